@@ -7,6 +7,8 @@ uniform vec3 cameraUp;
 uniform float fovRad;
 uniform float aspect;
 
+#define NO_CLOUD_DEPTH 1e+3 // Depth stored for rays that hit no cloud
+
 vec3 spawnRay(vec2 tc) {
     vec2 uv = tc * 2.0 - 1.0; // [0, 1] -> [-1, 1]
     uv.x *= aspect;
@@ -22,4 +24,19 @@ vec3 spawnRay(vec2 tc) {
     return rayDir;
 }
 
+// Inverse of spawnRay for the given camera, returns the texture coordinates of a world position
+vec2 projectToScreen(vec3 worldPos, vec3 eye, vec3 center, vec3 camUp, float fov, float aspectRatio) {
+    vec3 forward = normalize(center - eye);
+    vec3 left = normalize(cross(forward, camUp));
+    vec3 up = -cross(left, forward);
+    vec3 d = worldPos - eye;
+    float z = dot(d, forward);
+    if (z <= 0.0) {
+        return vec2(-1.0);
+    }
+    vec2 uv = vec2(dot(d, left), dot(d, up)) / (z * tan(fov * 0.5));
+    uv.x /= aspectRatio;
+    return uv * 0.5 + 0.5;
+}
+
 #endif // CAMERA_GLSL
\ No newline at end of file
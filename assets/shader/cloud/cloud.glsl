@@ -6,6 +6,7 @@
 #define RR_MIN_SAMPLES 50
 #define RR_PROBABILITY 0.5
 #define EXTINCTION_MULT 0.1
+#define CLOUD_BOX_SIZE 0.5 // Edge length of the box marched by quad.frag and covered by the light volume
 
 uniform vec3 cloudColor;
 uniform float absorption;
@@ -22,19 +23,20 @@ uniform vec3 lightColor;
 uniform float henyeyGreen_G;
 uniform float henyeyGreen_K;
 
-uniform sampler3D voronoiTex;
+uniform sampler3D voronoiTex; // Seamless tiles, sampled with GL_REPEAT
 uniform sampler3D fbmTex;
+uniform float period; // Texture coordinates covered by one noise tile
 
 const vec3 wind1 = vec3(0.06, 0.0, 0.02);
 const vec3 wind2 = vec3(0.12, 0.0, -0.08);
 
 float sampleFBM(vec3 pos) {
-    vec3 uvw = pos + 0.5;
+    vec3 uvw = (pos + 0.5) / period;
     return 1.0 - texture(voronoiTex, uvw).r; 
 }
 
 float samplePerlin(vec3 pos) {
-    vec3 uvw = pos + 0.5;
+    vec3 uvw = (pos + 0.5) / period;
     return texture(fbmTex, uvw).r; 
 }
 
@@ -0,0 +1,13 @@
+#version 450
+
+in vec3 pos;
+in vec3 norm;
+in vec2 tc;
+
+out vec4 fragColor;
+
+uniform sampler2D image;
+
+void main() {
+    fragColor = texture(image, tc);
+}
\ No newline at end of file
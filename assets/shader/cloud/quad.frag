@@ -14,13 +14,17 @@ in vec3 pos;
 in vec3 norm;
 in vec2 tc;
 
-out vec4 fragColor;
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out float cloudDepth; // Opacity weighted distance of the cloud along the ray
 
 uniform float dt;
 uniform float time;
 
 uniform float exposure;
 uniform float gamma;
+uniform vec2 pixelJitter; // Sub pixel offset of this frame's rays in texture coordinates
+
+uniform sampler3D lightVolume; // Transmittance towards the light, see lightVolume.comp
 
 const vec3 cuboidSize = vec3(1, 1, 1);
 
@@ -43,7 +47,8 @@ float map(vec3 p) {
 }
 
 void main() {
-    vec3 rayDir = spawnRay(tc);
+    vec3 rayDir = spawnRay(tc + pixelJitter);
+    cloudDepth = NO_CLOUD_DEPTH;
 
     float t = 0.0;
     bool hit = false;
@@ -62,6 +67,7 @@ void main() {
 
     if (hit) {
         fragColor = vec4(cameraEye + rayDir * t, 1.0);
+        cloudDepth = t;
     } else {
         fragColor = vec4(0.0, 0.0, 0.0, 1.0);
     }
@@ -71,7 +77,7 @@ void main() {
     // Compute ray direction from camera to current fragment
     vec3 rayStart;
     vec3 rayStop;
-    if (!intersectCuboid(cameraEye, rayDir, vec3(0.5), rayStart, rayStop)) {
+    if (!intersectCuboid(cameraEye, rayDir, vec3(CLOUD_BOX_SIZE), rayStart, rayStop)) {
         discard;
     }
     rayStart += 1e-5 * rayDir;
@@ -86,6 +92,8 @@ void main() {
 
     vec3 color = vec3(0);
     float cloudTransparency = 1.0;
+    float depthSum = 0.0;
+    float depthWeight = 0.0;
     for (int i = 0; i < numSteps && cloudTransparency > TRANSPARENCY_EARLY_EXIT_THRES && i < MAX_RAY_STEPS; ++i) {
 
         // Random jitter inside step range to prevent banding
@@ -93,31 +101,14 @@ void main() {
         float t = (float(i) + (outerRandom - 0.5) * 0.5) * sampleStepSize;
         vec3 samplePos = rayStart + rayDir * t;
         float cloudDensity = sampleStepSize * sampleDensity(samplePos, time);
+        float prevTransparency = cloudTransparency;
         cloudTransparency *= 1.0 - beersPowder(cloudDensity);
+        depthSum += (prevTransparency - cloudTransparency) * distance(cameraEye, samplePos);
+        depthWeight += prevTransparency - cloudTransparency;
 
-        // Sample illumination along ray to light source
+        // Transmittance towards the light from the precomputed light volume
         vec3 lightRayDir = normalize(lightPosition - samplePos);
-        vec3 lightRayStart = samplePos + 1e-3 * lightRayDir;
-        vec3 lightRayStartDiscard; // TODO 
-        vec3 lightRayStop;
-        if (!intersectCuboid(lightRayStart, lightRayDir, vec3(0.5), lightRayStartDiscard, lightRayStop)) {
-            continue;
-        }
-        float lightDistance = distance(lightRayStop, samplePos);
-        int numLightSteps = int(lightDistance / sampleStepSize); // TODO Make step size of light samples configurable
-        float lightTransparency = 1.0;
-        for (int j = 0; j < numLightSteps && lightTransparency > TRANSPARENCY_EARLY_EXIT_THRES && j < MAX_RAY_STEPS; ++j) {
-            float innerRandom = rnd(vec2(rnd(gl_FragCoord.xy), float(j)));
-            t = (float(j) + (innerRandom - 0.5) * 0.5) * sampleStepSize;
-            vec3 lightSamplePos = samplePos + t * lightRayDir; // TODO Here too
-            float lightDensity = sampleStepSize * sampleDensity(lightSamplePos, time);
-            lightTransparency *= 1.0 - multipleOctaveScattering(lightDensity, henyeyGreen_G);
-
-            // Heuristic early ray stop optimization
-            if(russianRoulette(j, vec2(outerRandom, innerRandom))) {
-                break;
-            }
-        }    
+        float lightTransparency = texture(lightVolume, samplePos / CLOUD_BOX_SIZE + 0.5).r;
 
         float cosTheta = acos(abs(dot(lightRayDir, -rayDir)));
         // Include backwards scattering component
@@ -143,6 +134,9 @@ void main() {
     }
 
     float opacity = 1.0 - cloudTransparency;
+    if (depthWeight > 1e-4) {
+        cloudDepth = depthSum / depthWeight;
+    }
     
 
     if (showFBM || showVoronoi) {
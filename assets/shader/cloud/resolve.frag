@@ -0,0 +1,80 @@
+#version 450
+
+#include "camera.glsl"
+
+in vec3 pos;
+in vec3 norm;
+in vec2 tc;
+
+layout(location = 0) out vec4 fragColor;
+layout(location = 1) out float cloudDepth;
+
+// Reduced resolution march of this frame
+uniform sampler2D currentColor;
+uniform sampler2D currentDepth;
+uniform vec2 pixelJitter;
+
+// Full resolution result of the previous frame and the camera it was rendered with
+uniform sampler2D historyColor;
+uniform sampler2D historyDepth;
+uniform bool useHistory;
+uniform float historyWeight;
+uniform vec3 prevCameraEye;
+uniform vec3 prevCameraCenter;
+uniform vec3 prevCameraUp;
+uniform float prevFovRad;
+uniform float prevAspect;
+
+void main() {
+    // Upsample the march, preferring low resolution samples with similar depth and opacity
+    // as the closest one so cloud borders are not blurred into the background
+    vec2 lowSize = vec2(textureSize(currentColor, 0));
+    vec2 p = (tc - pixelJitter) * lowSize - 0.5;
+    vec2 p0 = floor(p);
+    vec2 f = p - p0;
+    ivec2 nearest = ivec2(clamp(round(p), vec2(0), lowSize - 1));
+    float refDepth = texelFetch(currentDepth, nearest, 0).r;
+    float refOpacity = texelFetch(currentColor, nearest, 0).a;
+
+    vec4 color = vec4(0);
+    float depth = 0;
+    float weightSum = 0;
+    vec4 minColor = vec4(1e+9);
+    vec4 maxColor = vec4(-1e+9);
+    for (int i = 0; i < 4; i++) {
+        ivec2 offset = ivec2(i & 1, i >> 1);
+        ivec2 texel = clamp(ivec2(p0) + offset, ivec2(0), ivec2(lowSize) - 1);
+        vec4 c = texelFetch(currentColor, texel, 0);
+        float d = texelFetch(currentDepth, texel, 0).r;
+
+        vec2 bilinear = mix(1 - f, f, vec2(offset));
+        float similarity = exp(-abs(d - refDepth) / (0.1 * refDepth + 1e-3) - 4 * abs(c.a - refOpacity));
+        float w = bilinear.x * bilinear.y * similarity + 1e-5;
+        color += w * c;
+        depth += w * d;
+        weightSum += w;
+        minColor = min(minColor, c);
+        maxColor = max(maxColor, c);
+    }
+    color /= weightSum;
+    depth /= weightSum;
+
+    // Reproject into the previous frame and accumulate where the history saw the same surface
+    if (useHistory) {
+        vec3 worldPos = cameraEye + spawnRay(tc) * depth;
+        vec2 prevTC = projectToScreen(worldPos, prevCameraEye, prevCameraCenter, prevCameraUp, prevFovRad, prevAspect);
+        if (all(greaterThanEqual(prevTC, vec2(0))) && all(lessThanEqual(prevTC, vec2(1)))) {
+            vec4 history = texture(historyColor, prevTC);
+            float prevDepth = texture(historyDepth, prevTC).r;
+            float expectedDepth = distance(prevCameraEye, worldPos);
+            bool background = depth >= 0.5 * NO_CLOUD_DEPTH && prevDepth >= 0.5 * NO_CLOUD_DEPTH;
+            if (background || abs(prevDepth - expectedDepth) < 0.1 * expectedDepth) {
+                // Clamping to this frame's neighbourhood removes stale history
+                color = mix(color, clamp(history, minColor, maxColor), historyWeight);
+            }
+        }
+    }
+
+    fragColor = color;
+    cloudDepth = depth;
+}
\ No newline at end of file
@@ -7,7 +7,19 @@ out vec4 fragColor;
 
 uniform vec3 cameraPos;
 uniform int ddaDepth;
-const vec3 lightDir = normalize(vec3(-1));
+uniform int detailScale; // 1 marches the simulation grid, otherwise the upsampled detail field
+uniform sampler3D detailField;
+uniform bool emptySpaceSkipping;
+const float emptyDensity = 1e-4; // Macro cells below this density are skipped
+uniform sampler3D lightVolume; // Transmittance towards the light per cell
+uniform bool selfShadowing;
+uniform float shadowAmbient;
+uniform sampler3D smokeVolume; // Density and speed per cell, written by copySmokeBuffer, and its mip chain
+uniform float marchStepSize; // Continuous march step in cells when interpolating
+uniform bool levelOfDetail; // Sample coarser levels of the smoke volume with longer steps where cells get smaller than pixels
+uniform float pixelFootprint; // Width of a pixel at unit distance from the camera
+uniform float lodBias; // Added to the level picked from the footprint
+uniform int smokeLevels;
 
 vec3 getCuboidExitPos(vec3 origin, vec3 dir, vec3 cuboidSize) {
     vec3 t1 = (-cuboidSize - origin) / dir;
@@ -17,10 +29,96 @@ vec3 getCuboidExitPos(vec3 origin, vec3 dir, vec3 cuboidSize) {
     return origin + tExit * dir;
 }
 
+vec3 shadeObstacle(vec3 normal, vec3 rayDir) {
+    vec3 ambientColor = vec3(0.24725, 0.2245, 0.0645);
+    vec3 diffuseColor = vec3(0.34615, 0.3143, 0.0903);
+    vec3 specularColor = vec3(0.797357, 0.723991, 0.208006);
+    float shininess = 83.2;
+
+    // Blinn-Phong shading
+    vec3 viewDir = rayDir;
+    vec3 halfVector = normalize(lightDirection + viewDir);
+
+    vec3 ambient = ambientColor;
+    vec3 diffuse = max(dot(lightDirection, normal), 0.0) * diffuseColor;
+    vec3 specular = pow(max(dot(normal, halfVector), 0.0), shininess) * specularColor;
+    return ambient + diffuse + specular;
+}
+
+// Marches in fixed steps through the trilinearly filtered smoke volume instead of
+// visiting every cell, obstacles and empty macro cells are still resolved per cell.
+// With level of detail the step grows with the distance to the camera, together with
+// the mip level it samples, so a ray takes about one sample per pixel sized footprint.
+vec3 marchSmokeVolume(vec3 rayDir, vec3 start, float tStop, float cellSize, vec3 cuboidSize, vec3 background) {
+    vec3 smoke = vec3(0);
+    vec3 velocity = vec3(0);
+    vec3 pressure = vec3(0);
+    float transmittance = 1;
+    int maxSteps = int(ddaDepth / marchStepSize);
+
+    float t = 0.5 * marchStepSize * cellSize;
+    for (int i = 0; i < maxSteps && t < tStop; i++) {
+        vec3 p = start + t * rayDir;
+        float level = 0;
+        if (levelOfDetail) {
+            float footprint = pixelFootprint * distance(cameraPos, p);
+            level = clamp(log2(footprint / cellSize) + lodBias, 0, smokeLevels - 1);
+        }
+        float stepCells = marchStepSize * exp2(level);
+        float stepSize = stepCells * cellSize;
+        ivec3 cellID = ivec3(clamp(floor((p + 0.5 * cuboidSize) / cellSize), vec3(0), gridResolution - 1));
+
+        // Leap to the first step behind an empty macro cell
+        ivec3 macroID = cellID / MACRO_CELL_SIZE;
+        if (emptySpaceSkipping && loadOccupancy(macroID) <= emptyDensity) {
+            vec3 exitFace = (macroID * MACRO_CELL_SIZE + step(0, rayDir) * MACRO_CELL_SIZE) * cellSize - 0.5 * cuboidSize;
+            vec3 tExits = (exitFace - start) / rayDir;
+            float tExit = min(tExits.x, min(tExits.y, tExits.z));
+            t += max(ceil((tExit - t) / stepSize), 1) * stepSize;
+            continue;
+        }
+
+        // Obstacle, shaded at the face the ray entered the cell through
+        if (loadField(cellID.x, cellID.y, cellID.z, S_FIELD) < 1.f) {
+            vec3 cellMin = cellID * cellSize - 0.5 * cuboidSize;
+            vec3 tNear = min((cellMin - start) / rayDir, (cellMin + cellSize - start) / rayDir);
+            vec3 normal = vec3(0);
+            if (tNear.x >= tNear.y && tNear.x >= tNear.z) normal.x = -sign(rayDir.x);
+            else if (tNear.y >= tNear.z) normal.y = -sign(rayDir.y);
+            else normal.z = -sign(rayDir.z);
+
+            vec3 obstacle = shadeObstacle(normal, rayDir);
+            return showPressureField ? pressure + transmittance * obstacle
+                 : showVelocityField ? velocity + transmittance * obstacle
+                 : smoke + transmittance * obstacle;
+        }
+
+        vec3 uvw = (p + 0.5 * cuboidSize) / cuboidSize;
+        vec2 densitySpeed = textureLod(smokeVolume, uvw, level).rg;
+
+        // thickness is the opacity of a whole cell
+        float alpha = thickness * densitySpeed.r;
+        float light = 1;
+        if (selfShadowing && alpha > 0) {
+            light = mix(shadowAmbient, 1, texture(lightVolume, uvw).r);
+        }
+        smoke += stepCells * alpha * light;
+        velocity += stepCells * alpha * densitySpeed.g;
+        if (showPressureField && densitySpeed.r > 0) {
+            pressure += stepCells * densitySpeed.r * loadField(cellID.x, cellID.y, cellID.z, P_FIELD);
+        }
+        transmittance *= pow(1 - alpha, stepCells);
+        t += stepSize;
+    }
+
+    return (showPressureField ? pressure : showVelocityField ? velocity : smoke) + transmittance * background;
+}
+
 void main() {
     vec3 rayDir = normalize(pos - cameraPos);
-    float cellSize = 1 / max(gridResolution.x, max(gridResolution.y, gridResolution.z));
-    vec3 cuboidSize = gridResolution * cellSize;
+    vec3 marchResolution = gridResolution * detailScale;
+    float cellSize = 1 / max(marchResolution.x, max(marchResolution.y, marchResolution.z));
+    vec3 cuboidSize = marchResolution * cellSize;
 
     // Compute world space ray entry and exit positions
     vec3 start = pos;
@@ -28,10 +126,10 @@ void main() {
 
     // Convert world positions to voxel indices
     ivec3 startID = ivec3(
-        clamp((start + 0.5 * cuboidSize) / cellSize, vec3(0), gridResolution - 1)
+        clamp((start + 0.5 * cuboidSize) / cellSize, vec3(0), marchResolution - 1)
     );
     ivec3 stopID = ivec3(
-        clamp((stop + 0.5 * cuboidSize) / cellSize, vec3(0), gridResolution - 1)
+        clamp((stop + 0.5 * cuboidSize) / cellSize, vec3(0), marchResolution - 1)
     );
 
     // Step direction: +1 or -1 depending on ray direction
@@ -57,61 +155,98 @@ void main() {
     vec3 pressure = vec3(0);
     float transmittance = 1;
 
-    for (int i = 0; i < ddaDepth; i++) {
+    // Only the fields shown by the active view are loaded
+    bool needVelocity = showVelocityField && !showPressureField;
+    bool needPressure = showPressureField;
+    float tStop = dot(stop - pos, rayDir);
+    int macroVoxels = MACRO_CELL_SIZE * detailScale;
+
+    if ((interpolate || levelOfDetail) && detailScale == 1) {
+        fragColor = vec4(marchSmokeVolume(rayDir, start, tStop, cellSize, cuboidSize, background), 1.0);
+        return;
+    }
+
+    for (int i = 0; i < ddaDepth * detailScale; i++) {
+
+        // Simulation cell containing the current voxel
+        ivec3 cellID = voxelID / detailScale;
 
-        float alpha, m, u, v, w, p;
-        if (interpolate) 
+        // Leap over macro cells without smoke and obstacles
+        ivec3 macroID = cellID / MACRO_CELL_SIZE;
+        if (emptySpaceSkipping && loadOccupancy(macroID) <= emptyDensity) {
+            ivec3 macroBegin = macroID * macroVoxels;
+            vec3 exitFace = (macroBegin + step(0, rayDir) * macroVoxels) * cellSize - 0.5 * cuboidSize;
+            vec3 tExits = (exitFace - pos) / rayDir;
+            float tExit = min(tExits.x, min(tExits.y, tExits.z));
+            if (tExit >= tStop) {
+                smoke += transmittance * background;
+                velocity += transmittance * background;
+                pressure += transmittance * background;
+                break;
+            }
+
+            // Voxel behind the exit face, stepping explicitly on the exit axis to avoid rounding back
+            move = equal(tExits, vec3(tExit));
+            move = bvec3(move.x, move.y && !move.x, move.z && !move.x && !move.y);
+            vec3 exitPos = (pos + tExit * rayDir + 0.5 * cuboidSize) / cellSize;
+            ivec3 nextID = ivec3(clamp(floor(exitPos), vec3(0), marchResolution - 1));
+            ivec3 stepped = macroBegin + ivec3(step(0, rayDir)) * (macroVoxels + 1) - 1;
+            voxelID = clamp(ivec3(mix(vec3(nextID), vec3(stepped), vec3(move))), ivec3(0), ivec3(marchResolution) - 1);
+            tMax = ((voxelID + step(0, rayDir)) * cellSize - 0.5 * cuboidSize - pos) / rayDir;
+            continue;
+        }
+
+        float alpha, m;
+        float u = 0, v = 0, w = 0, p = 0;
+        if (detailScale > 1)
         {
-            // TODO How should be interpolated and how do I get rid of the visible voxel boundaries
-            vec3 voxelCenter = vec3(voxelID) * gridSpacing;
+            // Detail voxels are thinner, so each contributes proportionally less opacity
+            m = texelFetch(detailField, voxelID, 0).r;
+            alpha = thickness * (1 - m) / detailScale;
 
-            // Smoke 
-            m = sampleField(voxelCenter.x, voxelCenter.y, voxelCenter.z, M_FIELD);
-            alpha = thickness * (1 - m);
-    
-            // Velocity
-            u = sampleField(voxelCenter.x, voxelCenter.y, voxelCenter.z, U_FIELD);
-            v = sampleField(voxelCenter.x, voxelCenter.y, voxelCenter.z, V_FIELD);
-            w = sampleField(voxelCenter.x, voxelCenter.y, voxelCenter.z, W_FIELD);
-            
-            // Pressure
-            p = sampleField(voxelCenter.x, voxelCenter.y, voxelCenter.z, P_FIELD);
-        } else {
+            if (needVelocity && alpha > 0) {
+                u = loadField(cellID.x, cellID.y, cellID.z, U_FIELD);
+                v = loadField(cellID.x, cellID.y, cellID.z, V_FIELD);
+                w = loadField(cellID.x, cellID.y, cellID.z, W_FIELD);
+            }
+            if (needPressure && m < 1) {
+                p = loadField(cellID.x, cellID.y, cellID.z, P_FIELD);
+            }
+        }
+        else
+        {
             // Smoke 
             m = loadField(voxelID.x, voxelID.y, voxelID.z, M_FIELD);
             alpha = thickness * (1 - m);
 
             // Velocity
-            u = loadField(voxelID.x, voxelID.y, voxelID.z, U_FIELD);
-            v = loadField(voxelID.x, voxelID.y, voxelID.z, V_FIELD);
-            w = loadField(voxelID.x, voxelID.y, voxelID.z, W_FIELD);
+            if (needVelocity && alpha > 0) {
+                u = loadField(voxelID.x, voxelID.y, voxelID.z, U_FIELD);
+                v = loadField(voxelID.x, voxelID.y, voxelID.z, V_FIELD);
+                w = loadField(voxelID.x, voxelID.y, voxelID.z, W_FIELD);
+            }
 
             // Pressure
-            p = loadField(voxelID.x, voxelID.y, voxelID.z, P_FIELD);
+            if (needPressure && m < 1) {
+                p = loadField(voxelID.x, voxelID.y, voxelID.z, P_FIELD);
+            }
+        }
+
+        // Light reaching this voxel through the smoke between it and the light
+        float light = 1;
+        if (selfShadowing && alpha > 0) {
+            light = mix(shadowAmbient, 1, texture(lightVolume, (vec3(voxelID) + 0.5) / marchResolution).r);
         }
 
-        smoke += alpha;
+        smoke += alpha * light;
         velocity += alpha * vec3(u, v, w);
         pressure += (1 - m) * p;
 
         // Obstacle
-        float s = loadField(voxelID.x, voxelID.y, voxelID.z, S_FIELD);
+        float s = loadField(cellID.x, cellID.y, cellID.z, S_FIELD);
         if (s < 1.f) {
             vec3 normal = normalize(-sign(tMax) * vec3(move));
-            vec3 ambientColor = vec3(0.24725, 0.2245, 0.0645);
-            vec3 diffuseColor = vec3(0.34615, 0.3143, 0.0903);
-            vec3 specularColor = vec3(0.797357, 0.723991, 0.208006);
-            float shininess = 83.2;
-            
-            // Blinn-Phong shading
-            vec3 viewDir = rayDir;
-            vec3 halfVector = normalize(lightDir + viewDir);
-            
-            vec3 ambient = ambientColor;
-            vec3 diffuse = max(dot(lightDir, normal), 0.0) * diffuseColor;
-            vec3 specular = pow(max(dot(normal, halfVector), 0.0), shininess) * specularColor;
-            
-            vec3 obstacle = ambient + diffuse + specular;
+            vec3 obstacle = shadeObstacle(normal, rayDir);
             smoke += transmittance * obstacle;
             velocity += transmittance * obstacle;
             pressure += transmittance * obstacle;
@@ -0,0 +1,40 @@
+#include "smokeHeader.glsl"
+
+// Texture coordinates in coarse cell units, advected with the flow so the
+// synthesized detail moves with the smoke instead of sliding through it
+layout(std430, binding = 15) buffer texCoordField {
+    vec4 texCoord[];
+};
+
+layout(std430, binding = 16) buffer nextTexCoordField {
+    vec4 nextTexCoord[];
+};
+
+uniform int detailScale;
+uniform float detailStrength;
+uniform float detailFrequency;
+uniform bool resetTexCoords;
+
+// Same layout as the cell centered fields
+int cellIndex(ivec3 id) {
+    return id.z * int(gridResolution.x * gridResolution.y) + id.x * int(gridResolution.y) + id.y;
+}
+
+vec3 loadTexCoord(ivec3 id) {
+    id = clamp(id, ivec3(0), ivec3(gridResolution) - 1);
+    return texCoord[cellIndex(id)].xyz;
+}
+
+// Trilinear lookup, pos in cell units with cell centers at +0.5
+vec3 sampleTexCoord(vec3 pos) {
+    vec3 p = clamp(pos - 0.5, vec3(0), gridResolution - 1);
+    ivec3 i0 = ivec3(floor(p));
+    vec3 t = p - vec3(i0);
+
+    vec3 c00 = mix(loadTexCoord(i0), loadTexCoord(i0 + ivec3(1, 0, 0)), t.x);
+    vec3 c10 = mix(loadTexCoord(i0 + ivec3(0, 1, 0)), loadTexCoord(i0 + ivec3(1, 1, 0)), t.x);
+    vec3 c01 = mix(loadTexCoord(i0 + ivec3(0, 0, 1)), loadTexCoord(i0 + ivec3(1, 0, 1)), t.x);
+    vec3 c11 = mix(loadTexCoord(i0 + ivec3(0, 1, 1)), loadTexCoord(i0 + ivec3(1, 1, 1)), t.x);
+
+    return mix(mix(c00, c10, t.y), mix(c01, c11, t.y), t.z);
+}
\ No newline at end of file
@@ -0,0 +1,33 @@
+#include "smokeHeader.glsl"
+
+// Exchange of one cell thick halos between grids split along z.
+// Each region holds two (x, y) layers per field: the cell layer next to the
+// interface and, for w, the face above it. Only fields in haloFields are touched.
+#define SEND_LOWER 0
+#define SEND_UPPER 1
+#define RECEIVE_LOWER 2
+#define RECEIVE_UPPER 3
+#define HALO_FIELDS 14
+
+layout(std430, binding = 17) buffer haloField {
+    float halo[];
+};
+
+uniform int haloFields; // Bit mask of field ids
+uniform bool hasLower; // Grid has a neighbour below, its z = 0 layer is a halo
+uniform bool hasUpper; // Grid has a neighbour above, its top layer is a halo
+uniform int projectionPass; // Checkerboard pass of the projection, -1 for all other stages
+
+int haloIndex(int region, int field, int layer, ivec2 xy) {
+    int slot = int((gridResolution.x + 1) * (gridResolution.y + 1));
+    return ((region * HALO_FIELDS + field) * 2 + layer) * slot + xy.y * int(gridResolution.x + 1) + xy.x;
+}
+
+bool isFaceW(int field) {
+    return field == W_FIELD || field == NEXT_W_FIELD || field == AUX_W_FIELD;
+}
+
+// Whether the cell was updated in the current projection pass (see forceIncompressibility.comp)
+bool isProjected(ivec2 xy, int z) {
+    return projectionPass >= 0 && ((xy.x + xy.y + z + domainOffset.z) % 2) != projectionPass % 2;
+}
\ No newline at end of file
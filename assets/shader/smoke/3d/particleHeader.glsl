@@ -0,0 +1,65 @@
+#include "smokeHeader.glsl"
+
+// Particles of the PIC/FLIP advection mode. They are binned by cell with a counting sort every
+// substep, so splatting to the grid is a gather over the particles of the neighbouring cells.
+#define PARTICLE_GROUP_SIZE 256
+
+struct Particle {
+    vec4 position; // World position, w holds the carried smoke value (1 where there is none)
+    vec4 velocity; // w is 1 for live particles, dead slots are free for emission
+};
+
+layout(std430, binding = 21) buffer particleBuffer {
+    Particle particles[];
+};
+
+// Particles ordered by bin, written by sortParticles.comp
+layout(std430, binding = 22) buffer sortedParticleBuffer {
+    Particle sortedParticles[];
+};
+
+// Bin and rank inside the bin of every particle
+layout(std430, binding = 23) buffer particleBinBuffer {
+    uvec2 particleBins[];
+};
+
+layout(std430, binding = 24) buffer binCountBuffer {
+    uint binCount[];
+};
+
+// Exclusive prefix sum of binCount, the entry behind the last bin holds the total
+layout(std430, binding = 25) buffer binStartBuffer {
+    uint binStart[];
+};
+
+// Per workgroup sums of the prefix scan
+layout(std430, binding = 26) buffer scanBlockBuffer {
+    uint scanBlockSums[];
+};
+
+uniform uint particleCapacity;
+uniform float flipRatio; // 0 is pure PIC, 1 pure FLIP
+
+// One bin per cell followed by the bin of the dead particles, so after sorting the live
+// particles fill the front of the buffer and binStart[deadBin()] is the first free slot
+uint deadBin() {
+    return uint(gridResolution.x) * uint(gridResolution.y) * uint(gridResolution.z);
+}
+
+uint binTotal() {
+    return deadBin() + 1;
+}
+
+ivec3 particleCell(vec3 position) {
+    return clamp(ivec3(floor(position / instanceGridSpacing())), ivec3(0), ivec3(gridResolution) - 1);
+}
+
+uint cellBin(ivec3 cell) {
+    return uint(fieldIndex(cell.x, cell.y, cell.z, M_FIELD));
+}
+
+vec3 sampleVelocity(vec3 position, int u, int v, int w) {
+    return vec3(sampleField(position.x, position.y, position.z, u),
+                sampleField(position.x, position.y, position.z, v),
+                sampleField(position.x, position.y, position.z, w));
+}
\ No newline at end of file
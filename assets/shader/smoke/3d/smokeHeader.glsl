@@ -1,8 +1,11 @@
 #version 450
 
+// Default workgroup shape, programs specialized by the workgroup tuner inject their own
+#ifndef LOCAL_SIZE_X
 #define LOCAL_SIZE_X 8
 #define LOCAL_SIZE_Y 8
 #define LOCAL_SIZE_Z 16
+#endif
 
 #define U_FIELD 0
 #define V_FIELD 1
@@ -14,6 +17,15 @@
 #define P_FIELD 7
 #define M_FIELD 8
 #define NEXT_M_FIELD 9
+#define AUX_U_FIELD 10
+#define AUX_V_FIELD 11
+#define AUX_W_FIELD 12
+#define AUX_M_FIELD 13
+
+#define MACRO_CELL_SIZE 4 // Cells per axis summarized by one occupancy entry
+
+#define ADVECTION_SEMI_LAGRANGIAN 0
+#define ADVECTION_MACCORMACK 1
 
 layout(std430, binding = 0) buffer velocityFieldU {
     float velocityU[];
@@ -55,66 +67,193 @@ layout(std430, binding = 9) buffer nextSmokeField {
     float nextSmoke[];
 };
 
+// Scratch fields holding the corrected MacCormack result
+layout(std430, binding = 10) buffer auxVelocityFieldU {
+    float auxVelocityU[];
+};
+
+layout(std430, binding = 11) buffer auxVelocityFieldV {
+    float auxVelocityV[];
+};
+
+layout(std430, binding = 12) buffer auxVelocityFieldW {
+    float auxVelocityW[];
+};
+
+layout(std430, binding = 13) buffer auxSmokeField {
+    float auxSmoke[];
+};
+
+// Highest smoke density around each macro cell, 1 if it touches an obstacle
+layout(std430, binding = 18) buffer macroOccupancyField {
+    float macroOccupancy[];
+};
+
+// Specialized programs get the grid and the advection modes injected as constants,
+// so bounds checks and strides fold and the unused advection branches are removed
+#ifdef GRID_X
+const vec3 gridResolution = vec3(GRID_X, GRID_Y, GRID_Z);
+#else
 uniform vec3 gridResolution;
+#endif
+uniform ivec3 domainOffset; // Offset of this grid inside the whole domain when it is split across processes
+// Cells a moving window rose above the bottom of the domain. The fields are stored circularly
+// along z, so the slots of cells falling out at the bottom are recycled for the new top cells.
+uniform int windowOffset;
+uniform vec3 domainResolution; // Resolution of the whole domain
 uniform float dt; // delta time 
+#ifdef INSTANCES
+// Batched programs simulate INSTANCES independent grids in one dispatch, see instanceCell().
+// Every instance reads its solver parameters from its own block instead of the uniforms.
+struct InstanceParameters {
+    float gridSpacing;
+    float overrelaxation;
+    float density;
+};
+
+layout(std430, binding = 27) buffer instanceParameterBuffer {
+    InstanceParameters instanceParameters[];
+};
+
+// Instance of this invocation. Batched dispatches stack the instances along z, so it follows
+// from the invocation alone. Only compute shaders can be batched.
+int currentInstance() {
+    return int(gl_GlobalInvocationID.z) / INSTANCE_STRIDE_Z;
+}
+
+float instanceGridSpacing() { return instanceParameters[currentInstance()].gridSpacing; }
+float instanceOverrelaxation() { return instanceParameters[currentInstance()].overrelaxation; }
+float instanceDensity() { return instanceParameters[currentInstance()].density; }
+#else
 uniform float gridSpacing; // Grid spacing
 uniform float overrelaxation;
-uniform vec3 gravity;
 uniform float density;
+
+float instanceGridSpacing() { return gridSpacing; }
+float instanceOverrelaxation() { return overrelaxation; }
+float instanceDensity() { return density; }
+#endif
+uniform vec3 gravity;
 uniform int currentIteration;
 uniform int totalIterations;
 uniform bool showVelocityField;
 uniform bool showPressureField;
 uniform bool interpolate;
 uniform bool reset;
+#ifdef VELOCITY_ADVECTION
+#define velocityAdvection VELOCITY_ADVECTION
+#else
+uniform int velocityAdvection;
+#endif
+#ifdef SMOKE_ADVECTION
+#define smokeAdvection SMOKE_ADVECTION
+#else
+uniform int smokeAdvection;
+#endif
+#ifdef WARM_START
+#define warmStart bool(WARM_START)
+#else
+uniform bool warmStart; // Keep the pressure of the last step as initial guess of the projection
+#endif
 
 uniform float thickness;
+uniform vec3 lightDirection; // Direction towards the light
 
 const float maxVelocity = 100.f;
 
-float loadField(int x, int y, int z, int field) {
-    // Check bounds and calculate index
-    int idx = -1;
+// Grid cell of a global invocation. Batched programs stack the instances along the z axis of
+// the dispatch, each one INSTANCE_STRIDE_Z invocations deep. The stride is a multiple of the
+// workgroup depth, so no workgroup spans two instances.
+ivec3 instanceCell(uvec3 invocation) {
+    ivec3 id = ivec3(invocation);
+#ifdef INSTANCES
+    id.z -= currentInstance() * INSTANCE_STRIDE_Z;
+#endif
+    return id;
+}
+
+// Index of a cell in the buffer of a field inside one grid, -1 outside of the field
+int gridIndex(int x, int y, int z, int field) {
+    int X = int(gridResolution.x);
+    int Y = int(gridResolution.y);
+    int Z = int(gridResolution.z);
     switch (field) {
         case U_FIELD:
         case NEXT_U_FIELD:
-            if (x < 0 || x > int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return 0.f;
+        case AUX_U_FIELD:
+            if (x < 0 || x > X || y < 0 || y >= Y || z < 0 || z >= Z) {
+                return -1;
             }
-            idx = z * int((gridResolution.x + 1) * gridResolution.y) + y * int(gridResolution.x + 1) + x;
-            break;
+            z = (z + windowOffset) % Z;
+            return z * ((X + 1) * Y) + y * (X + 1) + x;
 
         case V_FIELD:
         case NEXT_V_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y > int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return 0.f;
+        case AUX_V_FIELD:
+            if (x < 0 || x >= X || y < 0 || y > Y || z < 0 || z >= Z) {
+                return -1;
             }
-            idx = z * int(gridResolution.x * (gridResolution.y + 1)) + x * int(gridResolution.y + 1) + y;
-            break;
+            z = (z + windowOffset) % Z;
+            return z * (X * (Y + 1)) + x * (Y + 1) + y;
 
         case W_FIELD:
         case NEXT_W_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z > int(gridResolution.z)) {
-                return 0.f;
+        case AUX_W_FIELD:
+            if (x < 0 || x >= X || y < 0 || y >= Y || z < 0 || z > Z) {
+                return -1;
             }
-            idx = x * int(gridResolution.y * (gridResolution.z + 1)) + y * int(gridResolution.z + 1) + z;
-            break;
+            // Faces cycle through Z + 1 slots, like the cells through Z
+            z = (z + windowOffset) % (Z + 1);
+            return x * (Y * (Z + 1)) + y * (Z + 1) + z;
 
-        case S_FIELD:
-        case P_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return 0.f;
+        default:
+            if (x < 0 || x >= X || y < 0 || y >= Y || z < 0 || z >= Z) {
+                return -1;
             }
-            idx = z * int(gridResolution.x * gridResolution.y) + x * int(gridResolution.y) + y;
-            break;
+            z = (z + windowOffset) % Z;
+            return z * (X * Y) + x * Y + y;
+    }
+}
 
-        case M_FIELD:
-        case NEXT_M_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return 1.f;
-            }
-            idx = z * int(gridResolution.x * gridResolution.y) + x * int(gridResolution.y) + y;
-            break;
+// Index of a cell in the buffer of a field, -1 outside of the field. The grids of batched
+// instances lie one after another in every buffer.
+int fieldIndex(int x, int y, int z, int field) {
+    int idx = gridIndex(x, y, z, field);
+#ifdef INSTANCES
+    if (idx >= 0) {
+        ivec3 size = ivec3(gridResolution);
+        switch (field) {
+            case U_FIELD:
+            case NEXT_U_FIELD:
+            case AUX_U_FIELD:
+                size.x++;
+                break;
+            case V_FIELD:
+            case NEXT_V_FIELD:
+            case AUX_V_FIELD:
+                size.y++;
+                break;
+            case W_FIELD:
+            case NEXT_W_FIELD:
+            case AUX_W_FIELD:
+                size.z++;
+                break;
+        }
+        idx += currentInstance() * size.x * size.y * size.z;
+    }
+#endif
+    return idx;
+}
+
+float loadField(int x, int y, int z, int field) {
+    int idx = fieldIndex(x, y, z, field);
+    if (idx < 0) {
+        // Below a window that left the bottom of the domain lies open air the smoke flows out to
+        if (field == S_FIELD && z < 0 && windowOffset > 0) {
+            return 1.f;
+        }
+        // Smoke is 1 where there is none
+        return field == M_FIELD || field == NEXT_M_FIELD || field == AUX_M_FIELD ? 1.f : 0.f;
     }
 
     // Lookup value
@@ -139,53 +278,22 @@ float loadField(int x, int y, int z, int field) {
             return smoke[idx];
         case NEXT_M_FIELD:
             return nextSmoke[idx];
+        case AUX_U_FIELD:
+            return auxVelocityU[idx];
+        case AUX_V_FIELD:
+            return auxVelocityV[idx];
+        case AUX_W_FIELD:
+            return auxVelocityW[idx];
+        case AUX_M_FIELD:
+            return auxSmoke[idx];
     }
     return 0.f;
 }
 
 void saveField(int x, int y, int z, int field, float value) {
-    // Check bounds and calculate index
-    int idx = -1;
-    switch (field) {
-        case U_FIELD:
-        case NEXT_U_FIELD:
-            if (x < 0 || x > int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return;
-            }
-            idx = z * int(gridResolution.y * (gridResolution.x + 1)) + y * int(gridResolution.x + 1) + x;
-            break;
-
-        case V_FIELD:
-        case NEXT_V_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y > int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return;
-            }
-            idx = z * int(gridResolution.x * (gridResolution.y + 1)) + x * int(gridResolution.y + 1) + y;
-            break;
-
-        case W_FIELD:
-        case NEXT_W_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z > int(gridResolution.z)) {
-                return;
-            }
-            idx = y * int(gridResolution.x * (gridResolution.z + 1)) + x * int(gridResolution.z + 1) + z;
-            break;
-
-        case S_FIELD:
-        case P_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return;
-            }
-            idx = z * int(gridResolution.x * gridResolution.y) + x * int(gridResolution.y) + y;
-            break;
-
-        case M_FIELD:
-        case NEXT_M_FIELD:
-            if (x < 0 || x >= int(gridResolution.x) || y < 0 || y >= int(gridResolution.y) || z < 0 || z >= int(gridResolution.z)) {
-                return;
-            }
-            idx = z * int(gridResolution.x * gridResolution.y) + x * int(gridResolution.y) + y;
-            break;
+    int idx = fieldIndex(x, y, z, field);
+    if (idx < 0) {
+        return;
     }
 
     // Save value
@@ -220,11 +328,24 @@ void saveField(int x, int y, int z, int field, float value) {
         case NEXT_M_FIELD:
             nextSmoke[idx] = value;
             break;
+        case AUX_U_FIELD:
+            auxVelocityU[idx] = value;
+            break;
+        case AUX_V_FIELD:
+            auxVelocityV[idx] = value;
+            break;
+        case AUX_W_FIELD:
+            auxVelocityW[idx] = value;
+            break;
+        case AUX_M_FIELD:
+            auxSmoke[idx] = value;
+            break;
     }
 }
 
-float sampleField(float x, float y, float z, int field) {
-    float h = gridSpacing;
+// Gathers the 8 grid values surrounding a world position and the trilinear weights between them
+void sampleCorners(float x, float y, float z, int field, out float c[8], out vec3 t) {
+    float h = instanceGridSpacing();
     float h1 = 1 / h;
     float h2 = h / 2;
 
@@ -238,18 +359,21 @@ float sampleField(float x, float y, float z, int field) {
     switch (field) {
         case U_FIELD:
         case NEXT_U_FIELD:
+        case AUX_U_FIELD:
             dy = h2;
             dz = h2;
             break;
 
         case V_FIELD:
         case NEXT_V_FIELD:
+        case AUX_V_FIELD:
             dx = h2;
             dz = h2;
             break;
 
         case W_FIELD:
         case NEXT_W_FIELD:
+        case AUX_W_FIELD:
             dx = h2;
             dy = h2;
             break;
@@ -258,6 +382,7 @@ float sampleField(float x, float y, float z, int field) {
         case P_FIELD:
         case M_FIELD:
         case NEXT_M_FIELD:
+        case AUX_M_FIELD:
             dx = h2;
             dy = h2;
             dz = h2;
@@ -276,28 +401,56 @@ float sampleField(float x, float y, float z, int field) {
     float tz = h1 * ((z - dz) - z0 * h);
     float z1 = min(z0 + 1, int(gridResolution.z) - 1);
 
-    float sx = 1 - tx;
-    float sy = 1 - ty;
-    float sz = 1 - tz;
+    t = vec3(tx, ty, tz);
+    c[0] = loadField(int(x0), int(y0), int(z0), field);
+    c[1] = loadField(int(x1), int(y0), int(z0), field);
+    c[2] = loadField(int(x0), int(y1), int(z0), field);
+    c[3] = loadField(int(x1), int(y1), int(z0), field);
+    c[4] = loadField(int(x0), int(y0), int(z1), field);
+    c[5] = loadField(int(x1), int(y0), int(z1), field);
+    c[6] = loadField(int(x0), int(y1), int(z1), field);
+    c[7] = loadField(int(x1), int(y1), int(z1), field);
+}
+
+float sampleField(float x, float y, float z, int field) {
+    float c[8];
+    vec3 t;
+    sampleCorners(x, y, z, field, c, t);
+    vec3 s = 1 - t;
+
+    float c00 = s.x * c[0] + t.x * c[1];
+    float c10 = s.x * c[2] + t.x * c[3];
+    float c01 = s.x * c[4] + t.x * c[5];
+    float c11 = s.x * c[6] + t.x * c[7];
+
+    float c0 = s.y * c00 + t.y * c10;
+    float c1 = s.y * c01 + t.y * c11;
 
-    float c000 = loadField(int(x0), int(y0), int(z0), field);
-    float c100 = loadField(int(x1), int(y0), int(z0), field);
-    float c010 = loadField(int(x0), int(y1), int(z0), field);
-    float c110 = loadField(int(x1), int(y1), int(z0), field);
-    float c001 = loadField(int(x0), int(y0), int(z1), field);
-    float c101 = loadField(int(x1), int(y0), int(z1), field);
-    float c011 = loadField(int(x0), int(y1), int(z1), field);
-    float c111 = loadField(int(x1), int(y1), int(z1), field);
+    return s.z * c0 + t.z * c1;
+}
 
-    float c00 = sx * c000 + tx * c100;
-    float c10 = sx * c010 + tx * c110;
-    float c01 = sx * c001 + tx * c101;
-    float c11 = sx * c011 + tx * c111;
+// Min (x) and max (y) of the values a trilinear sample at this position interpolates between
+vec2 sampleFieldRange(float x, float y, float z, int field) {
+    float c[8];
+    vec3 t;
+    sampleCorners(x, y, z, field, c, t);
 
-    float c0 = sy * c00 + ty * c10;
-    float c1 = sy * c01 + ty * c11;
+    vec2 range = vec2(c[0]);
+    for (int i = 1; i < 8; i++) {
+        range = vec2(min(range.x, c[i]), max(range.y, c[i]));
+    }
+    return range;
+}
 
-    return sz * c0 + tz * c1;
+// Cell centered velocity used for transporting smoke
+vec3 smokeVelocity(ivec3 id) {
+    float u1 = loadField(id.x, id.y, id.z, U_FIELD);
+    float u2 = loadField(id.x + 1, id.y, id.z, U_FIELD);
+    float v1 = loadField(id.x, id.y, id.z, V_FIELD);
+    float v2 = loadField(id.x, id.y + 1, id.z, V_FIELD);
+    float w1 = loadField(id.x, id.y, id.z, W_FIELD);
+    float w2 = loadField(id.x, id.y, id.z + 1, W_FIELD);
+    return vec3(u1 + 0.5 * u2, v1 + 0.5 * v2, w1 + 0.5 * w2);
 }
 
 float avgU(int x, int y, int z) {
@@ -338,3 +491,16 @@ float avgW(int x, int y, int z) {
     avgW += loadField(x - 1, y, z + 1, W_FIELD);
     return avgW / 8.f;
 }
+
+
+ivec3 macroResolution() {
+    return (ivec3(gridResolution) + MACRO_CELL_SIZE - 1) / MACRO_CELL_SIZE;
+}
+
+float loadOccupancy(ivec3 macroID) {
+    ivec3 res = macroResolution();
+    if (any(lessThan(macroID, ivec3(0))) || any(greaterThanEqual(macroID, res))) {
+        return 0.f;
+    }
+    return macroOccupancy[(macroID.z * res.y + macroID.y) * res.x + macroID.x];
+}
\ No newline at end of file
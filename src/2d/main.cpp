@@ -16,6 +16,8 @@
 #include <imgui_impl_opengl3.h>
 #include <imgui_impl_glfw.h>
 
+#include "../program.h"
+
 #ifdef _WIN32
     #define ASSETS_PATH_RELATIVE "../../assets"
 #else
@@ -112,7 +114,8 @@ static void buildGUI(SmokeParams &params, float dt)
     ImGui::End();
 }
 
-static void setUniforms(graphics::Shader &shader, SmokeParams &params, float dt)
+template <typename Shader>
+static void setUniforms(Shader &shader, SmokeParams &params, float dt)
 {
     shader.bind();
     shader.setUniform("gridResolution", params.gridResolution);
@@ -176,13 +179,15 @@ int main()
 
     // Compile shaders
     const std::string smokeShaders = std::string(ASSETS_PATH_RELATIVE) + "/shader/smoke";
-    auto applyGravityShader = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/applyGravity.comp"}));
-    auto forceIncompressibility = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/forceIncompressibility.comp"}));
-    auto extrapolate = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/extrapolate.comp"}));
-    auto advectVelocities = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/advectVelocities.comp"}));
-    auto copyVelocityBuffer = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/copyVelocityBuffer.comp"}));
-    auto advectSmoke = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/advectSmoke.comp"}));
-    auto copySmokeBuffer = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/copySmokeBuffer.comp"}));
+    auto applyGravityShader = gpu::Program(smokeShaders + "/2d/applyGravity.comp");
+    auto forceIncompressibility = gpu::Program(smokeShaders + "/2d/forceIncompressibility.comp");
+    auto extrapolate = gpu::Program(smokeShaders + "/2d/extrapolate.comp");
+    auto advectVelocities = gpu::Program(smokeShaders + "/2d/advectVelocities.comp");
+    auto copyVelocityBuffer = gpu::Program(smokeShaders + "/2d/copyVelocityBuffer.comp");
+    auto advectSmoke = gpu::Program(smokeShaders + "/2d/advectSmoke.comp");
+    auto copySmokeBuffer = gpu::Program(smokeShaders + "/2d/copySmokeBuffer.comp");
+    gpu::buildPrograms({&applyGravityShader, &forceIncompressibility, &extrapolate, &advectVelocities,
+                        &copyVelocityBuffer, &advectSmoke, &copySmokeBuffer});
     auto smokeRenderShader = graphics::Shader(std::vector<std::string>({smokeShaders + "/2d/quad.vert", smokeShaders + "/2d/quad.frag"}));
 
     // Initialize SSBOs
@@ -230,13 +235,8 @@ int main()
             // Reload shader
             if (controls::Keyboard::getInstance().isPressed(GLFW_KEY_R))
             {
-                applyGravityShader.reload();
-                forceIncompressibility.reload();
-                extrapolate.reload();
-                advectVelocities.reload();
-                copyVelocityBuffer.reload();
-                advectSmoke.reload();
-                copySmokeBuffer.reload();
+                gpu::buildPrograms({&applyGravityShader, &forceIncompressibility, &extrapolate, &advectVelocities,
+                                    &copyVelocityBuffer, &advectSmoke, &copySmokeBuffer});
                 smokeRenderShader.reload();
                 controls::Keyboard::getInstance().setKeyState(GLFW_KEY_R, false);
             }
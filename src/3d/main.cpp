@@ -1,4 +1,8 @@
+#include <algorithm>
+#include <cmath>
 #include <filesystem>
+#include <fstream>
+#include <sstream>
 
 #include <tinylogger/tinylogger.h>
 #include <glm/glm.hpp>
@@ -17,6 +21,12 @@
 #include "controls/gui.h"
 
 #include "../util.h"
+#include "../gpu.h"
+#include "../program.h"
+#include "../diagnostics.h"
+#include "../workgroups.h"
+#include "../stages.h"
+#include "../snapshots.h"
 
 #ifdef _WIN32
     #define ASSETS_PATH_RELATIVE "../../assets"
@@ -24,24 +34,66 @@
     #define ASSETS_PATH_RELATIVE "../assets"
 #endif
 
+enum AdvectionScheme {
+    SEMI_LAGRANGIAN = 0,
+    MAC_CORMACK = 1
+};
+
+static const char *advectionSchemeNames[] = {"Semi-Lagrangian", "MacCormack"};
 
 struct SmokeParams {
     glm::vec3 gridResolution = glm::vec3(32, 32, 128);
     float gridSpacing = 1.5f;
     int totalIterations = 21;
+    bool warmStart = false; // Start the projection from the pressure of the last step
+    float tolerance = 0.05f; // Residual the convergence measurement counts iterations to
+    bool measureConvergence = false;
     glm::vec3 gravity = glm::vec3(0, 0, 9.81);
     float overrelaxation = 0.91f;
     float density = 0.002f;
     bool showVelocityField = false;
     bool showPressureField = false;
-    bool interpolate = false;
+    bool interpolate = false; // March the filtered smoke volume instead of the cell DDA
+    float marchStepSize = 0.5f; // Cells per step of the filtered march
+    bool levelOfDetail = false; // March coarser mip levels of the smoke with longer steps where cells are smaller than pixels
+    float lodBias = 0.f;        // Shifts the mip level picked from the pixel footprint
     bool reset = false;
+    bool tuneWorkgroups = false; // Benchmarks the workgroup shapes of all kernels, then resets
+    bool exportSmoke = false;    // Writes the smoke field of the current step to a raw float file
     bool useFixedDT = true;
     float fixedDT = 1/120.f;
     float thickness = 0.047;
     int ddaDepth = 200;
+    int velocityAdvection = SEMI_LAGRANGIAN;
+    int smokeAdvection = SEMI_LAGRANGIAN;
+    bool particles = false;           // Carry velocity and smoke on PIC/FLIP particles as well
+    float flipRatio = 0.95f;          // 0 is pure PIC, 1 pure FLIP
+    int particlesPerStep = 2048;      // Particles seeded in the smoke source each substep
+    int particleCapacity = 1 << 19;
+    bool movingWindow = false;   // Scroll the grid up along with the smoke
+    float windowTarget = 0.5f;   // Fraction of the grid height the smoke's centre of mass is kept below
+    int windowOffset = 0;        // Cells the window rose above the bottom of the domain
+    bool adaptiveDT = false;
+    float cflNumber = 1.f;
+    int maxSubsteps = 8;
+    bool detail = false;
+    int detailScale = 4;
+    float detailStrength = 4.f;
+    float detailFrequency = 4.f;
+    int texCoordResetInterval = 120;
+    bool emptySpaceSkipping = true;
+    bool barrierElision = true; // Skip the barriers and program binds the stage graph finds redundant
+    glm::vec3 lightDirection = glm::normalize(glm::vec3(-1)); // Towards the light
+    bool selfShadowing = true;
+    float shadowAmbient = 0.3f;
 };
 
+// Cells per axis summarized by one occupancy entry, MACRO_CELL_SIZE in smokeHeader.glsl
+static const int macroCellSize = 4;
+
+// Invocations per workgroup of the particle kernels, PARTICLE_GROUP_SIZE in particleHeader.glsl
+static const int particleGroupSize = 256;
+
 static void initGLEW()
 {
     GLenum err = glewInit();
@@ -95,7 +147,24 @@ static inline float getAspectRatio()
     return static_cast<float>(m_viewport[2]) / static_cast<float>(m_viewport[3]);
 }
 
-static void buildGUI(SmokeParams &params, float dt) 
+static inline float getViewportHeight()
+{
+    GLint m_viewport[4];
+    glGetIntegerv(GL_VIEWPORT, m_viewport);
+    return static_cast<float>(m_viewport[3]);
+}
+
+static void plotMetric(const char *label, const std::vector<float> &values)
+{
+    if (values.empty())
+        return;
+    ImGui::PlotLines(label, values.data(), static_cast<int>(values.size()), 0, std::to_string(values.back()).c_str(),
+                     FLT_MAX, FLT_MAX, ImVec2(0, 60));
+}
+
+static void buildGUI(SmokeParams &params, float dt, float maxSpeed, int substeps, const gpu::MetricsLog &metrics,
+                     const std::string &convergence, const gpu::StageGraph::Statistics &elidedStages,
+                     const gpu::StageGraph::Statistics &naiveStages, uint64_t droppedMetrics)
 {
     static bool show = false;
 
@@ -104,29 +173,106 @@ static void buildGUI(SmokeParams &params, float dt)
     ImGui::Text("FPS: %.1f", 1 / dt);
     ImGui::Checkbox("Use fixed dt", &params.useFixedDT);
     ImGui::SliderInt("Incompressability Iterations", &params.totalIterations, 0, 100);
+    ImGui::Checkbox("Warm start pressure", &params.warmStart);
+    ImGui::SliderFloat("Tolerance", &params.tolerance, 0.0001, 0.5, "%.4f");
+    params.measureConvergence = ImGui::Button("Measure iterations to tolerance");
+    ImGui::SameLine();
+    ImGui::Text("%s", convergence.c_str());
     ImGui::SliderFloat("Fixed dt", &params.fixedDT, 0.001, 0.1);
+    ImGui::Checkbox("Adaptive dt (CFL)", &params.adaptiveDT);
+    ImGui::SliderFloat("CFL number", &params.cflNumber, 0.1, 5);
+    ImGui::SliderInt("Max substeps", &params.maxSubsteps, 1, 32);
+    ImGui::Text("Max speed: %.2f, substeps: %d", maxSpeed, substeps);
     ImGui::SliderFloat("Grid Spacing", &params.gridSpacing, 0.001, 2);
     ImGui::SliderFloat("Overrelaxation", &params.overrelaxation, 0.1, 2);
     ImGui::SliderFloat("Thickness", &params.thickness, 0, 5);
     ImGui::SliderInt("DDA depth", &params.ddaDepth, 1, 250);
+    ImGui::Checkbox("Empty space skipping", &params.emptySpaceSkipping);
+    ImGui::Checkbox("Self shadowing", &params.selfShadowing);
+    ImGui::SliderFloat("Shadow ambient", &params.shadowAmbient, 0, 1);
+    ImGui::Checkbox("Procedural detail", &params.detail);
+    ImGui::SliderFloat("Detail strength", &params.detailStrength, 0, 20);
+    ImGui::SliderFloat("Detail frequency", &params.detailFrequency, 0.5, 16);
+    ImGui::SliderInt("Texture coordinate reset", &params.texCoordResetInterval, 1, 600);
     ImGui::SliderFloat3("Gravity", &params.gravity[0], -10, 10);
     ImGui::SliderFloat("Density", &params.density, 0, 0.01);
     ImGui::Checkbox("Show velocity field", &params.showVelocityField);
     ImGui::Checkbox("Show pressure field", &params.showPressureField);
     ImGui::Checkbox("Interpolate", &params.interpolate);
+    ImGui::SliderFloat("March step size", &params.marchStepSize, 0.1, 2);
+    ImGui::Checkbox("Level of detail", &params.levelOfDetail);
+    ImGui::SliderFloat("LOD bias", &params.lodBias, -2, 2);
+    ImGui::Combo("Velocity advection", &params.velocityAdvection, advectionSchemeNames, IM_ARRAYSIZE(advectionSchemeNames));
+    ImGui::Combo("Smoke advection", &params.smokeAdvection, advectionSchemeNames, IM_ARRAYSIZE(advectionSchemeNames));
+    ImGui::Checkbox("PIC/FLIP particles", &params.particles);
+    ImGui::SliderFloat("FLIP ratio", &params.flipRatio, 0, 1);
+    ImGui::SliderInt("Particles per step", &params.particlesPerStep, 0, 8192);
+    ImGui::Checkbox("Moving window", &params.movingWindow);
+    ImGui::SliderFloat("Window target height", &params.windowTarget, 0.2, 0.8);
+    ImGui::Text("Window offset: %d cells", params.windowOffset);
     params.reset = ImGui::Button("Reset");
+    params.tuneWorkgroups = ImGui::Button("Tune workgroups");
+    ImGui::SameLine();
+    params.exportSmoke = ImGui::Button("Export smoke");
+    if (ImGui::CollapsingHeader("Diagnostics"))
+    {
+        plotMetric("Smoke mass", metrics.series(&gpu::SimulationMetrics::mass));
+        plotMetric("Max divergence", metrics.series(&gpu::SimulationMetrics::maxDivergence));
+        plotMetric("Residual (RMS divergence)", metrics.series(&gpu::SimulationMetrics::residual));
+        plotMetric("Max speed", metrics.series(&gpu::SimulationMetrics::maxSpeed));
+        plotMetric("Active cells", metrics.series(&gpu::SimulationMetrics::activeCells));
+        plotMetric("Centre of mass height", metrics.series(&gpu::SimulationMetrics::centerHeight));
+        ImGui::Text("Steps without metrics: %llu", static_cast<unsigned long long>(droppedMetrics));
+        // Counted by the stage graph in the last frame run with and without elision
+        ImGui::Checkbox("Barrier elision", &params.barrierElision);
+        for (const auto *stages : {&elidedStages, &naiveStages})
+        {
+            const char *mode = stages->elision ? "With elision" : "Without elision";
+            if (stages->dispatches == 0)
+                ImGui::Text("%s: not measured yet", mode);
+            else
+                ImGui::Text("%s: %d dispatches, %d barriers, %d program binds, %.2f ms submit",
+                            mode, stages->dispatches, stages->barriers, stages->binds, stages->submitMs);
+        }
+    }
     ImGui::End();
 }
 
-static void setUniforms(graphics::Shader &shader, SmokeParams &params, float dt)
+// Splits the frame time into the fewest equal substeps that keep the fastest
+// velocity component below cflNumber cells per step
+static int computeSubsteps(const SmokeParams &params, float frameDT, float maxSpeed)
+{
+    if (!params.adaptiveDT || maxSpeed <= 0.f) {
+        return 1;
+    }
+    float stableDT = params.cflNumber * params.gridSpacing / maxSpeed;
+    int substeps = static_cast<int>(std::ceil(frameDT / stableDT));
+    return std::clamp(substeps, 1, params.maxSubsteps);
+}
+
+// Constants the solver programs are specialized with, a change selects other program variants
+static gpu::Defines solverDefines(const SmokeParams &params)
+{
+    return {
+        {"GRID_X", std::to_string(static_cast<int>(params.gridResolution.x))},
+        {"GRID_Y", std::to_string(static_cast<int>(params.gridResolution.y))},
+        {"GRID_Z", std::to_string(static_cast<int>(params.gridResolution.z))},
+        {"VELOCITY_ADVECTION", std::to_string(params.velocityAdvection)},
+        {"SMOKE_ADVECTION", std::to_string(params.smokeAdvection)},
+        {"WARM_START", params.warmStart ? "1" : "0"},
+        {"SMOKE_VOLUME", "1"}, // copySmokeBuffer.comp fills the renderer's smoke volume
+    };
+}
+
+template <typename Shader>
+static void setUniforms(Shader &shader, SmokeParams &params, float dt)
 {
     shader.bind();
     shader.setUniform("gridResolution", params.gridResolution);
-    if (params.useFixedDT) {
-        shader.setUniform("dt", params.fixedDT);
-    } else {
-        shader.setUniform("dt", dt);
-    }
+    shader.setUniform("domainOffset", glm::ivec3(0, 0, params.windowOffset));
+    shader.setUniform("windowOffset", params.windowOffset);
+    shader.setUniform("domainResolution", params.gridResolution);
+    shader.setUniform("dt", dt);
     shader.setUniform("gridSpacing", params.gridSpacing);
     shader.setUniform("overrelaxation", params.overrelaxation);
     shader.setUniform("gravity", params.gravity);
@@ -136,13 +282,28 @@ static void setUniforms(graphics::Shader &shader, SmokeParams &params, float dt)
     shader.setUniform("showVelocityField", params.showVelocityField);
     shader.setUniform("showPressureField", params.showPressureField);
     shader.setUniform("interpolate", params.interpolate);
+    shader.setUniform("marchStepSize", params.marchStepSize);
+    shader.setUniform("levelOfDetail", params.levelOfDetail);
+    shader.setUniform("lodBias", params.lodBias);
     shader.setUniform("reset", params.reset);
     shader.setUniform("totalIterations", params.totalIterations);
+    shader.setUniform("velocityAdvection", params.velocityAdvection);
+    shader.setUniform("smokeAdvection", params.smokeAdvection);
+    shader.setUniform("particleCapacity", static_cast<unsigned>(params.particleCapacity));
+    shader.setUniform("flipRatio", params.flipRatio);
+    shader.setUniform("emitCount", static_cast<unsigned>(params.particlesPerStep));
+    shader.setUniform("detailScale", params.detail ? params.detailScale : 1);
+    shader.setUniform("detailStrength", params.detailStrength);
+    shader.setUniform("detailFrequency", params.detailFrequency);
+    shader.setUniform("emptySpaceSkipping", params.emptySpaceSkipping);
+    shader.setUniform("lightDirection", params.lightDirection);
+    shader.setUniform("selfShadowing", params.selfShadowing);
+    shader.setUniform("shadowAmbient", params.shadowAmbient);
     shader.unbind();
     params.reset = false;
 }
 
-int main()
+int main(int argc, char **argv)
 {
     // Print current working directory:
     tlog::info() << "Current working directory: " << std::filesystem::current_path();
@@ -150,6 +311,22 @@ int main()
 
     auto params = SmokeParams();
 
+    // Per step metrics are plotted in the GUI and, with --metrics <file.csv|file.json>, streamed to a file
+    // --dump <path> saves the first frame after --dump-step simulation steps (100 by default like
+    // 3d-smoke-cpu --steps) and quits, for comparing the CPU renderer against it
+    auto metricsLog = gpu::MetricsLog();
+    std::string dumpPath;
+    uint64_t dumpStep = 100;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (std::string(argv[i]) == "--metrics")
+            metricsLog.open(argv[++i]);
+        else if (std::string(argv[i]) == "--dump")
+            dumpPath = argv[++i];
+        else if (std::string(argv[i]) == "--dump-step")
+            dumpStep = std::stoull(argv[++i]);
+    }
+
     graphics::Window window;
     initGLFW(window, params);
     initGLEW();
@@ -170,40 +347,197 @@ int main()
     window.hideMouse();
 
     // Initalize the cube mesh
-    auto cube = graphics::Mesh(createCubeVertices(params.gridResolution), createCubeIndices());
+    auto cube = gpu::Mesh(createCubeVertices(params.gridResolution), createCubeIndices());
 
     // Compile shaders
     const std::string smokeShaders = std::string(ASSETS_PATH_RELATIVE) + "/shader/smoke";
-    auto applyGravityShader = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/applyGravity.comp"}));
-    auto forceIncompressibility = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/forceIncompressibility.comp"}));
-    auto extrapolate = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/extrapolate.comp"}));
-    auto advectVelocities = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/advectVelocities.comp"}));
-    auto copyVelocityBuffer = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/copyVelocityBuffer.comp"}));
-    auto advectSmoke = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/advectSmoke.comp"}));
-    auto copySmokeBuffer = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/copySmokeBuffer.comp"}));
-    auto smokeRenderShader = graphics::Shader(std::vector<std::string>({smokeShaders + "/3d/cube.vert", smokeShaders + "/3d/cube.frag"}));
-
-    // Initialize SSBOs
+    auto applyGravityShader = gpu::Program(smokeShaders + "/3d/applyGravity.comp");
+    auto applyPressure = gpu::Program(smokeShaders + "/3d/applyPressure.comp");
+    auto forceIncompressibility = gpu::Program(smokeShaders + "/3d/forceIncompressibility.comp");
+    auto extrapolate = gpu::Program(smokeShaders + "/3d/extrapolate.comp");
+    auto advectVelocities = gpu::Program(smokeShaders + "/3d/advectVelocities.comp");
+    auto maccormackVelocities = gpu::Program(smokeShaders + "/3d/maccormackVelocities.comp");
+    auto copyVelocityBuffer = gpu::Program(smokeShaders + "/3d/copyVelocityBuffer.comp");
+    auto advectSmoke = gpu::Program(smokeShaders + "/3d/advectSmoke.comp");
+    auto maccormackSmoke = gpu::Program(smokeShaders + "/3d/maccormackSmoke.comp");
+    auto copySmokeBuffer = gpu::Program(smokeShaders + "/3d/copySmokeBuffer.comp");
+    auto diagnostics = gpu::Program(smokeShaders + "/3d/diagnostics.comp");
+    auto reduceDiagnostics = gpu::Program(smokeShaders + "/3d/reduceDiagnostics.comp");
+    auto advectTexCoords = gpu::Program(smokeShaders + "/3d/advectTexCoords.comp");
+    auto upsampleSmoke = gpu::Program(smokeShaders + "/3d/upsampleSmoke.comp");
+    auto buildOccupancy = gpu::Program(smokeShaders + "/3d/buildOccupancy.comp");
+    auto lightVolumeShader = gpu::Program(smokeShaders + "/3d/lightVolume.comp");
+    auto emitParticles = gpu::Program(smokeShaders + "/3d/emitParticles.comp");
+    auto binParticles = gpu::Program(smokeShaders + "/3d/binParticles.comp");
+    auto scanBins = gpu::Program(smokeShaders + "/3d/scanBins.comp");
+    auto sortParticles = gpu::Program(smokeShaders + "/3d/sortParticles.comp");
+    auto particlesToGrid = gpu::Program(smokeShaders + "/3d/particlesToGrid.comp");
+    auto gridToParticles = gpu::Program(smokeShaders + "/3d/gridToParticles.comp");
+    auto recycleWindow = gpu::Program(smokeShaders + "/3d/recycleWindow.comp");
+    auto shiftParticles = gpu::Program(smokeShaders + "/3d/shiftParticles.comp");
+    auto downsampleSmoke = gpu::Program(smokeShaders + "/3d/downsampleSmoke.comp");
+    // The renderer shares the solver's specialization and is built in the same batch
+    auto smokeRenderShader = gpu::Program(std::vector<std::string>({smokeShaders + "/3d/cube.vert", smokeShaders + "/3d/cube.frag"}));
+    const std::vector<gpu::Program *> solverPrograms = {
+        &applyGravityShader, &applyPressure, &forceIncompressibility, &extrapolate, &advectVelocities, &maccormackVelocities,
+        &copyVelocityBuffer, &advectSmoke, &maccormackSmoke, &copySmokeBuffer, &diagnostics, &reduceDiagnostics,
+        &advectTexCoords, &upsampleSmoke, &buildOccupancy, &lightVolumeShader, &emitParticles, &binParticles, &scanBins,
+        &sortParticles, &particlesToGrid, &gridToParticles, &recycleWindow, &shiftParticles, &downsampleSmoke,
+        &smokeRenderShader};
+    // Kernels with a fixed workgroup shape, which the tuner leaves alone, and the renderer without one
+    const std::vector<gpu::Program *> fixedShapePrograms = {
+        &lightVolumeShader, &reduceDiagnostics, &emitParticles, &binParticles, &scanBins, &sortParticles, &gridToParticles,
+        &shiftParticles, &downsampleSmoke, &smokeRenderShader};
+    auto specialization = solverDefines(params);
+
+    // Kernels take the workgroup shape tuned for the current specialization. The light sweep
+    // has a fixed one that matches its slice-by-slice dispatch, the final metrics reduction
+    // runs a single workgroup and the particle kernels run one dimensional workgroups.
+    auto tuner = gpu::WorkgroupTuner();
+    auto specializeSolver = [&]()
+    {
+        for (auto *program : solverPrograms)
+        {
+            if (std::find(fixedShapePrograms.begin(), fixedShapePrograms.end(), program) != fixedShapePrograms.end())
+                program->specialize(specialization);
+            else
+                gpu::WorkgroupTuner::specialize(*program, specialization, tuner.get(*program, specialization));
+        }
+        gpu::buildPrograms(solverPrograms);
+    };
+    specializeSolver();
+
+    // Initialize SSBOs, the initial values are filled in on the GPU
     auto res = params.gridResolution;
-    std::vector<float> uValues((res.x + 1) * res.y * res.z, 0);
-    std::vector<float> vValues(res.x * (res.y + 1) * res.z, 0);
-    std::vector<float> wValues(res.x * res.y * (res.z + 1), 0);
-    std::vector<float> pressure(res.x * res.y * res.z, 1.f);
-    std::vector<float> obstacles(res.x * res.y * res.z, 1.f);
-    std::vector<float> smoke(res.x * res.y * res.z, 1.f);
-
-    auto uBuffer = graphics::SSBO<float>(uValues, 0);
-    auto vBuffer = graphics::SSBO<float>(vValues, 1);
-    auto wBuffer = graphics::SSBO<float>(wValues, 2);
-    auto nextUBuffer = graphics::SSBO<float>(uValues, 3);
-    auto nextVBuffer = graphics::SSBO<float>(vValues, 4);
-    auto nextWBuffer = graphics::SSBO<float>(wValues, 5);
-    auto obstacleBuffer = graphics::SSBO<float>(obstacles, 6);
-    auto pressureBuffer = graphics::SSBO<float>(pressure, 7);
-    auto smokeBuffer = graphics::SSBO<float>(smoke, 8);
-    auto nextSmokeBuffer = graphics::SSBO<float>(smoke, 9);
+    GLsizeiptr uSize = (res.x + 1) * res.y * res.z * sizeof(float);
+    GLsizeiptr vSize = res.x * (res.y + 1) * res.z * sizeof(float);
+    GLsizeiptr wSize = res.x * res.y * (res.z + 1) * sizeof(float);
+    GLsizeiptr cellSize = res.x * res.y * res.z * sizeof(float);
+
+    auto uBuffer = gpu::Buffer(uSize, 0);
+    auto vBuffer = gpu::Buffer(vSize, 1);
+    auto wBuffer = gpu::Buffer(wSize, 2);
+    auto nextUBuffer = gpu::Buffer(uSize, 3);
+    auto nextVBuffer = gpu::Buffer(vSize, 4);
+    auto nextWBuffer = gpu::Buffer(wSize, 5);
+    auto obstacleBuffer = gpu::Buffer(cellSize, 6);
+    auto pressureBuffer = gpu::Buffer(cellSize, 7);
+    auto smokeBuffer = gpu::Buffer(cellSize, 8);
+    auto nextSmokeBuffer = gpu::Buffer(cellSize, 9);
+    auto auxUBuffer = gpu::Buffer(uSize, 10);
+    auto auxVBuffer = gpu::Buffer(vSize, 11);
+    auto auxWBuffer = gpu::Buffer(wSize, 12);
+    auto auxSmokeBuffer = gpu::Buffer(cellSize, 13);
+    for (gpu::Buffer *buffer : {&uBuffer, &vBuffer, &wBuffer, &nextUBuffer, &nextVBuffer, &nextWBuffer, &auxUBuffer,
+                                &auxVBuffer, &auxWBuffer})
+        buffer->clear(0.f);
+    for (gpu::Buffer *buffer : {&obstacleBuffer, &pressureBuffer, &smokeBuffer, &nextSmokeBuffer, &auxSmokeBuffer})
+        buffer->clear(1.f);
+
+    // Host copies of the smoke field for exporting, read from mapped memory once the copy finished.
+    // The files are written by a worker thread, so the frame loop only copies out of the mapping.
+    auto smokeSnapshots = gpu::SnapshotRing(cellSize);
+    host::WorkerPool exportWriter(1);
+    auto metricsRing = gpu::MetricsRing();
+    uint64_t simulationStep = 0;
+    uint64_t droppedMetrics = 0; // Steps recorded while every metrics slot waited for its read back
+    float maxSpeed = 0.f;
+
+    // Residual after every projection sweep of one step, for measuring iterations to tolerance
+    auto convergenceRing = gpu::MetricsRing(128);
+    std::vector<float> convergenceResiduals;
+    int convergenceSamples = 0;
+    std::string convergence;
+    int substeps = 1;
     
-    auto dispatchSize = glm::ivec3(res) / glm::ivec3(8, 8, 16) + 1;
+    // Staggered faces reach one past the last cell
+    auto invocations = glm::ivec3(res) + 1;
+
+    // Coarse occupancy grid the renderer uses to leap over empty regions
+    auto macroResolution = (glm::ivec3(res) + macroCellSize - 1) / macroCellSize;
+    auto occupancyBuffer = gpu::Buffer(macroResolution.x * macroResolution.y * macroResolution.z * sizeof(float), 18);
+
+    // Transmittance towards the light per cell, swept from the light once per frame
+    auto lightVolume = gpu::Volume(glm::ivec3(res));
+
+    // Density and speed per cell, written by copySmokeBuffer for filtered fetches in the renderer
+    // Its mip chain lets distant smoke be marched on coarser levels
+    auto smokeVolume = gpu::Volume(glm::ivec3(res), GL_RG16F, GL_CLAMP_TO_EDGE, gpu::Volume::mipLevels(glm::ivec3(res)));
+
+    // Procedural detail: the smoke is simulated on the coarse grid and upsampled by
+    // detailScale every frame using flow advected texture coordinates and band noise
+    auto texCoordBuffer = gpu::Buffer(res.x * res.y * res.z * sizeof(glm::vec4), 15);
+    auto nextTexCoordBuffer = gpu::Buffer(res.x * res.y * res.z * sizeof(glm::vec4), 16);
+    // The detail volume holds detailScale³ texels per cell, so it stays a single texel until detail is enabled
+    const glm::ivec3 detailResolution = glm::ivec3(res) * params.detailScale;
+    auto detailVolume = gpu::Volume(glm::ivec3(1));
+    auto allocateDetailVolume = [&]()
+    {
+        if (detailVolume.resolution != detailResolution)
+            detailVolume = gpu::Volume(detailResolution);
+    };
+    const glm::ivec3 noiseTileResolution(32);
+    auto noiseTile = gpu::Volume(noiseTileResolution, GL_R16F, GL_REPEAT);
+    host::GridArena noiseArena;
+    auto noiseTileValues = noiseArena.grid<float>("noiseTile", noiseTileResolution.x * noiseTileResolution.y * noiseTileResolution.z);
+    perlin::noiseBand(noiseTileValues, noiseTileResolution, 8, 1337);
+    noiseTile.upload(noiseTileValues.data(), glm::ivec3(0), noiseTileResolution);
+    int detailFrame = 0;
+
+    // PIC/FLIP particles, binned by cell with a counting sort every substep. There is one bin per
+    // cell and one for the dead particles, the bin starts have an extra entry for the total.
+    GLsizeiptr particleSize = 2 * sizeof(glm::vec4);
+    GLsizeiptr bins = static_cast<GLsizeiptr>(res.x * res.y * res.z) + 1;
+    GLsizeiptr scanBlocks = (bins + 2 * particleGroupSize - 1) / (2 * particleGroupSize);
+    auto particleBuffer = gpu::Buffer(params.particleCapacity * particleSize, 21);
+    auto sortedParticleBuffer = gpu::Buffer(params.particleCapacity * particleSize, 22);
+    auto particleBinBuffer = gpu::Buffer(params.particleCapacity * sizeof(glm::uvec2), 23);
+    auto binCountBuffer = gpu::Buffer(bins * sizeof(uint32_t), 24);
+    auto binStartBuffer = gpu::Buffer((bins + 1) * sizeof(uint32_t), 25);
+    auto scanBlockBuffer = gpu::Buffer(scanBlocks * sizeof(uint32_t), 26);
+    for (gpu::Buffer *buffer : {&particleBuffer, &sortedParticleBuffer, &binStartBuffer})
+        buffer->clear();
+    auto particleInvocations = glm::ivec3(params.particleCapacity, 1, 1);
+    uint32_t particleSeed = 0;
+    bool particlesActive = false;
+
+    // Metrics recorded before the window last moved describe the old window
+    uint64_t windowMovedStep = 0;
+
+    // Kernels the workgroup tuner benchmarks and the invocations each one is dispatched with
+    const std::vector<std::pair<gpu::Program *, glm::ivec3>> tunedKernels = {
+        {&applyGravityShader, invocations}, {&applyPressure, invocations}, {&forceIncompressibility, invocations}, {&extrapolate, invocations},
+        {&advectVelocities, invocations}, {&maccormackVelocities, invocations}, {&copyVelocityBuffer, invocations},
+        {&advectSmoke, invocations}, {&maccormackSmoke, invocations}, {&copySmokeBuffer, invocations},
+        {&diagnostics, glm::ivec3(res)}, {&advectTexCoords, invocations}, {&buildOccupancy, macroResolution},
+        {&upsampleSmoke, detailResolution}, {&particlesToGrid, invocations}};
+
+    // Resources the stages of a frame declare as read or written
+    using gpu::storage, gpu::image, gpu::texture, gpu::host;
+    gpu::StageGraph stages;
+    gpu::StageGraph::Statistics elidedStages;
+    gpu::StageGraph::Statistics naiveStages;
+    naiveStages.elision = false;
+    const int velocityField = stages.resource("velocity");
+    const int nextVelocityField = stages.resource("nextVelocity");
+    const int auxVelocityField = stages.resource("auxVelocity");
+    const int obstacleField = stages.resource("obstacle");
+    const int pressureField = stages.resource("pressure");
+    const int smokeField = stages.resource("smoke");
+    const int nextSmokeField = stages.resource("nextSmoke");
+    const int auxSmokeField = stages.resource("auxSmoke");
+    const int occupancyGrid = stages.resource("occupancy");
+    const int texCoordField = stages.resource("texCoords");
+    const int nextTexCoordField = stages.resource("nextTexCoords");
+    const int smokeVolumeImage = stages.resource("smokeVolume");
+    const int lightVolumeImage = stages.resource("lightVolume");
+    const int detailVolumeImage = stages.resource("detailVolume");
+    const int particleField = stages.resource("particles");
+    const int sortedParticleField = stages.resource("sortedParticles");
+    const int particleBinField = stages.resource("particleBins");
+    const int binCountField = stages.resource("binCount");
+    const int binStartField = stages.resource("binStart");
+    const int scanBlockField = stages.resource("scanBlocks");
  
     auto currTime = std::chrono::steady_clock::now();
     auto prevTime = currTime;
@@ -229,14 +563,7 @@ int main()
             // Reload shader
             if (controls::Keyboard::getInstance().isPressed(GLFW_KEY_R))
             {
-                applyGravityShader.reload();
-                forceIncompressibility.reload();
-                extrapolate.reload();
-                advectVelocities.reload();
-                copyVelocityBuffer.reload();
-                advectSmoke.reload();
-                copySmokeBuffer.reload();
-                smokeRenderShader.reload();
+                gpu::buildPrograms(solverPrograms);
                 controls::Keyboard::getInstance().setKeyState(GLFW_KEY_R, false);
             }
             if (controls::Keyboard::getInstance().isPressed(GLFW_KEY_F1))
@@ -251,43 +578,358 @@ int main()
             }
 
             gui.preBuild();
-            buildGUI(params, dt);
+            buildGUI(params, dt, maxSpeed, substeps, metricsLog, convergence, elidedStages, naiveStages, droppedMetrics);
+
+            // Switching an advection scheme selects the matching variants, built once on first use
+            auto defines = solverDefines(params);
+            if (defines != specialization)
+            {
+                specialization = defines;
+                specializeSolver();
+            }
         }
 
         { // Update smoke simulation
 
+            // Pick the substep count from the speeds the metrics ring delivered since the last
+            // frame. They come from fenced slots of its persistent mapping and lag a few frames
+            // behind, so the CPU never waits for the GPU. The fastest of them is used, so a burst
+            // within the lag still shortens the substeps.
+            float frameDT = params.useFixedDT ? params.fixedDT : dt;
+            float smokeCenter = -1.f;
+            float deliveredSpeed = -1.f;
+            metricsRing.collect([&](uint64_t step, const gpu::SimulationMetrics &metrics) {
+                metricsLog.add(step, metrics);
+                deliveredSpeed = std::max(deliveredSpeed, metrics.maxSpeed);
+                if (step >= windowMovedStep && metrics.mass > 0.f)
+                    smokeCenter = metrics.centerHeight;
+            });
+            if (deliveredSpeed >= 0.f)
+                maxSpeed = deliveredSpeed;
+
+            // Sample i holds the residual after i sweeps
+            convergenceRing.collect([&](uint64_t, const gpu::SimulationMetrics &metrics) {
+                convergenceResiduals.push_back(metrics.residual);
+            });
+            if (convergenceSamples > 0 && static_cast<int>(convergenceResiduals.size()) == convergenceSamples)
+            {
+                auto reached = std::find_if(convergenceResiduals.begin(), convergenceResiduals.end(),
+                                            [&](float residual) { return residual <= params.tolerance; });
+                std::stringstream text;
+                text << (params.warmStart ? "Warm start: " : "Cold start: ");
+                if (reached == convergenceResiduals.end())
+                    text << "not reached in " << convergenceSamples - 1 << " iterations, residual " << convergenceResiduals.back();
+                else
+                    text << reached - convergenceResiduals.begin() << " iterations";
+                convergence = text.str();
+                tlog::info() << "Iterations to residual " << params.tolerance << ": " << convergence;
+                convergenceSamples = 0;
+            }
+            smokeSnapshots.collect([&](uint64_t step, const char *data) {
+                std::stringstream name;
+                name << "smoke_" << step << "_" << res.x << "x" << res.y << "x" << res.z << ".raw";
+                exportWriter.submit([path = name.str(), values = std::vector<char>(data, data + smokeSnapshots.getSlotSize())] {
+                    std::ofstream(path, std::ios::binary).write(values.data(), values.size());
+                    tlog::info() << "Exported smoke to " << path;
+                });
+            });
+            substeps = computeSubsteps(params, frameDT, maxSpeed);
+            float stepDT = frameDT / substeps;
+
+            // The benchmark runs the kernels on the live fields, so the simulation restarts afterwards
+            if (params.tuneWorkgroups)
+            {
+                allocateDetailVolume();
+                detailVolume.bindImage(0);
+                smokeVolume.bindImage(2);
+                for (auto &[program, kernelInvocations] : tunedKernels)
+                {
+                    tuner.tune(*program, specialization, kernelInvocations,
+                               [&](gpu::Program &variant) {
+                                   setUniforms(variant, params, stepDT);
+                                   if (&variant == &diagnostics)
+                                       metricsRing.reserve(diagnostics, glm::ivec3(res));
+                               });
+                }
+                tuner.save();
+                params.reset = true;
+            }
+
+            // The window rises in whole cells once the smoke's centre of mass passes the target
+            // height. Only the recycled top layers are cleared, the other cells keep their slots.
+            int recycledCells = 0;
+            if (params.reset)
+            {
+                params.windowOffset = 0;
+            }
+            else if (params.movingWindow && smokeCenter >= 0.f)
+            {
+                int maxStep = static_cast<int>(res.z) / 4;
+                recycledCells = std::clamp(static_cast<int>(smokeCenter - params.windowTarget * res.z), 0, maxStep);
+                if (recycledCells > 0)
+                {
+                    params.windowOffset += recycledCells;
+                    windowMovedStep = simulationStep;
+                    detailFrame = 0; // Texture coordinates restart in the new window
+                }
+            }
+
+            // Particles restart with the simulation and when they are switched on
+            bool clearParticles = params.reset || (params.particles && !particlesActive);
+            particlesActive = params.particles;
+
             // Update shader uniforms
-            setUniforms(applyGravityShader, params, dt);
-            setUniforms(forceIncompressibility, params, dt);
-            setUniforms(extrapolate, params, dt);
-            setUniforms(advectVelocities, params, dt);
-            setUniforms(copyVelocityBuffer, params, dt);
-            setUniforms(advectSmoke, params, dt);
-            setUniforms(copySmokeBuffer, params, dt);
-            setUniforms(smokeRenderShader, params, dt);
-
-            // Dispatch compute shaders
-            applyGravityShader.dispatch(dispatchSize);
-            //// Execute twice per iteration for preventing race conditions by evaluating in checkboard pattern
-            for (int i = 0; i < 2 * params.totalIterations; i++)
+            setUniforms(applyGravityShader, params, stepDT);
+            setUniforms(applyPressure, params, stepDT);
+            setUniforms(forceIncompressibility, params, stepDT);
+            setUniforms(extrapolate, params, stepDT);
+            setUniforms(advectVelocities, params, stepDT);
+            setUniforms(maccormackVelocities, params, stepDT);
+            setUniforms(copyVelocityBuffer, params, stepDT);
+            setUniforms(advectSmoke, params, stepDT);
+            setUniforms(maccormackSmoke, params, stepDT);
+            setUniforms(copySmokeBuffer, params, stepDT);
+            setUniforms(diagnostics, params, stepDT);
+            setUniforms(advectTexCoords, params, frameDT);
+            setUniforms(upsampleSmoke, params, frameDT);
+            setUniforms(buildOccupancy, params, stepDT);
+            setUniforms(lightVolumeShader, params, stepDT);
+            for (gpu::Program *program : {&emitParticles, &binParticles, &scanBins, &sortParticles, &particlesToGrid,
+                                          &gridToParticles, &recycleWindow, &shiftParticles})
+                setUniforms(*program, params, stepDT);
+            setUniforms(smokeRenderShader, params, stepDT);
+
+            // Describe the frame's compute work, the graph derives the barriers between the stages
+            smokeVolume.bindImage(2);
+            if (recycledCells > 0)
+            {
+                auto setRecycled = [recycledCells](gpu::Program &program) {
+                    program.setUniform("recycledCells", recycledCells);
+                };
+                stages.dispatch(recycleWindow, glm::ivec3(invocations.x, invocations.y, recycledCells + 1), {},
+                                {storage(velocityField), storage(pressureField), storage(smokeField), storage(nextSmokeField),
+                                 storage(obstacleField)},
+                                setRecycled);
+                if (params.particles && !clearParticles)
+                {
+                    stages.dispatch(shiftParticles, particleInvocations, {storage(particleField)}, {storage(particleField)},
+                                    setRecycled);
+                }
+            }
+            if (clearParticles)
+            {
+                stages.call({}, {host(particleField), host(sortedParticleField), host(binStartField)}, [&] {
+                    particleBuffer.clear();
+                    sortedParticleBuffer.clear();
+                    binStartBuffer.clear();
+                });
+            }
+            for (int step = 0; step < substeps; step++)
+            {
+                if (params.particles)
+                {
+                    // Seed particles into the free slots, sort them by cell and splat them to the grid
+                    auto scanGroups = glm::ivec3(static_cast<int>(scanBlocks) * particleGroupSize, 1, 1);
+                    stages.dispatch(emitParticles, glm::ivec3(params.particlesPerStep, 1, 1),
+                                    {storage(binStartField), storage(velocityField)}, {storage(particleField)},
+                                    [seed = particleSeed++](gpu::Program &program) { program.setUniform("emitSeed", seed); });
+                    stages.call({}, {host(binCountField)}, [&] { binCountBuffer.clear(); });
+                    stages.dispatch(binParticles, particleInvocations, {storage(particleField)},
+                                    {storage(particleBinField), storage(binCountField)});
+                    stages.dispatch(scanBins, scanGroups, {storage(binCountField)},
+                                    {storage(binStartField), storage(scanBlockField)},
+                                    [](gpu::Program &program) { program.setUniform("scanPhase", 0); });
+                    stages.dispatch(scanBins, glm::ivec3(particleGroupSize, 1, 1), {storage(scanBlockField)},
+                                    {storage(scanBlockField), storage(binStartField)},
+                                    [](gpu::Program &program) { program.setUniform("scanPhase", 1); });
+                    stages.dispatch(scanBins, scanGroups, {storage(scanBlockField), storage(binStartField)},
+                                    {storage(binStartField)},
+                                    [](gpu::Program &program) { program.setUniform("scanPhase", 2); });
+                    stages.dispatch(sortParticles, particleInvocations,
+                                    {storage(particleField), storage(particleBinField), storage(binStartField)},
+                                    {storage(sortedParticleField)});
+                    stages.dispatch(particlesToGrid, invocations,
+                                    {storage(sortedParticleField), storage(binStartField), storage(velocityField),
+                                     storage(smokeField)},
+                                    {storage(velocityField), storage(smokeField), storage(auxVelocityField)});
+                }
+
+                stages.dispatch(applyGravityShader, invocations,
+                                {storage(velocityField), storage(smokeField)},
+                                {storage(velocityField), storage(nextSmokeField), storage(smokeField), storage(obstacleField),
+                                 storage(pressureField)},
+                                [step](gpu::Program &program) {
+                                    // Only the first substep may reset the simulation
+                                    if (step > 0)
+                                        program.setUniform("reset", false);
+                                });
+                if (params.warmStart)
+                {
+                    stages.dispatch(applyPressure, invocations,
+                                    {storage(velocityField), storage(obstacleField), storage(pressureField)}, {storage(velocityField)});
+                }
+
+                // The measurement samples the residual of the first substep after every sweep
+                bool measure = params.measureConvergence && step == 0 && convergenceSamples == 0;
+                auto recordResidual = [&](int sweep) {
+                    stages.call({storage(velocityField), storage(smokeField), storage(obstacleField)}, {}, [&, sweep] {
+                        convergenceRing.record(diagnostics, reduceDiagnostics, glm::ivec3(res), sweep);
+                    });
+                };
+                if (measure)
+                {
+                    convergenceResiduals.clear();
+                    convergenceSamples = params.totalIterations + 1;
+                    recordResidual(0);
+                }
+
+                // Execute twice per iteration for preventing race conditions by evaluating in checkboard pattern
+                for (int i = 0; i < 2 * params.totalIterations; i++)
+                {
+                    stages.dispatch(forceIncompressibility, invocations,
+                                    {storage(velocityField), storage(obstacleField), storage(pressureField)},
+                                    {storage(velocityField), storage(pressureField)},
+                                    [i](gpu::Program &program) { program.setUniform("currentIteration", i); });
+                    if (measure && i % 2 == 1)
+                        recordResidual(i / 2 + 1);
+                }
+                uint64_t recordedStep = simulationStep++;
+                stages.call({storage(velocityField), storage(smokeField), storage(obstacleField)}, {}, [&, recordedStep] {
+                    if (metricsRing.record(diagnostics, reduceDiagnostics, glm::ivec3(res), recordedStep))
+                        return;
+                    if (droppedMetrics++ == 0)
+                        tlog::warning() << "No metrics for step " << recordedStep << ", all read back slots are in use. Further gaps are counted under Diagnostics";
+                });
+
+                stages.dispatch(extrapolate, invocations, {storage(velocityField)}, {storage(velocityField)});
+                if (params.particles)
+                {
+                    // PIC/FLIP update from the projected grid, then the sorted particles become the particles
+                    stages.dispatch(gridToParticles, particleInvocations,
+                                    {storage(velocityField), storage(auxVelocityField), storage(obstacleField),
+                                     storage(binStartField), storage(sortedParticleField)},
+                                    {storage(sortedParticleField)});
+                    stages.call({}, {storage(particleField), storage(sortedParticleField)}, [&] {
+                        std::swap(particleBuffer, sortedParticleBuffer);
+                        particleBuffer.bind(21);
+                        sortedParticleBuffer.bind(22);
+                    });
+                }
+
+                stages.dispatch(advectVelocities, invocations, {storage(velocityField), storage(obstacleField)},
+                                {storage(nextVelocityField)});
+                bool correctVelocities = params.velocityAdvection == MAC_CORMACK;
+                if (correctVelocities)
+                {
+                    stages.dispatch(maccormackVelocities, invocations,
+                                    {storage(velocityField), storage(nextVelocityField), storage(obstacleField)},
+                                    {storage(auxVelocityField)});
+                }
+                stages.dispatch(copyVelocityBuffer, invocations,
+                                {storage(correctVelocities ? auxVelocityField : nextVelocityField)}, {storage(velocityField)});
+
+                stages.dispatch(advectSmoke, invocations, {storage(velocityField), storage(smokeField), storage(obstacleField)},
+                                {storage(nextSmokeField)});
+                bool correctSmoke = params.smokeAdvection == MAC_CORMACK;
+                if (correctSmoke)
+                {
+                    stages.dispatch(maccormackSmoke, invocations,
+                                    {storage(velocityField), storage(smokeField), storage(nextSmokeField), storage(obstacleField)},
+                                    {storage(auxSmokeField)});
+                }
+                stages.dispatch(copySmokeBuffer, invocations,
+                                {storage(correctSmoke ? auxSmokeField : nextSmokeField), storage(velocityField)},
+                                {storage(smokeField), image(smokeVolumeImage)});
+            }
+
+            // Summarize the advected smoke for the renderer
+            if (params.emptySpaceSkipping)
+            {
+                stages.dispatch(buildOccupancy, macroResolution, {storage(smokeField), storage(obstacleField)},
+                                {storage(occupancyGrid)});
+            }
+
+            if (params.levelOfDetail)
+            {
+                stages.call({image(smokeVolumeImage)}, {image(smokeVolumeImage)}, [&] {
+                    gpu::buildMipChain(downsampleSmoke, smokeVolume, 3);
+                });
+            }
+
+            if (params.selfShadowing)
+            {
+                stages.call({storage(smokeField)}, {image(lightVolumeImage)}, [&] {
+                    gpu::sweepTowardsLight(lightVolumeShader, lightVolume, 1, params.lightDirection);
+                });
+            }
+
+            if (params.detail)
+            {
+                allocateDetailVolume();
+
+                // Texture coordinates are advected once per frame over the whole frame time
+                bool resetTexCoords = detailFrame % params.texCoordResetInterval == 0;
+                stages.dispatch(advectTexCoords, invocations, {storage(velocityField), storage(texCoordField)},
+                                {storage(nextTexCoordField)},
+                                [resetTexCoords](gpu::Program &program) { program.setUniform("resetTexCoords", resetTexCoords); });
+                stages.call({}, {storage(texCoordField), storage(nextTexCoordField)}, [&] {
+                    std::swap(texCoordBuffer, nextTexCoordBuffer);
+                    texCoordBuffer.bind(15);
+                    nextTexCoordBuffer.bind(16);
+                    noiseTile.bindTexture(1);
+                    detailVolume.bindImage(0);
+                });
+                stages.dispatch(upsampleSmoke, detailVolume.resolution,
+                                {storage(smokeField), storage(velocityField), storage(texCoordField)},
+                                {image(detailVolumeImage)},
+                                [](gpu::Program &program) { program.setUniform("noiseTile", 1); });
+                detailFrame++;
+            }
+
+            if (params.exportSmoke)
             {
-                forceIncompressibility.bind();
-                forceIncompressibility.setUniform("currentIteration", i);
-                forceIncompressibility.unbind();
-                forceIncompressibility.dispatch(dispatchSize);
+                stages.call({host(smokeField)}, {}, [&] {
+                    // Smoke is z-major, so the window's bottom layer starts the file
+                    GLintptr rotation = (params.windowOffset % res.z) * res.x * res.y * sizeof(float);
+                    if (!smokeSnapshots.snapshot(smokeBuffer, simulationStep, 0, rotation))
+                        tlog::warning() << "Smoke export skipped, all snapshot slots are in use";
+                });
             }
-            extrapolate.dispatch(dispatchSize);
-            advectVelocities.dispatch(dispatchSize);
-            copyVelocityBuffer.dispatch(dispatchSize);
-            advectSmoke.dispatch(dispatchSize);
-            copySmokeBuffer.dispatch(dispatchSize);
+
+            // Everything the renderer reads
+            stages.consume({storage(velocityField), storage(pressureField), storage(smokeField), storage(obstacleField),
+                            storage(occupancyGrid), texture(smokeVolumeImage), texture(lightVolumeImage),
+                            texture(detailVolumeImage)});
+            stages.setElision(params.barrierElision);
+            stages.run();
+            (params.barrierElision ? elidedStages : naiveStages) = stages.getStatistics();
         }
 
         { // Render
             smokeRenderShader.bind();
             smokeRenderShader.setUniform("PV", pv);
             smokeRenderShader.setUniform("cameraPos", camera.getPosition());
+            smokeRenderShader.setUniform("detailField", 0);
+            detailVolume.bindTexture(0);
+            smokeRenderShader.setUniform("lightVolume", 2);
+            lightVolume.bindTexture(2);
+            smokeRenderShader.setUniform("smokeVolume", 3);
+            smokeVolume.bindTexture(3);
+            smokeRenderShader.setUniform("smokeLevels", smokeVolume.getLevels());
+            // A pixel spans 2 / (P[1][1] * height) at unit distance from the camera
+            float pixelFootprint = 2.f / (camera.getProjectionMatrix(aspectRatio)[1][1] * getViewportHeight());
+            smokeRenderShader.setUniform("pixelFootprint", pixelFootprint);
             cube.draw(smokeRenderShader);
+            if (!dumpPath.empty() && simulationStep >= dumpStep)
+            {
+                GLint viewport[4];
+                glGetIntegerv(GL_VIEWPORT, viewport);
+                glm::ivec2 size(viewport[2], viewport[3]);
+                gpu::saveFramebuffer(dumpPath, size);
+                tlog::info() << "Saved " << size.x << "x" << size.y << " frame of step " << simulationStep << " to " << dumpPath;
+                glfwSetWindowShouldClose(window.getGLFWWindow(), GLFW_TRUE);
+                dumpPath.clear();
+            }
             gui.render();
             smokeRenderShader.unbind();
         }
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <span>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+namespace host
+{
+    // Calls work(begin, end) for contiguous ranges of [0, count) on up to threads threads, which
+    // are started for this call only. Grids are generated along their slowest axis this way, so
+    // each thread writes one contiguous part of the memory. This only spreads the generation, the
+    // threads that later read the grid are others, so it says nothing about NUMA placement.
+    template <typename Work>
+    void parallelRanges(int count, Work &&work, unsigned threads = std::thread::hardware_concurrency())
+    {
+        int parts = std::clamp(static_cast<int>(threads), 1, std::max(count, 1));
+        std::vector<std::thread> workers;
+        for (int part = 1; part < parts; part++)
+            workers.emplace_back([&, part] { work(count * part / parts, count * (part + 1) / parts); });
+        work(0, count / parts);
+        for (auto &worker : workers)
+            worker.join();
+    }
+
+    // Long lived background threads that run submitted tasks in submission order. The destructor
+    // runs the tasks still queued before it joins, so work handed over, e.g. a file write, is
+    // never lost.
+    class WorkerPool
+    {
+    public:
+        // Leaves one hardware thread to the caller by default
+        explicit WorkerPool(unsigned threads = std::max(std::thread::hardware_concurrency(), 2u) - 1)
+        {
+            for (unsigned i = 0; i < std::max(threads, 1u); i++)
+                workers.emplace_back([this] { run(); });
+        }
+
+        ~WorkerPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+        }
+
+        WorkerPool(const WorkerPool &) = delete;
+        WorkerPool &operator=(const WorkerPool &) = delete;
+
+        void submit(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            wake.notify_one();
+        }
+
+        unsigned getThreadCount() const { return static_cast<unsigned>(workers.size()); }
+
+    private:
+        void run()
+        {
+            while (true)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                        return;
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+    };
+
+    // Fills the slices [0, count) of a grid on the threads of a worker pool while the calling
+    // thread keeps going, e.g. rendering. collect() hands out the finished slices in order, so
+    // they can be uploaded as they become ready.
+    //
+    // Every start() is a generation of its own. Workers compute a batch of slices into scratch
+    // memory and copy it into the target only while their generation is still the current one.
+    // cancel(), a new start() and the destructor therefore never wait for the workers: slices
+    // still computed for a stale generation are discarded instead of written.
+    class SliceJob
+    {
+    public:
+        explicit SliceJob(WorkerPool &pool) : pool(pool) {}
+
+        ~SliceJob()
+        {
+            cancel();
+        }
+
+        SliceJob(const SliceJob &) = delete;
+        SliceJob &operator=(const SliceJob &) = delete;
+
+        // work(values, begin, end) writes the slices [begin, end) to values, which holds just these
+        // slices. target receives all count slices.
+        void start(std::span<float> target, int count, std::function<void(std::span<float>, int, int)> work, int batch = 1)
+        {
+            cancel();
+            auto state = std::make_shared<Generation>();
+            state->target = target;
+            state->sliceSize = target.size() / std::max(count, 1);
+            state->count = count;
+            state->work = std::move(work);
+            state->finished = std::make_unique<std::atomic<bool>[]>(count);
+            generation = state;
+            collected = 0;
+            for (unsigned i = 0; i < pool.getThreadCount(); i++)
+                pool.submit([state, batch] { state->run(batch); });
+        }
+
+        // Returns right away. Workers busy with a slice of this generation finish computing it
+        // and then drop it.
+        void cancel()
+        {
+            if (generation == nullptr)
+                return;
+            std::lock_guard<std::mutex> lock(generation->mutex);
+            generation->cancelled = true;
+            generation.reset();
+        }
+
+        // Hands the finished slices after those already collected to consume(begin, end). Returns
+        // true once, when this call collected the last slice.
+        template <typename Consume>
+        bool collect(Consume &&consume)
+        {
+            if (generation == nullptr)
+                return false;
+            int end = collected;
+            while (end < generation->count && generation->finished[end].load(std::memory_order_acquire))
+                end++;
+            if (end == collected)
+                return false;
+
+            consume(collected, end);
+            collected = end;
+            if (collected < generation->count)
+                return false;
+            generation.reset();
+            return true;
+        }
+
+        bool isRunning() const { return generation != nullptr; }
+
+    private:
+        struct Generation
+        {
+            void run(int batch)
+            {
+                std::vector<float> scratch;
+                while (!cancelled)
+                {
+                    int begin = next.fetch_add(batch);
+                    if (begin >= count)
+                        return;
+                    int end = std::min(begin + batch, count);
+                    scratch.resize((end - begin) * sliceSize);
+                    work(scratch, begin, end);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (cancelled)
+                        return;
+                    std::copy(scratch.begin(), scratch.end(), target.begin() + begin * sliceSize);
+                    for (int slice = begin; slice < end; slice++)
+                        finished[slice].store(true, std::memory_order_release);
+                }
+            }
+
+            std::span<float> target;
+            size_t sliceSize = 0;
+            int count = 0;
+            std::function<void(std::span<float>, int, int)> work;
+            std::atomic<int> next = 0;
+            std::atomic<bool> cancelled = false;
+            std::unique_ptr<std::atomic<bool>[]> finished;
+            std::mutex mutex; // Held while a slice is copied to the target and when cancelling
+        };
+
+        WorkerPool &pool;
+        std::shared_ptr<Generation> generation;
+        int collected = 0;
+    };
+
+    // Memory of the host side grids, handed out as 64 byte aligned slices of a few large chunks.
+    // Every grid has a name and requesting the same name again returns the same slice as long as
+    // it is large enough, so regenerating a grid reuses its memory instead of reallocating.
+    //
+    // Chunks are backed by huge pages when available (transparent huge pages otherwise) and are
+    // never written by the arena. The OS places each page on the NUMA node of the thread that
+    // first writes it, so grids should be initialized by the long lived threads that later
+    // process them, as the pinned workers of cpu::SmokeSolver do for their bricks.
+    class GridArena
+    {
+    public:
+        static constexpr size_t alignment = 64; // Cache line, also enough for any SIMD load
+        static constexpr size_t hugePageSize = 2 << 20;
+
+        explicit GridArena(bool hugePages = true, size_t chunkSize = 64 << 20)
+            : hugePages(hugePages), chunkSize(chunkSize)
+        {
+        }
+
+        ~GridArena()
+        {
+            for (auto &chunk : chunks)
+                unmap(chunk);
+        }
+
+        GridArena(const GridArena &) = delete;
+        GridArena &operator=(const GridArena &) = delete;
+
+        // Uninitialized slice of count elements. A grid that outgrew its slice gets a new one and
+        // its old slice is kept for other grids.
+        template <typename T>
+        std::span<T> grid(const std::string &name, size_t count)
+        {
+            static_assert(alignof(T) <= alignment);
+            size_t bytes = (count * sizeof(T) + alignment - 1) / alignment * alignment;
+            auto it = slices.find(name);
+            if (it != slices.end() && it->second.capacity >= bytes)
+                return {reinterpret_cast<T *>(it->second.data), count};
+            if (it != slices.end())
+                released.push_back(it->second);
+
+            Slice slice = take(bytes);
+            slices[name] = slice;
+            return {reinterpret_cast<T *>(slice.data), count};
+        }
+
+        // Bytes of all chunks, including those not handed out yet
+        size_t getReservedBytes() const
+        {
+            size_t bytes = 0;
+            for (const auto &chunk : chunks)
+                bytes += chunk.size;
+            return bytes;
+        }
+
+    private:
+        struct Slice
+        {
+            char *data;
+            size_t capacity;
+        };
+
+        struct Chunk
+        {
+            char *data;
+            size_t size;
+            size_t used;
+        };
+
+        Slice take(size_t bytes)
+        {
+            // Smallest released slice that fits
+            auto best = released.end();
+            for (auto it = released.begin(); it != released.end(); ++it)
+            {
+                if (it->capacity >= bytes && (best == released.end() || it->capacity < best->capacity))
+                    best = it;
+            }
+            if (best != released.end())
+            {
+                Slice slice = *best;
+                released.erase(best);
+                return slice;
+            }
+
+            if (chunks.empty() || chunks.back().size - chunks.back().used < bytes)
+                chunks.push_back(map(std::max(chunkSize, bytes)));
+            Chunk &chunk = chunks.back();
+            Slice slice = {chunk.data + chunk.used, bytes};
+            chunk.used += bytes;
+            return slice;
+        }
+
+        Chunk map(size_t bytes)
+        {
+            bytes = (bytes + hugePageSize - 1) / hugePageSize * hugePageSize;
+            void *data = nullptr;
+#if defined(__linux__)
+            // Reserved huge pages first, then transparent huge pages, which the kernel may split
+            if (hugePages)
+                data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (data == nullptr || data == MAP_FAILED)
+            {
+                data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (data == MAP_FAILED)
+                    throw std::bad_alloc();
+                if (hugePages)
+                    madvise(data, bytes, MADV_HUGEPAGE);
+            }
+#elif defined(_WIN32)
+            data = _aligned_malloc(bytes, alignment);
+#else
+            data = std::aligned_alloc(alignment, bytes);
+#endif
+            if (data == nullptr)
+                throw std::bad_alloc();
+            return {static_cast<char *>(data), bytes, 0};
+        }
+
+        static void unmap(const Chunk &chunk)
+        {
+#if defined(__linux__)
+            munmap(chunk.data, chunk.size);
+#elif defined(_WIN32)
+            _aligned_free(chunk.data);
+#else
+            std::free(chunk.data);
+#endif
+        }
+
+        bool hugePages;
+        size_t chunkSize;
+        std::vector<Chunk> chunks;
+        std::unordered_map<std::string, Slice> slices;
+        std::vector<Slice> released;
+    };
+
+} // namespace host
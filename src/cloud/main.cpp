@@ -1,4 +1,7 @@
+#include <array>
 #include <filesystem>
+#include <memory>
+#include <string>
 
 #include <gl/glew.h>
 
@@ -13,6 +16,9 @@
 #include "controls/gui.h"
 
 #include "../util.h"
+#include "../gpu.h"
+#include "../program.h"
+#include "../properties.h"
 
 #include <imgui.h>
 #include <glm/gtc/random.hpp>
@@ -66,7 +72,7 @@ static inline float getAspectRatio()
     return static_cast<float>(m_viewport[2]) / static_cast<float>(m_viewport[3]);
 }
 
-static void buildGUI(float dt, controls::PropertySystem &properties)
+static void buildGUI(float dt, properties::Registry &properties)
 {
     ImGui::NewFrame();
 
@@ -101,13 +107,23 @@ static void setUniforms(graphics::Shader &shader, float dt)
     shader.setUniform("dt", dt);
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // --dump <path> saves a frame for comparing the CPU renderer against (3d-smoke-cpu --render
+    // cloud --compare <path>) and quits. Time stays at 0 so the noise is not moved by the wind.
+    std::string dumpPath;
+    const unsigned dumpFrame = 16; // The temporal accumulation has converged by then
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (std::string(argv[i]) == "--dump")
+            dumpPath = argv[++i];
+    }
+
     // Print current working directory:
     tlog::info() << "Current working directory: " << std::filesystem::current_path();
     tlog::info() << "Assets directory: " << ASSETS_PATH_RELATIVE;
 
-    auto propertiews = controls::PropertySystem(std::string(ASSETS_PATH_RELATIVE) + "/config/cloudProperties.json");
+    properties::Registry registry(std::string(ASSETS_PATH_RELATIVE) + "/config/cloudProperties.json");
 
     graphics::Window window("Cloud", 1920, 1080);
     glfwMakeContextCurrent(window.getGLFWWindow());
@@ -131,44 +147,114 @@ int main()
     controls::Mouse &mouse = *window.getContext().mouse;
 
     // Initalize the cube mesh
-    auto quad2DMesh = graphics::Mesh(geometry::quad2d::vertices(), geometry::quad2d::indices());
+    auto quad2DMesh = gpu::Mesh(geometry::quad2d::vertices(), geometry::quad2d::indices());
 
     // Compile shaders
     const std::string cloudShaderPath = std::string(ASSETS_PATH_RELATIVE) + "/shader/cloud";
-    auto cloudShader = graphics::Shader(std::vector<std::string>({cloudShaderPath + "/quad.vert", cloudShaderPath + "/quad.frag"}));
-
-    // Create noise textures
-    auto voronoiNoise = voronoi::composedVoronoiNoise(
-        propertiews.getValue<glm::ivec3>("voronoiResolution"),
-        propertiews.getValue<float>("c1"),
-        propertiews.getValue<float>("c2"),
-        propertiews.getValue<float>("c3"),
-        propertiews.getValue<float>("period"));
-    auto voronoiTex = graphics::Texture3D(
-        voronoiNoise,
-        propertiews.getValue<glm::ivec3>("voronoiResolution"));
-
-    auto fbmNoise = perlin::noiseFBM(
-        propertiews.getValue<glm::ivec3>("fbmResolution"),
-        propertiews.getValue<int>("octaveCount"),
-        propertiews.getValue<float>("persistence"),
-        propertiews.getValue<float>("lacunarity"),
-        propertiews.getValue<float>("amplitude"),
-        propertiews.getValue<float>("scale"),
-        propertiews.getValue<int>("seed"),
-        propertiews.getValue<float>("period"));
-    auto fbmTex = graphics::Texture3D(
-        fbmNoise,
-        propertiews.getValue<glm::ivec3>("fbmResolution"));
+    auto cloudShader = gpu::Program(std::vector<std::string>({cloudShaderPath + "/quad.vert", cloudShaderPath + "/quad.frag"}));
+    auto lightVolumeShader = gpu::Program(cloudShaderPath + "/lightVolume.comp");
+    auto resolveShader = gpu::Program(std::vector<std::string>({cloudShaderPath + "/quad.vert", cloudShaderPath + "/resolve.frag"}));
+    auto presentShader = gpu::Program(std::vector<std::string>({cloudShaderPath + "/quad.vert", cloudShaderPath + "/present.frag"}));
+    const std::vector<gpu::Program *> programs = {&cloudShader, &lightVolumeShader, &resolveShader, &presentShader};
+    gpu::buildPrograms(programs);
+
+    // Transmittance towards the light, swept from the light once per frame
+    auto lightVolume = gpu::Volume(glm::ivec3(64));
+
+    // The cloud is marched at renderScale times the window resolution with a sub pixel jitter
+    // cycling every 4 frames. The resolve pass upsamples it and blends it with the previous
+    // frame's reprojected result, ping-ponging between two full resolution history targets.
+    const float noCloudDepth = 1e+3f; // NO_CLOUD_DEPTH in camera.glsl
+    const std::vector<GLenum> targetFormats = {GL_RGBA16F, GL_R32F};
+    std::unique_ptr<gpu::RenderTarget> marchTarget;
+    std::array<std::unique_ptr<gpu::RenderTarget>, 2> historyTargets;
+    int historyIndex = 0;
+    bool historyValid = false;
+    unsigned frame = 0;
+    glm::vec3 prevEye(0), prevCenter(0), prevUp(0);
+    float prevFov = 0.0f, prevAspect = 1.0f;
+
+    // Properties are resolved once, edits mark them changed and only their uniforms are uploaded again
+    auto period = registry.get<float>("period");
+    auto voronoiResolution = registry.get<glm::ivec3>("voronoiResolution");
+    auto c1 = registry.get<float>("c1");
+    auto c2 = registry.get<float>("c2");
+    auto c3 = registry.get<float>("c3");
+    auto fbmResolution = registry.get<glm::ivec3>("fbmResolution");
+    auto amplitude = registry.get<float>("amplitude");
+    auto octaveCount = registry.get<int>("octaveCount");
+    auto persistence = registry.get<float>("persistence");
+    auto lacunarity = registry.get<float>("lacunarity");
+    auto scale = registry.get<float>("scale");
+    auto seed = registry.get<int>("seed");
+    auto reloadVoronoi = registry.get<bool>("reloadVoronoi");
+    auto reloadFBM = registry.get<bool>("reloadFBM");
+    auto lightPosition = registry.get<glm::vec3>("lightPosition");
+    auto renderScale = registry.get<float>("renderScale");
+    auto temporalReprojection = registry.get<bool>("temporalReprojection");
+    auto historyWeight = registry.get<float>("historyWeight");
+
+    // Each noise volume is only regenerated when one of its own parameters changed. Both are
+    // seamless tiles, the period only scales their texture coordinates.
+    auto voronoiGroup = properties::Group(voronoiResolution, c1, c2, c3);
+    auto fbmGroup = properties::Group(fbmResolution, octaveCount, persistence, lacunarity, amplitude, scale, seed);
+
+    for (const auto *name : {"border", "sampleStepSize", "henyeyGreen_G"})
+    {
+        auto handle = registry.get<float>(name);
+        registry.bindUniform(handle, cloudShader, name);
+        registry.bindUniform(handle, lightVolumeShader, name);
+    }
+    registry.bindUniform(period, cloudShader, "period");
+    registry.bindUniform(period, lightVolumeShader, "period");
+    registry.bindUniform(lightPosition, cloudShader, "lightPosition");
+    registry.bindUniform(lightPosition, lightVolumeShader, "lightPosition");
+    for (const auto *name : {"absorption", "henyeyGreen_K", "lightIntensity", "exposure", "gamma"})
+        registry.bindUniform(registry.get<float>(name), cloudShader, name);
+    for (const auto *name : {"cloudColor", "lightColor"})
+        registry.bindUniform(registry.get<glm::vec3>(name), cloudShader, name);
+    registry.bindUniform(registry.get<bool>("showVoronoi"), cloudShader, "showVoronoi");
+    registry.bindUniform(historyWeight, resolveShader, "historyWeight");
+
+    // Create noise textures. The host grids live in an arena and keep their memory across
+    // regenerations, the shaders only sample the red channel.
+    host::GridArena noiseArena;
+    auto cells = [](glm::ivec3 resolution) { return static_cast<size_t>(resolution.x) * resolution.y * resolution.z; };
+    auto voronoiNoise = noiseArena.grid<float>("voronoi", cells(*voronoiResolution));
+    // The feature points follow the seed as well, reloading draws new ones
+    uint32_t voronoiSeed = *seed;
+    voronoi::composedVoronoiNoise(voronoiNoise, *voronoiResolution, *c1, *c2, *c3, voronoiSeed);
+    auto voronoiTex = gpu::Volume(*voronoiResolution, GL_R32F, GL_REPEAT);
+    voronoiTex.upload(voronoiNoise.data(), glm::ivec3(0), *voronoiResolution);
+
+    auto fbmNoise = noiseArena.grid<float>("fbm", cells(*fbmResolution));
+    perlin::noiseFBM(fbmNoise, *fbmResolution, *octaveCount, *persistence, *lacunarity, *amplitude, *scale, *seed);
+    auto fbmTex = gpu::Volume(*fbmResolution, GL_R32F, GL_REPEAT);
+    fbmTex.upload(fbmNoise.data(), glm::ivec3(0), *fbmResolution);
+
+    // Regeneration while the app runs, see the update below
+    auto voronoiBack = gpu::Volume(*voronoiResolution, GL_R32F, GL_REPEAT);
+    auto fbmBack = gpu::Volume(*fbmResolution, GL_R32F, GL_REPEAT);
+    host::WorkerPool noiseWorkers;
+    host::SliceJob voronoiJob(noiseWorkers);
+    host::SliceJob fbmJob(noiseWorkers);
+    auto uploadSlices = [](gpu::Volume &volume, std::span<const float> values, int begin, int end) {
+        glm::ivec3 res = volume.resolution;
+        volume.upload(values.data() + static_cast<size_t>(begin) * res.x * res.y, glm::ivec3(0, 0, begin),
+                      glm::ivec3(res.x, res.y, end - begin));
+    };
 
     auto currTime = std::chrono::steady_clock::now();
     auto prevTime = currTime;
+    float time = 0.0f;
     while (!glfwWindowShouldClose(window.getGLFWWindow()))
     {
         // Calculate delta time between frames
         currTime = std::chrono::steady_clock::now();
         float dt = std::chrono::duration<float>(currTime - prevTime).count();
         prevTime = currTime;
+        if (dumpPath.empty())
+            time += dt;
 
         // Poll keyboard and mouse events
         mouse.beginFrame();
@@ -190,7 +276,9 @@ int main()
             // Reload shader
             if (keyboard.pressed(GLFW_KEY_R))
             {
-                cloudShader.reload();
+                gpu::buildPrograms(programs);
+                for (auto *shader : programs)
+                    registry.invalidate(*shader);
             }
             if (keyboard.pressed(GLFW_KEY_F1))
             {
@@ -219,71 +307,169 @@ int main()
 
         { // Update
             gui.preBuild();
-            buildGUI(dt, propertiews);
+            buildGUI(dt, registry);
+
+            registry.update();
 
-            if (propertiews.getValue<bool>("reloadFBM"))
+            // Noise is regenerated slice by slice on worker threads. Finished slices are uploaded
+            // to a back volume over the following frames, which replaces the sampled volume once
+            // complete. Changing a parameter again restarts the generation without waiting for
+            // the workers, slices still in flight for the old parameters are dropped.
+            if (fbmGroup.changed() || *reloadFBM)
             {
-                auto fbmResolution = propertiews.getValue<glm::ivec3>("fbmResolution");
-                fbmNoise = perlin::noiseFBM(
-                    fbmResolution,
-                    propertiews.getValue<int>("octaveCount"),
-                    propertiews.getValue<float>("persistence"),
-                    propertiews.getValue<float>("lacunarity"),
-                    propertiews.getValue<float>("amplitude"),
-                    propertiews.getValue<float>("scale"),
-                    propertiews.getValue<int>("seed"),
-                    propertiews.getValue<float>("period"));
-                if (glm::any(glm::lessThan(fbmTex.resolution, fbmResolution)))
+                fbmJob.cancel();
+                fbmNoise = noiseArena.grid<float>("fbm", cells(*fbmResolution));
+                if (fbmBack.resolution != *fbmResolution)
                 {
-                    fbmTex = graphics::Texture3D(fbmNoise, fbmResolution);
+                    fbmBack = gpu::Volume(*fbmResolution, GL_R32F, GL_REPEAT);
                 }
-                else
-                {
-                    fbmTex.update(fbmNoise, glm::ivec3(0), fbmResolution);
-                }
-                propertiews.setValue<bool>("reloadFBM", false);
+                auto slices = perlin::fbmSlices(*fbmResolution, *octaveCount, *persistence, *lacunarity, *amplitude, *scale, *seed);
+                fbmJob.start(fbmNoise, fbmResolution->z, slices);
+                if (*reloadFBM)
+                    reloadFBM.set(false);
             }
+            if (fbmJob.collect([&](int begin, int end) { uploadSlices(fbmBack, fbmNoise, begin, end); }))
+                std::swap(fbmTex, fbmBack);
 
-            if (propertiews.getValue<bool>("reloadVoronoi"))
+            if (voronoiGroup.changed() || *reloadVoronoi)
             {
-                auto voronoiResolution = propertiews.getValue<glm::ivec3>("voronoiResolution");
-                voronoiNoise = voronoiNoise = voronoi::composedVoronoiNoise(
-                    voronoiResolution,
-                    propertiews.getValue<float>("c1"),
-                    propertiews.getValue<float>("c2"),
-                    propertiews.getValue<float>("c3"),
-                    propertiews.getValue<float>("period"));
-                if (glm::any(glm::lessThan(voronoiTex.resolution, voronoiResolution)))
+                voronoiJob.cancel();
+                voronoiNoise = noiseArena.grid<float>("voronoi", cells(*voronoiResolution));
+                if (voronoiBack.resolution != *voronoiResolution)
                 {
-                    voronoiTex = graphics::Texture3D(voronoiNoise, voronoiResolution);
+                    voronoiBack = gpu::Volume(*voronoiResolution, GL_R32F, GL_REPEAT);
                 }
-                else
+                if (*reloadVoronoi)
                 {
-                    voronoiTex.update(voronoiNoise, glm::ivec3(0), voronoiResolution);
+                    voronoiSeed++;
+                    reloadVoronoi.set(false);
                 }
-                propertiews.setValue<bool>("reloadVoronoi", false);
+                auto slices = voronoi::composedVoronoiSlices(*voronoiResolution, *c1, *c2, *c3, voronoiSeed);
+                voronoiJob.start(voronoiNoise, voronoiResolution->z, slices);
             }
+            if (voronoiJob.collect([&](int begin, int end) { uploadSlices(voronoiBack, voronoiNoise, begin, end); }))
+                std::swap(voronoiTex, voronoiBack);
         }
 
         { // Render
-            // Render cloud
+            // Light transmittance for this frame's cloud density
+            voronoiTex.bindTexture(0);
+            fbmTex.bindTexture(1);
+            lightVolumeShader.bind();
+            registry.upload(lightVolumeShader);
+            lightVolumeShader.setUniform("voronoiTex", 0);
+            lightVolumeShader.setUniform("fbmTex", 1);
+            lightVolumeShader.setUniform("time", time);
+            lightVolumeShader.unbind();
+            // The cloud box is centered at the origin
+            gpu::sweepTowardsLight(lightVolumeShader, lightVolume, 0, *lightPosition);
+
+            // (Re)create the render targets for the current window size
+            glm::ivec2 framebufferSize;
+            glfwGetFramebufferSize(window.getGLFWWindow(), &framebufferSize.x, &framebufferSize.y);
+            framebufferSize = glm::max(framebufferSize, glm::ivec2(1));
+            auto marchSize = glm::max(glm::ivec2(glm::vec2(framebufferSize) * *renderScale), glm::ivec2(1));
+            if (!marchTarget || marchTarget->size != marchSize)
+            {
+                marchTarget = std::make_unique<gpu::RenderTarget>(marchSize, targetFormats);
+            }
+            if (!historyTargets[0] || historyTargets[0]->size != framebufferSize)
+            {
+                historyTargets[0] = std::make_unique<gpu::RenderTarget>(framebufferSize, targetFormats);
+                historyTargets[1] = std::make_unique<gpu::RenderTarget>(framebufferSize, targetFormats);
+                historyValid = false;
+            }
+            float aspect = static_cast<float>(framebufferSize.x) / static_cast<float>(framebufferSize.y);
+            bool temporal = *temporalReprojection;
+
+            // Quarter pixel offsets so four frames cover every low resolution pixel in a 2x2 pattern
+            glm::vec2 jitter(0);
+            if (temporal)
+            {
+                const glm::vec2 offsets[4] = {{-0.25f, -0.25f}, {0.25f, 0.25f}, {0.25f, -0.25f}, {-0.25f, 0.25f}};
+                jitter = offsets[frame % 4] / glm::vec2(marchSize);
+            }
+
+            // March the cloud at reduced resolution
+            glDisable(GL_BLEND);
+            marchTarget->bind();
+            marchTarget->clear(0, glm::vec4(0));
+            marchTarget->clear(1, glm::vec4(noCloudDepth));
             cloudShader.bind();
-            voronoiTex.bind(0);
-            fbmTex.bind(1);
+            registry.upload(cloudShader);
+            voronoiTex.bindTexture(0);
+            fbmTex.bindTexture(1);
+            lightVolume.bindTexture(2);
 
+            cloudShader.setUniform("time", time);
             cloudShader.setUniform("cameraEye", camera.getEye());
             cloudShader.setUniform("cameraCenter", camera.getCenter());
             cloudShader.setUniform("cameraUp", camera.getUp());
             cloudShader.setUniform("fovRad", glm::radians(camera.getFov()));
-            cloudShader.setUniform("aspect", getAspectRatio());
+            cloudShader.setUniform("aspect", aspect);
+            cloudShader.setUniform("pixelJitter", jitter);
             cloudShader.setUniform("voronoiTex", 0);
             cloudShader.setUniform("fbmTex", 1);
+            cloudShader.setUniform("lightVolume", 2);
             quad2DMesh.draw(cloudShader);
 
-            voronoiTex.unbind();
-            fbmTex.unbind();
             cloudShader.unbind();
 
+            // Upsample and accumulate into the next history target
+            auto &history = *historyTargets[historyIndex];
+            auto &resolved = *historyTargets[1 - historyIndex];
+            resolved.bind();
+            resolveShader.bind();
+            registry.upload(resolveShader);
+            marchTarget->bindTexture(0, 3);
+            marchTarget->bindTexture(1, 4);
+            history.bindTexture(0, 5);
+            history.bindTexture(1, 6);
+            resolveShader.setUniform("currentColor", 3);
+            resolveShader.setUniform("currentDepth", 4);
+            resolveShader.setUniform("historyColor", 5);
+            resolveShader.setUniform("historyDepth", 6);
+            resolveShader.setUniform("pixelJitter", jitter);
+            resolveShader.setUniform("useHistory", temporal && historyValid);
+            resolveShader.setUniform("cameraEye", camera.getEye());
+            resolveShader.setUniform("cameraCenter", camera.getCenter());
+            resolveShader.setUniform("cameraUp", camera.getUp());
+            resolveShader.setUniform("fovRad", glm::radians(camera.getFov()));
+            resolveShader.setUniform("aspect", aspect);
+            resolveShader.setUniform("prevCameraEye", prevEye);
+            resolveShader.setUniform("prevCameraCenter", prevCenter);
+            resolveShader.setUniform("prevCameraUp", prevUp);
+            resolveShader.setUniform("prevFovRad", prevFov);
+            resolveShader.setUniform("prevAspect", prevAspect);
+            quad2DMesh.draw(resolveShader);
+            resolveShader.unbind();
+
+            // Blend the result over the background
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(0, 0, framebufferSize.x, framebufferSize.y);
+            glEnable(GL_BLEND);
+            presentShader.bind();
+            resolved.bindTexture(0, 3);
+            presentShader.setUniform("image", 3);
+            quad2DMesh.draw(presentShader);
+            presentShader.unbind();
+
+            historyIndex = 1 - historyIndex;
+            historyValid = true;
+            prevEye = camera.getEye();
+            prevCenter = camera.getCenter();
+            prevUp = camera.getUp();
+            prevFov = glm::radians(camera.getFov());
+            prevAspect = aspect;
+            frame++;
+
+            if (!dumpPath.empty() && frame == dumpFrame)
+            {
+                gpu::saveFramebuffer(dumpPath, framebufferSize);
+                tlog::info() << "Saved " << framebufferSize.x << "x" << framebufferSize.y << " frame to " << dumpPath;
+                glfwSetWindowShouldClose(window.getGLFWWindow(), GLFW_TRUE);
+            }
+
             // Render GUI
             gui.render();
         }
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <tinylogger/tinylogger.h>
+#include <glm/glm.hpp>
+
+#include "graphics/window.h"
+
+#include "../gpu.h"
+#include "../program.h"
+#include "transport.h"
+
+#define ASSETS_PATH_RELATIVE "../assets"
+
+// Field ids as defined in smokeHeader.glsl
+#define FIELD_BIT(field) (1 << (field))
+#define U_FIELD 0
+#define V_FIELD 1
+#define W_FIELD 2
+#define NEXT_U_FIELD 3
+#define NEXT_V_FIELD 4
+#define NEXT_W_FIELD 5
+#define P_FIELD 7
+#define M_FIELD 8
+#define NEXT_M_FIELD 9
+#define HALO_FIELDS 14
+
+struct ClusterParams {
+    glm::ivec3 gridResolution = glm::ivec3(32, 32, 128);
+    float gridSpacing = 1.5f;
+    int totalIterations = 21;
+    glm::vec3 gravity = glm::vec3(0, 0, 9.81);
+    float overrelaxation = 0.91f;
+    float density = 0.002f;
+    float dt = 1/120.f;
+    int steps = 200;
+    int ranks = 1;
+    int rank = -1; // -1 launches all ranks on this machine
+    bool sweep = false;
+    std::string transport = "shm";
+    std::string session = "smoke";
+    uint64_t generation = 0; // Token of the run in the shared memory header, unique per run
+    std::vector<std::string> hosts = {"127.0.0.1"};
+    int port = 47000;
+};
+
+// Part of the domain simulated by one rank. The domain is split into slabs along z,
+// each padded with a one cell halo towards every neighbouring slab.
+struct Slab {
+    glm::ivec3 resolution; // Including halos
+    int offsetZ; // Domain z of the local z = 0 layer
+    bool hasLower;
+    bool hasUpper;
+};
+
+static std::vector<std::string> split(const std::string &value, char delimiter)
+{
+    std::vector<std::string> parts;
+    std::stringstream stream(value);
+    std::string part;
+    while (std::getline(stream, part, delimiter))
+        parts.push_back(part);
+    return parts;
+}
+
+static ClusterParams parseArguments(int argc, char **argv)
+{
+    ClusterParams params;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--sweep") {
+            params.sweep = true;
+            continue;
+        }
+
+        if (arg == "--ranks") {
+            params.ranks = std::stoi(value);
+        } else if (arg == "--rank") {
+            params.rank = std::stoi(value);
+        } else if (arg == "--steps") {
+            params.steps = std::stoi(value);
+        } else if (arg == "--iterations") {
+            params.totalIterations = std::stoi(value);
+        } else if (arg == "--transport") {
+            params.transport = value;
+        } else if (arg == "--session") {
+            params.session = value;
+        } else if (arg == "--generation") {
+            params.generation = std::stoull(value);
+        } else if (arg == "--hosts") {
+            params.hosts = split(value, ',');
+        } else if (arg == "--port") {
+            params.port = std::stoi(value);
+        } else if (arg == "--resolution") {
+            auto res = split(value, ',');
+            params.gridResolution = glm::ivec3(std::stoi(res.at(0)), std::stoi(res.at(1)), std::stoi(res.at(2)));
+        } else {
+            tlog::error() << "Unknown argument " << arg;
+            exit(EXIT_FAILURE);
+        }
+        i++;
+    }
+    return params;
+}
+
+static Slab computeSlab(const ClusterParams &params, int rank)
+{
+    int layers = params.gridResolution.z / params.ranks;
+    int remainder = params.gridResolution.z % params.ranks;
+    int owned = layers + (rank < remainder ? 1 : 0);
+    int begin = rank * layers + std::min(rank, remainder);
+
+    Slab slab;
+    slab.hasLower = rank > 0;
+    slab.hasUpper = rank < params.ranks - 1;
+    slab.offsetZ = begin - (slab.hasLower ? 1 : 0);
+    slab.resolution = glm::ivec3(params.gridResolution.x, params.gridResolution.y,
+                                 owned + (slab.hasLower ? 1 : 0) + (slab.hasUpper ? 1 : 0));
+    return slab;
+}
+
+static void initGLEW()
+{
+    GLenum err = glewInit();
+    if (GLEW_OK != err)
+    {
+        tlog::error() << "Error: " << glewGetErrorString(err);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void initGLFW(graphics::Window &window, int rank)
+{
+    // Ranks only compute, so their windows are never shown
+    glfwInit();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    std::string title = "3d-smoke-cluster rank " + std::to_string(rank);
+    if (!window.init(title.c_str(), 1, 1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    glfwMakeContextCurrent(window.getGLFWWindow());
+}
+
+static void setUniforms(gpu::Program &shader, const ClusterParams &params, const Slab &slab)
+{
+    shader.bind();
+    shader.setUniform("gridResolution", glm::vec3(slab.resolution));
+    shader.setUniform("domainOffset", glm::ivec3(0, 0, slab.offsetZ));
+    shader.setUniform("domainResolution", glm::vec3(params.gridResolution));
+    shader.setUniform("dt", params.dt);
+    shader.setUniform("gridSpacing", params.gridSpacing);
+    shader.setUniform("overrelaxation", params.overrelaxation);
+    shader.setUniform("gravity", params.gravity);
+    shader.setUniform("density", params.density);
+    shader.setUniform("totalIterations", params.totalIterations);
+    shader.setUniform("reset", false);
+    shader.setUniform("hasLower", slab.hasLower);
+    shader.setUniform("hasUpper", slab.hasUpper);
+    shader.unbind();
+}
+
+// Moves halo layers between the GPU of this rank and its neighbours. Fields are packed on
+// the GPU, read back, passed on through the transport and unpacked into the halo layers.
+class HaloExchange
+{
+public:
+    HaloExchange(cluster::Transport &transport, const Slab &slab, gpu::Program &pack, gpu::Program &unpack)
+        : transport(transport), slab(slab), pack(pack), unpack(unpack),
+          slotSize((slab.resolution.x + 1) * (slab.resolution.y + 1)),
+          buffer(4 * HALO_FIELDS * 2 * slotSize * sizeof(float), 17),
+          sendLower(messageSize()), sendUpper(messageSize()), receiveLower(messageSize()), receiveUpper(messageSize())
+    {
+    }
+
+    // Largest message, sent when every field is exchanged
+    static size_t maxMessageBytes(const Slab &slab)
+    {
+        return HALO_FIELDS * 2 * (slab.resolution.x + 1) * (slab.resolution.y + 1) * sizeof(float);
+    }
+
+    void exchange(int fields, int projectionPass = -1)
+    {
+        if (fields == 0 || (!slab.hasLower && !slab.hasUpper))
+            return;
+        auto start = std::chrono::steady_clock::now();
+
+        pack.bind();
+        pack.setUniform("haloFields", fields);
+        pack.unbind();
+        pack.dispatch(dispatchSize());
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+        size_t bytes = 0;
+        for (int field = 0; field < HALO_FIELDS; field++)
+        {
+            if ((fields & FIELD_BIT(field)) == 0)
+                continue;
+            if (slab.hasLower)
+                glGetNamedBufferSubData(buffer.getID(), offset(SEND_LOWER, field), 2 * slotBytes(), sendLower.data() + bytes / sizeof(float));
+            if (slab.hasUpper)
+                glGetNamedBufferSubData(buffer.getID(), offset(SEND_UPPER, field), 2 * slotBytes(), sendUpper.data() + bytes / sizeof(float));
+            bytes += 2 * slotBytes();
+        }
+
+        // Every rank first sends up and then receives from below, then the other way round.
+        // The top rank only receives in the first phase and the bottom rank in the second,
+        // which ends each chain of blocking sends.
+        int rank = transport.rank;
+        if (slab.hasUpper)
+            transport.send(rank + 1, sendUpper.data(), bytes);
+        if (slab.hasLower)
+            transport.receive(rank - 1, receiveLower.data(), bytes);
+        if (slab.hasLower)
+            transport.send(rank - 1, sendLower.data(), bytes);
+        if (slab.hasUpper)
+            transport.receive(rank + 1, receiveUpper.data(), bytes);
+
+        bytes = 0;
+        for (int field = 0; field < HALO_FIELDS; field++)
+        {
+            if ((fields & FIELD_BIT(field)) == 0)
+                continue;
+            if (slab.hasLower)
+                glNamedBufferSubData(buffer.getID(), offset(RECEIVE_LOWER, field), 2 * slotBytes(), receiveLower.data() + bytes / sizeof(float));
+            if (slab.hasUpper)
+                glNamedBufferSubData(buffer.getID(), offset(RECEIVE_UPPER, field), 2 * slotBytes(), receiveUpper.data() + bytes / sizeof(float));
+            bytes += 2 * slotBytes();
+        }
+
+        unpack.bind();
+        unpack.setUniform("haloFields", fields);
+        unpack.setUniform("projectionPass", projectionPass);
+        unpack.unbind();
+        unpack.dispatch(dispatchSize());
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+        exchangeTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    double exchangeTime = 0.0;
+
+private:
+    // Regions of the halo buffer, see haloHeader.glsl
+    enum Region {
+        SEND_LOWER = 0,
+        SEND_UPPER = 1,
+        RECEIVE_LOWER = 2,
+        RECEIVE_UPPER = 3
+    };
+
+    size_t slotBytes() const { return slotSize * sizeof(float); }
+    size_t messageSize() const { return HALO_FIELDS * 2 * slotSize; }
+    GLintptr offset(Region region, int field) const { return (region * HALO_FIELDS + field) * 2 * slotBytes(); }
+    glm::ivec3 dispatchSize() const { return glm::ivec3((slab.resolution.x + 1) / 8 + 1, (slab.resolution.y + 1) / 8 + 1, 1); }
+
+    cluster::Transport &transport;
+    const Slab &slab;
+    gpu::Program &pack;
+    gpu::Program &unpack;
+    int slotSize;
+    gpu::Buffer buffer;
+    std::vector<float> sendLower;
+    std::vector<float> sendUpper;
+    std::vector<float> receiveLower;
+    std::vector<float> receiveUpper;
+};
+
+static int runRank(const ClusterParams &params)
+{
+    Slab slab = computeSlab(params, params.rank);
+
+    std::unique_ptr<cluster::Transport> transport;
+    if (params.transport == "socket")
+    {
+        transport = std::make_unique<cluster::SocketTransport>(params.rank, params.ranks, params.hosts, params.port);
+    }
+    else
+    {
+        transport = std::make_unique<cluster::SharedMemoryTransport>(
+            params.rank, params.ranks, "/" + params.session, HaloExchange::maxMessageBytes(slab), params.generation);
+    }
+
+    graphics::Window window;
+    initGLFW(window, params.rank);
+    initGLEW();
+
+    // Compile shaders
+    const std::string smokeShaders = std::string(ASSETS_PATH_RELATIVE) + "/shader/smoke";
+    auto applyGravityShader = gpu::Program(smokeShaders + "/3d/applyGravity.comp");
+    auto forceIncompressibility = gpu::Program(smokeShaders + "/3d/forceIncompressibility.comp");
+    auto extrapolate = gpu::Program(smokeShaders + "/3d/extrapolate.comp");
+    auto advectVelocities = gpu::Program(smokeShaders + "/3d/advectVelocities.comp");
+    auto copyVelocityBuffer = gpu::Program(smokeShaders + "/3d/copyVelocityBuffer.comp");
+    auto advectSmoke = gpu::Program(smokeShaders + "/3d/advectSmoke.comp");
+    auto copySmokeBuffer = gpu::Program(smokeShaders + "/3d/copySmokeBuffer.comp");
+    auto packHalo = gpu::Program(smokeShaders + "/3d/packHalo.comp");
+    auto unpackHalo = gpu::Program(smokeShaders + "/3d/unpackHalo.comp");
+    const std::vector<gpu::Program *> programs = {&applyGravityShader, &forceIncompressibility, &extrapolate, &advectVelocities,
+                                                  &copyVelocityBuffer, &advectSmoke, &copySmokeBuffer, &packHalo, &unpackHalo};
+
+    // Every rank specializes the programs for its own slab, the cluster only runs semi-Lagrangian advection
+    const gpu::Defines slabDefines = {
+        {"GRID_X", std::to_string(slab.resolution.x)},
+        {"GRID_Y", std::to_string(slab.resolution.y)},
+        {"GRID_Z", std::to_string(slab.resolution.z)},
+        {"VELOCITY_ADVECTION", "ADVECTION_SEMI_LAGRANGIAN"},
+        {"SMOKE_ADVECTION", "ADVECTION_SEMI_LAGRANGIAN"},
+        {"WARM_START", "0"},
+    };
+    for (auto *shader : programs)
+        shader->specialize(slabDefines);
+    gpu::buildPrograms(programs);
+    for (auto *shader : programs)
+    {
+        setUniforms(*shader, params, slab);
+    }
+
+    // Initialize SSBOs of the local sub-grid
+    auto res = slab.resolution;
+    GLsizeiptr uBytes = (res.x + 1) * res.y * res.z * sizeof(float);
+    GLsizeiptr vBytes = res.x * (res.y + 1) * res.z * sizeof(float);
+    GLsizeiptr wBytes = res.x * res.y * (res.z + 1) * sizeof(float);
+    GLsizeiptr cellBytes = res.x * res.y * res.z * sizeof(float);
+    std::vector<gpu::Buffer> fields;
+    fields.emplace_back(uBytes, 0);
+    fields.emplace_back(vBytes, 1);
+    fields.emplace_back(wBytes, 2);
+    fields.emplace_back(uBytes, 3);
+    fields.emplace_back(vBytes, 4);
+    fields.emplace_back(wBytes, 5);
+    fields.emplace_back(cellBytes, 6);
+    fields.emplace_back(cellBytes, 7);
+    fields.emplace_back(cellBytes, 8);
+    fields.emplace_back(cellBytes, 9);
+    for (int i = 0; i < 6; i++)
+        fields[i].clear(0.f);
+    for (int i = 6; i < 10; i++)
+        fields[i].clear(1.f);
+
+    HaloExchange halo(*transport, slab, packHalo, unpackHalo);
+    // Staggered faces reach one past the last cell
+    auto invocations = res + 1;
+
+    auto stage = [&](gpu::Program &shader, int haloFields, int projectionPass = -1)
+    {
+        shader.dispatchFor(invocations);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+        halo.exchange(haloFields, projectionPass);
+    };
+
+    const int velocities = FIELD_BIT(U_FIELD) | FIELD_BIT(V_FIELD) | FIELD_BIT(W_FIELD);
+    const int nextVelocities = FIELD_BIT(NEXT_U_FIELD) | FIELD_BIT(NEXT_V_FIELD) | FIELD_BIT(NEXT_W_FIELD);
+
+    transport->barrier();
+    glFinish();
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < params.steps; step++)
+    {
+        stage(applyGravityShader, velocities | FIELD_BIT(P_FIELD) | FIELD_BIT(M_FIELD));
+        for (int i = 0; i < 2 * params.totalIterations; i++)
+        {
+            forceIncompressibility.bind();
+            forceIncompressibility.setUniform("currentIteration", i);
+            forceIncompressibility.unbind();
+            stage(forceIncompressibility, velocities | FIELD_BIT(P_FIELD), i);
+        }
+        stage(extrapolate, velocities);
+        stage(advectVelocities, nextVelocities);
+        // Copies are pointwise and keep consistent halos consistent
+        stage(copyVelocityBuffer, 0);
+        stage(advectSmoke, FIELD_BIT(NEXT_M_FIELD));
+        stage(copySmokeBuffer, 0);
+    }
+    glFinish();
+    transport->barrier();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    tlog::info() << "Rank " << params.rank << "/" << params.ranks << ": z " << slab.offsetZ << "+" << res.z
+                 << ", " << 1000.0 * seconds / params.steps << " ms/step, "
+                 << 1000.0 * halo.exchangeTime / params.steps << " ms/step in halo exchange";
+    if (params.rank == 0)
+    {
+        tlog::info() << "Scaling: " << params.ranks << " ranks, " << params.gridResolution.x << "x" << params.gridResolution.y
+                     << "x" << params.gridResolution.z << ", " << 1000.0 * seconds / params.steps << " ms/step";
+    }
+    return EXIT_SUCCESS;
+}
+
+// Starts every rank as a child process on this machine and waits for all of them
+static int launchRanks(const ClusterParams &params, char **argv, int ranks)
+{
+    std::string session = params.session + "-" + std::to_string(getpid()) + "-" + std::to_string(ranks);
+    std::random_device random;
+    uint64_t generation = (static_cast<uint64_t>(random()) << 32 | random()) ^ std::chrono::steady_clock::now().time_since_epoch().count();
+    std::string hosts;
+    for (const auto &host : params.hosts)
+        hosts += (hosts.empty() ? "" : ",") + host;
+    std::vector<pid_t> children;
+    for (int rank = 0; rank < ranks; rank++)
+    {
+        std::vector<std::string> args = {
+            argv[0],
+            "--rank", std::to_string(rank),
+            "--ranks", std::to_string(ranks),
+            "--steps", std::to_string(params.steps),
+            "--iterations", std::to_string(params.totalIterations),
+            "--transport", params.transport,
+            "--session", session,
+            "--generation", std::to_string(generation),
+            "--hosts", hosts,
+            "--port", std::to_string(params.port),
+            "--resolution", std::to_string(params.gridResolution.x) + "," + std::to_string(params.gridResolution.y) + "," + std::to_string(params.gridResolution.z)};
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            std::vector<char *> childArgv;
+            for (auto &arg : args)
+                childArgv.push_back(arg.data());
+            childArgv.push_back(nullptr);
+            execvp(argv[0], childArgv.data());
+            _exit(EXIT_FAILURE);
+        }
+        children.push_back(pid);
+    }
+
+    int result = EXIT_SUCCESS;
+    for (pid_t child : children)
+    {
+        int status = 0;
+        waitpid(child, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            result = EXIT_FAILURE;
+    }
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    tlog::info() << "Current working directory: " << std::filesystem::current_path();
+    tlog::info() << "Assets directory: " << ASSETS_PATH_RELATIVE;
+
+    auto params = parseArguments(argc, argv);
+
+    if (params.rank >= 0)
+    {
+        return runRank(params);
+    }
+
+    if (params.sweep)
+    {
+        // Scaling measurement on one machine
+        int result = EXIT_SUCCESS;
+        for (int ranks : {1, 2, 4, 8})
+        {
+            if (launchRanks(params, argv, ranks) != EXIT_SUCCESS)
+                result = EXIT_FAILURE;
+        }
+        return result;
+    }
+
+    return launchRanks(params, argv, params.ranks);
+}
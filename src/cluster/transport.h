@@ -0,0 +1,304 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cluster
+{
+    // Point to point message passing between the ranks of a split simulation.
+    // send blocks until the receiver can take the message, so callers have to order
+    // their sends and receives such that every chain of sends ends in a receive.
+    class Transport
+    {
+    public:
+        Transport(int rank, int size) : rank(rank), size(size) {}
+        virtual ~Transport() = default;
+
+        virtual void send(int peer, const void *data, size_t bytes) = 0;
+        virtual void receive(int peer, void *data, size_t bytes) = 0;
+
+        // Blocks until every rank reached the barrier
+        void barrier()
+        {
+            char token = 0;
+            if (rank == 0)
+            {
+                for (int peer = 1; peer < size; peer++)
+                    receive(peer, &token, 1);
+                for (int peer = 1; peer < size; peer++)
+                    send(peer, &token, 1);
+            }
+            else
+            {
+                send(0, &token, 1);
+                receive(0, &token, 1);
+            }
+        }
+
+        const int rank;
+        const int size;
+    };
+
+    // Transport for ranks on the same machine. One shared memory segment holds a
+    // single slot mailbox for every ordered pair of ranks. Rank 0 creates the segment
+    // and publishes the generation token of the run in its header last, the other ranks
+    // only use a segment carrying their token, never one left behind by an earlier run.
+    class SharedMemoryTransport : public Transport
+    {
+    public:
+        SharedMemoryTransport(int rank, int size, const std::string &name, size_t capacity, uint64_t generation)
+            : Transport(rank, size), name(name), capacity(capacity)
+        {
+            static_assert(std::atomic<uint32_t>::is_always_lock_free, "Mailboxes need address free atomics");
+            static_assert(std::atomic<uint64_t>::is_always_lock_free, "The header needs address free atomics");
+            slotSize = (sizeof(Slot) + capacity + 63) / 64 * 64;
+            mappedSize = HEADER_SIZE + slotSize * size * size;
+
+            if (rank == 0)
+            {
+                shm_unlink(name.c_str());
+                int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+                if (fd < 0 || ftruncate(fd, mappedSize) != 0)
+                    throw std::runtime_error("Failed to create shared memory segment " + name + ": " + std::strerror(errno));
+                map(fd);
+                Header &header = getHeader();
+                header.size = size;
+                header.capacity = capacity;
+                header.generation.store(generation, std::memory_order_release);
+            }
+            else
+            {
+                // Wait until rank 0 created the segment of this run and published its header
+                while (true)
+                {
+                    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+                    struct stat info = {};
+                    if (fd >= 0 && fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) == mappedSize)
+                    {
+                        map(fd);
+                        Header &header = getHeader();
+                        if (header.generation.load(std::memory_order_acquire) == generation && header.size == static_cast<uint32_t>(size) && header.capacity == capacity)
+                            break;
+                        munmap(memory, mappedSize);
+                        memory = nullptr;
+                    }
+                    else if (fd >= 0)
+                    {
+                        close(fd);
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+
+        ~SharedMemoryTransport() override
+        {
+            munmap(memory, mappedSize);
+            if (rank == 0)
+                shm_unlink(name.c_str());
+        }
+
+        void send(int peer, const void *data, size_t bytes) override
+        {
+            Slot &slot = getSlot(rank, peer);
+            if (bytes > capacity)
+                throw std::runtime_error("Message exceeds shared memory slot capacity");
+            while (slot.full.load(std::memory_order_acquire) != 0)
+                std::this_thread::yield();
+            slot.bytes = bytes;
+            std::memcpy(slot.payload(), data, bytes);
+            slot.full.store(1, std::memory_order_release);
+        }
+
+        void receive(int peer, void *data, size_t bytes) override
+        {
+            Slot &slot = getSlot(peer, rank);
+            while (slot.full.load(std::memory_order_acquire) == 0)
+                std::this_thread::yield();
+            if (slot.bytes != bytes)
+                throw std::runtime_error("Unexpected message size from rank " + std::to_string(peer));
+            std::memcpy(data, slot.payload(), bytes);
+            slot.full.store(0, std::memory_order_release);
+        }
+
+    private:
+        static constexpr size_t HEADER_SIZE = 64;
+
+        struct Header
+        {
+            std::atomic<uint64_t> generation;
+            uint32_t size;
+            uint64_t capacity;
+        };
+
+        struct Slot
+        {
+            std::atomic<uint32_t> full;
+            uint64_t bytes;
+
+            char *payload() { return reinterpret_cast<char *>(this) + sizeof(Slot); }
+        };
+
+        // Maps the segment and closes its descriptor
+        void map(int fd)
+        {
+            void *mapped = mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mapped == MAP_FAILED)
+                throw std::runtime_error("Failed to map shared memory segment " + name);
+            memory = static_cast<char *>(mapped);
+        }
+
+        Header &getHeader()
+        {
+            return *reinterpret_cast<Header *>(memory);
+        }
+
+        Slot &getSlot(int from, int to)
+        {
+            return *reinterpret_cast<Slot *>(memory + HEADER_SIZE + (from * size + to) * slotSize);
+        }
+
+        std::string name;
+        size_t capacity;
+        size_t slotSize;
+        size_t mappedSize;
+        char *memory = nullptr;
+    };
+
+    // Transport over TCP for ranks on different machines. Every rank listens on
+    // basePort + rank, connects to all lower ranks and accepts all higher ones.
+    class SocketTransport : public Transport
+    {
+    public:
+        SocketTransport(int rank, int size, const std::vector<std::string> &hosts, uint16_t basePort)
+            : Transport(rank, size), sockets(size, -1)
+        {
+            int listener = socket(AF_INET, SOCK_STREAM, 0);
+            int reuse = 1;
+            setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_ANY);
+            address.sin_port = htons(basePort + rank);
+            if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, size) != 0)
+                throw std::runtime_error("Failed to listen on port " + std::to_string(basePort + rank) + ": " + std::strerror(errno));
+
+            for (int peer = 0; peer < rank; peer++)
+            {
+                sockets[peer] = connectTo(hosts[peer % hosts.size()], basePort + peer);
+                writeAll(sockets[peer], &rank, sizeof(rank));
+            }
+
+            for (int accepted = rank + 1; accepted < size; accepted++)
+            {
+                int connection = accept(listener, nullptr, nullptr);
+                if (connection < 0)
+                    throw std::runtime_error(std::string("Failed to accept connection: ") + std::strerror(errno));
+                int peer = -1;
+                readAll(connection, &peer, sizeof(peer));
+                if (peer <= rank || peer >= size || sockets[peer] != -1)
+                    throw std::runtime_error("Unexpected connection from rank " + std::to_string(peer));
+                sockets[peer] = connection;
+            }
+            close(listener);
+
+            for (int socket : sockets)
+            {
+                int noDelay = 1;
+                if (socket >= 0)
+                    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            }
+        }
+
+        ~SocketTransport() override
+        {
+            for (int socket : sockets)
+            {
+                if (socket >= 0)
+                    close(socket);
+            }
+        }
+
+        void send(int peer, const void *data, size_t bytes) override
+        {
+            writeAll(sockets[peer], data, bytes);
+        }
+
+        void receive(int peer, void *data, size_t bytes) override
+        {
+            readAll(sockets[peer], data, bytes);
+        }
+
+    private:
+        static int connectTo(const std::string &host, uint16_t port)
+        {
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            if (inet_pton(AF_INET, host.c_str(), &address.sin_addr) != 1)
+                throw std::runtime_error("Invalid host address " + host);
+
+            // The peer may not be listening yet
+            while (true)
+            {
+                int connection = socket(AF_INET, SOCK_STREAM, 0);
+                if (connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+                    return connection;
+                close(connection);
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+
+        static void writeAll(int socket, const void *data, size_t bytes)
+        {
+            auto *bytePtr = static_cast<const char *>(data);
+            while (bytes > 0)
+            {
+                ssize_t written = ::send(socket, bytePtr, bytes, MSG_NOSIGNAL);
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    throw std::runtime_error(std::string("Socket send failed: ") + std::strerror(errno));
+                bytePtr += written;
+                bytes -= written;
+            }
+        }
+
+        static void readAll(int socket, void *data, size_t bytes)
+        {
+            auto *bytePtr = static_cast<char *>(data);
+            while (bytes > 0)
+            {
+                ssize_t received = ::recv(socket, bytePtr, bytes, 0);
+                if (received < 0 && errno == EINTR)
+                    continue;
+                if (received <= 0)
+                    throw std::runtime_error(std::string("Socket receive failed: ") + std::strerror(errno));
+                bytePtr += received;
+                bytes -= received;
+            }
+        }
+
+        std::vector<int> sockets;
+    };
+
+} // namespace cluster
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <tinylogger/tinylogger.h>
+#include <glm/glm.hpp>
+
+#include "controls/gui.h"
+
+#include "../util.h"
+#include "renderer.h"
+#include "scheduler.h"
+#include "solver.h"
+
+#ifdef _WIN32
+#define ASSETS_PATH_RELATIVE "../../assets"
+#else
+#define ASSETS_PATH_RELATIVE "../assets"
+#endif
+
+struct CPUParams {
+    cpu::SolverParams solver;
+    int steps = 100;
+    int stepsPerGraph = 10;
+    unsigned threads = std::thread::hardware_concurrency();
+    bool compare = false;
+    float tolerance = 0.f; // Reports iterations to this residual with and without warm start if set
+
+    // Rendering of the final state, "smoke" or "cloud"
+    std::string render;
+    int width = 1280;
+    int height = 720;
+    int frames = 1;
+    std::string output = "render.ppm";
+    std::string reference; // Image of the GL app the render is compared against, see gpu::saveFramebuffer
+};
+
+static glm::ivec3 parseVector(const std::string &value)
+{
+    std::vector<int> parts;
+    std::stringstream stream(value);
+    std::string part;
+    while (std::getline(stream, part, ','))
+        parts.push_back(std::stoi(part));
+    return glm::ivec3(parts.at(0), parts.at(1), parts.at(2));
+}
+
+static CPUParams parseArguments(int argc, char **argv)
+{
+    CPUParams params;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--barriers") {
+            params.solver.globalBarriers = true;
+            continue;
+        }
+        if (arg == "--compare" && (value.empty() || value.starts_with("--"))) {
+            params.compare = true;
+            continue;
+        }
+        if (arg == "--warm-start") {
+            params.solver.warmStart = true;
+            continue;
+        }
+        if (arg == "--small-pages") {
+            params.solver.hugePages = false;
+            continue;
+        }
+
+        if (arg == "--threads") {
+            params.threads = std::stoi(value);
+        } else if (arg == "--steps") {
+            params.steps = std::stoi(value);
+        } else if (arg == "--steps-per-graph") {
+            params.stepsPerGraph = std::stoi(value);
+        } else if (arg == "--iterations") {
+            params.solver.totalIterations = std::stoi(value);
+        } else if (arg == "--resolution") {
+            params.solver.gridResolution = parseVector(value);
+        } else if (arg == "--brick") {
+            params.solver.brickSize = parseVector(value);
+        } else if (arg == "--tolerance") {
+            params.tolerance = std::stof(value);
+        } else if (arg == "--render") {
+            params.render = value;
+        } else if (arg == "--width") {
+            params.width = std::stoi(value);
+        } else if (arg == "--height") {
+            params.height = std::stoi(value);
+        } else if (arg == "--frames") {
+            params.frames = std::stoi(value);
+        } else if (arg == "--output") {
+            params.output = value;
+        } else if (arg == "--compare") {
+            params.reference = value;
+        } else {
+            tlog::error() << "Unknown argument " << arg;
+            exit(EXIT_FAILURE);
+        }
+        i++;
+    }
+    return params;
+}
+
+// Simulates the requested number of steps and returns the milliseconds per step
+static double simulate(const CPUParams &params, cpu::SmokeSolver &solver, cpu::ThreadPool &pool)
+{
+    const auto &solverParams = solver.params;
+
+    // Consecutive steps share one graph so the next step's bricks can start early
+    cpu::TaskGraph graph;
+    solver.schedule(graph, params.stepsPerGraph);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < params.steps; step += params.stepsPerGraph)
+        pool.run(graph);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    const auto &smoke = solver.getField(cpu::M_FIELD);
+    double smokeAmount = smoke.size() - std::accumulate(smoke.begin(), smoke.end(), 0.0);
+    int steps = (params.steps + params.stepsPerGraph - 1) / params.stepsPerGraph * params.stepsPerGraph;
+    tlog::info() << (solverParams.globalBarriers ? "Global barriers: " : "Brick dependencies: ")
+                 << ms / steps << "ms/step, " << graph.size() << " tasks per graph, smoke " << smokeAmount;
+    return ms / steps;
+}
+
+// Runs the requested number of steps without and with warm start and reports how many
+// projection sweeps each needed on average to reach the tolerance
+static void measureConvergence(const CPUParams &params, cpu::ThreadPool &pool)
+{
+    for (bool warmStart : {false, true})
+    {
+        auto solverParams = params.solver;
+        solverParams.warmStart = warmStart;
+        cpu::SmokeSolver solver(solverParams, pool);
+
+        double sweeps = 0;
+        int unconverged = 0;
+        for (int step = 0; step < params.steps; step++)
+        {
+            int needed = solver.stepToTolerance(pool, params.tolerance);
+            unconverged += needed > solverParams.totalIterations;
+            sweeps += std::min(needed, solverParams.totalIterations);
+        }
+        tlog::info() << (warmStart ? "Warm start: " : "Cold start: ") << sweeps / params.steps << " of "
+                     << solverParams.totalIterations << " iterations to residual " << params.tolerance << ", "
+                     << unconverged << " of " << params.steps << " steps did not reach it, final residual " << solver.residual();
+    }
+}
+
+// Reports how far the image is from the reference and writes their difference, amplified
+// 4 times, next to the output
+static void compareImages(const CPUParams &params, const cpu::Image &image)
+{
+    cpu::Image reference(0, 0);
+    try
+    {
+        reference = cpu::Image::readPPM(params.reference);
+    }
+    catch (const std::runtime_error &error)
+    {
+        tlog::error() << error.what();
+        return;
+    }
+    if (reference.width != image.width || reference.height != image.height)
+    {
+        tlog::error() << "Reference " << params.reference << " is " << reference.width << "x" << reference.height
+                      << ", render it with --width " << reference.width << " --height " << reference.height;
+        return;
+    }
+
+    cpu::Image difference(image.width, image.height);
+    double squaredError = 0;
+    float maxError = 0;
+    size_t differing = 0;
+    for (size_t i = 0; i < image.pixels.size(); i++)
+    {
+        // Quantized like the written image
+        glm::vec3 pixel = glm::floor(glm::clamp(image.pixels[i], 0.f, 1.f) * 255.f + 0.5f) / 255.f;
+        glm::vec3 error = glm::abs(pixel - reference.pixels[i]);
+        squaredError += glm::dot(error, error) / 3;
+        maxError = std::max(maxError, std::max(error.r, std::max(error.g, error.b)));
+        differing += std::max(error.r, std::max(error.g, error.b)) > 4.f / 255.f;
+        difference.pixels[i] = 4.f * error;
+    }
+    std::string differencePath = params.output.substr(0, params.output.rfind('.')) + "_diff.ppm";
+    difference.writePPM(differencePath);
+    tlog::info() << "Compared to " << params.reference << ": RMS error " << std::sqrt(squaredError / image.pixels.size()) * 255
+                 << ", max error " << maxError * 255 << " (of 255), " << 100.0 * differing / image.pixels.size()
+                 << "% of the pixels differ by more than 4, difference saved to " << differencePath;
+}
+
+// Renders the requested number of frames and writes the last one
+template <typename Renderer>
+static void render(const CPUParams &params, Renderer &renderer, const cpu::Camera &camera, cpu::ThreadPool &pool)
+{
+    cpu::Image image(params.width, params.height);
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < params.frames; frame++)
+        renderer.render(pool, image, camera);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    tlog::info() << "Rendered " << params.width << "x" << params.height << " in " << ms / params.frames << "ms/frame";
+    image.writePPM(params.output);
+    tlog::info() << "Saved " << params.output;
+    if (!params.reference.empty())
+        compareImages(params, image);
+}
+
+// Cloud of the cloud app with the current values of its property file
+static void renderCloud(const CPUParams &params, cpu::ThreadPool &pool)
+{
+    std::string path = std::string(ASSETS_PATH_RELATIVE) + "/config/cloudProperties.json";
+    if (!std::filesystem::exists(path))
+    {
+        tlog::error() << "Missing property file " << path;
+        return;
+    }
+    auto properties = controls::PropertySystem(path);
+
+    host::GridArena arena(params.solver.hugePages);
+    auto noise = [&](const char *name, glm::ivec3 resolution) {
+        return arena.grid<float>(name, static_cast<size_t>(resolution.x) * resolution.y * resolution.z);
+    };
+    auto toTexture = [](std::span<const float> noise, glm::ivec3 resolution) {
+        return cpu::NoiseTexture{resolution, std::vector<float>(noise.begin(), noise.end())};
+    };
+
+    auto voronoiResolution = properties.getValue<glm::ivec3>("voronoiResolution");
+    auto voronoiNoise = noise("voronoi", voronoiResolution);
+    voronoi::composedVoronoiNoise(voronoiNoise, voronoiResolution,
+        properties.getValue<float>("c1"), properties.getValue<float>("c2"), properties.getValue<float>("c3"),
+        properties.getValue<int>("seed"));
+
+    auto fbmResolution = properties.getValue<glm::ivec3>("fbmResolution");
+    auto fbmNoise = noise("fbm", fbmResolution);
+    perlin::noiseFBM(fbmNoise, fbmResolution, properties.getValue<int>("octaveCount"),
+        properties.getValue<float>("persistence"), properties.getValue<float>("lacunarity"),
+        properties.getValue<float>("amplitude"), properties.getValue<float>("scale"),
+        properties.getValue<int>("seed"));
+
+    cpu::CloudRenderer renderer(toTexture(voronoiNoise, voronoiResolution), toTexture(fbmNoise, fbmResolution), cpu::CloudRenderParams(properties));
+    render(params, renderer, cpu::Camera{glm::vec3(2, 2, 2), glm::vec3(0, 0, 0)}, pool);
+}
+
+// Smoke from the camera of the 3D app
+static void renderSmoke(const CPUParams &params, const cpu::SmokeSolver &solver, cpu::ThreadPool &pool)
+{
+    glm::vec3 eye(-0.549534, -0.369212, 0.227356);
+    glm::vec3 dir(0.785052, 0.527448, -0.324796);
+    cpu::SmokeRenderer renderer(solver, cpu::SmokeRenderParams());
+    render(params, renderer, cpu::Camera{eye, eye + dir}, pool);
+}
+
+int main(int argc, char **argv)
+{
+    auto params = parseArguments(argc, argv);
+    if (params.stepsPerGraph < 1)
+        params.stepsPerGraph = 1;
+
+    cpu::ThreadPool pool(params.threads);
+    auto res = params.solver.gridResolution;
+    tlog::info() << "Grid " << res.x << "x" << res.y << "x" << res.z << " on " << pool.getThreadCount() << " threads";
+
+    if (params.render == "cloud")
+    {
+        renderCloud(params, pool);
+        return EXIT_SUCCESS;
+    }
+
+    if (params.tolerance > 0.f)
+    {
+        measureConvergence(params, pool);
+        return EXIT_SUCCESS;
+    }
+
+    // The comparison runs global barriers first, the dependency run is kept for rendering
+    auto solverParams = params.solver;
+    double barrierTime = 0;
+    if (params.compare)
+    {
+        solverParams.globalBarriers = true;
+        cpu::SmokeSolver barrierSolver(solverParams, pool);
+        barrierTime = simulate(params, barrierSolver, pool);
+        solverParams.globalBarriers = false;
+    }
+
+    cpu::SmokeSolver solver(solverParams, pool);
+    double time = simulate(params, solver, pool);
+    if (params.compare)
+        tlog::info() << "Speedup over global barriers: " << barrierTime / time;
+
+    if (params.render == "smoke")
+        renderSmoke(params, solver, pool);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,495 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "scheduler.h"
+#include "solver.h"
+
+namespace cpu
+{
+    constexpr int TILE_SIZE = 32;
+
+    struct Image
+    {
+        Image(int width, int height) : width(width), height(height), pixels(width * height) {}
+
+        // Binary PPM, rows from top to bottom
+        void writePPM(const std::string &path) const
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << "P6\n" << width << " " << height << "\n255\n";
+            for (int y = height - 1; y >= 0; y--)
+            {
+                for (int x = 0; x < width; x++)
+                {
+                    glm::vec3 c = glm::clamp(pixels[y * width + x], 0.f, 1.f) * 255.f + 0.5f;
+                    char rgb[3] = {static_cast<char>(c.r), static_cast<char>(c.g), static_cast<char>(c.b)};
+                    file.write(rgb, 3);
+                }
+            }
+        }
+
+        // Binary PPM with 8 bit channels, as written by writePPM() and gpu::saveFramebuffer()
+        static Image readPPM(const std::string &path)
+        {
+            std::ifstream file(path, std::ios::binary);
+            std::string magic;
+            int width = 0, height = 0, maxValue = 0;
+            file >> magic >> width >> height >> maxValue;
+            file.get(); // Single whitespace before the pixels
+            if (!file || magic != "P6" || width <= 0 || height <= 0 || maxValue != 255)
+                throw std::runtime_error("Unsupported image " + path + ", expected a binary 8 bit PPM");
+
+            Image image(width, height);
+            std::vector<unsigned char> row(width * 3);
+            for (int y = height - 1; y >= 0; y--)
+            {
+                if (!file.read(reinterpret_cast<char *>(row.data()), row.size()))
+                    throw std::runtime_error("Image " + path + " ends early");
+                for (int x = 0; x < width; x++)
+                    image.pixels[y * width + x] = glm::vec3(row[3 * x], row[3 * x + 1], row[3 * x + 2]) / 255.f;
+            }
+            return image;
+        }
+
+        int width;
+        int height;
+        std::vector<glm::vec3> pixels; // Rows from bottom to top like gl_FragCoord
+    };
+
+    // Pinhole camera as spawnRay in camera.glsl
+    struct Camera
+    {
+        glm::vec3 eye;
+        glm::vec3 center;
+        glm::vec3 up = glm::vec3(0, 1, 0);
+        float fovRad = glm::radians(45.f);
+    };
+
+    // Renders the image in tiles of TILE_SIZE x TILE_SIZE pixels, one task each. trace(rayDir,
+    // fragCoord) returns the color of one pixel, fragCoord is its gl_FragCoord.
+    template <typename Trace>
+    void renderTiles(ThreadPool &pool, Image &image, const Camera &camera, Trace trace)
+    {
+        glm::vec3 forward = glm::normalize(camera.center - camera.eye);
+        glm::vec3 left = glm::normalize(glm::cross(forward, camera.up));
+        glm::vec3 up = -glm::cross(left, forward);
+        float aspect = static_cast<float>(image.width) / static_cast<float>(image.height);
+        float tanFov = std::tan(camera.fovRad * 0.5f);
+
+        TaskGraph graph;
+        for (int tileY = 0; tileY < image.height; tileY += TILE_SIZE)
+        for (int tileX = 0; tileX < image.width; tileX += TILE_SIZE)
+        {
+            graph.add([&, tileX, tileY] {
+                for (int y = tileY; y < std::min(tileY + TILE_SIZE, image.height); y++)
+                for (int x = tileX; x < std::min(tileX + TILE_SIZE, image.width); x++)
+                {
+                    glm::vec2 fragCoord(x + 0.5f, y + 0.5f);
+                    float u = (2.f * fragCoord.x / image.width - 1.f) * aspect * tanFov;
+                    float v = (2.f * fragCoord.y / image.height - 1.f) * tanFov;
+                    glm::vec3 rayDir = glm::normalize(forward + u * left + v * up);
+                    image.pixels[y * image.width + x] = trace(rayDir, fragCoord);
+                }
+            });
+        }
+        pool.run(graph);
+    }
+
+    // Transmittance towards a light per voxel, swept slice by slice from the light like
+    // gpu::sweepTowardsLight and the lightVolume.comp shaders. direction(center) returns the
+    // voxel space step per unit of segment length towards the light and attenuation(center,
+    // previous, length) the transmittance of the segment between the two voxel positions.
+    template <typename Direction, typename Attenuation>
+    std::vector<float> sweepTowardsLight(ThreadPool &pool, glm::ivec3 res, glm::vec3 towardsLight, Direction direction, Attenuation attenuation)
+    {
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (std::abs(towardsLight[i]) > std::abs(towardsLight[axis]))
+                axis = i;
+        }
+        int axisA = (axis + 1) % 3;
+        int axisB = (axis + 2) % 3;
+        int sweepDirection = towardsLight[axis] > 0 ? 1 : -1;
+        std::vector<float> volume(res.x * res.y * res.z, 1.f);
+        auto index = [&](glm::ivec3 id) { return (id.z * res.y + id.y) * res.x + id.x; };
+
+        // Bilinear lookup in a finished slice, 1 where the ray left through a side face
+        auto loadSlice = [&](glm::vec3 pos, int slice) {
+            glm::vec2 p = glm::vec2(pos[axisA], pos[axisB]) - 0.5f;
+            if (p.x < -0.5f || p.y < -0.5f || p.x > res[axisA] - 0.5f || p.y > res[axisB] - 0.5f)
+                return 1.f;
+            glm::vec2 p0 = glm::floor(p);
+            glm::vec2 t = p - p0;
+            float c[4];
+            for (int i = 0; i < 4; i++)
+            {
+                glm::ivec3 texel;
+                texel[axis] = slice;
+                texel[axisA] = std::clamp(static_cast<int>(p0.x) + (i & 1), 0, res[axisA] - 1);
+                texel[axisB] = std::clamp(static_cast<int>(p0.y) + (i >> 1), 0, res[axisB] - 1);
+                c[i] = volume[index(texel)];
+            }
+            return glm::mix(glm::mix(c[0], c[1], t.x), glm::mix(c[2], c[3], t.x), t.y);
+        };
+
+        // One task per row of a slice, every row waits for the whole previous slice
+        TaskGraph graph;
+        std::vector<int> previousTasks;
+        for (int i = 0; i < res[axis]; i++)
+        {
+            int slice = sweepDirection > 0 ? res[axis] - 1 - i : i;
+            std::vector<int> tasks;
+            for (int b = 0; b < res[axisB]; b++)
+            {
+                int task = graph.add([&, slice, b] {
+                    int previousSlice = slice + sweepDirection;
+                    bool first = previousSlice < 0 || previousSlice >= res[axis];
+                    for (int a = 0; a < res[axisA]; a++)
+                    {
+                        glm::ivec3 id;
+                        id[axis] = slice;
+                        id[axisA] = a;
+                        id[axisB] = b;
+                        glm::vec3 center = glm::vec3(id) + 0.5f;
+                        glm::vec3 dir = direction(center);
+                        float along = std::max(dir[axis] * sweepDirection, 1e-3f);
+                        float length = (first ? 0.5f : 1.f) / along;
+                        glm::vec3 previous = center + length * dir;
+                        float transmittance = first ? 1.f : loadSlice(previous, previousSlice);
+                        volume[index(id)] = transmittance * attenuation(center, previous, length);
+                    }
+                });
+                for (int previousTask : previousTasks)
+                    graph.depend(task, previousTask);
+                tasks.push_back(task);
+            }
+            previousTasks = std::move(tasks);
+        }
+        pool.run(graph);
+        return volume;
+    }
+
+    struct SmokeRenderParams
+    {
+        float thickness = 0.047f;
+        int ddaDepth = 200;
+        glm::vec3 lightDirection = glm::normalize(glm::vec3(-1)); // Towards the light
+        bool selfShadowing = true;
+        float shadowAmbient = 0.3f;
+        glm::vec3 background = glm::vec3(0.088f, 0.084f, 0.084f);
+    };
+
+    // CPU version of the smoke view of cube.frag (simulation grid, no procedural detail)
+    class SmokeRenderer
+    {
+    public:
+        SmokeRenderer(const SmokeSolver &solver, const SmokeRenderParams &params)
+            : solver(solver), params(params), res(solver.params.gridResolution)
+        {
+        }
+
+        void render(ThreadPool &pool, Image &image, const Camera &camera)
+        {
+            if (params.selfShadowing)
+            {
+                lightVolume = sweepTowardsLight(pool, res, params.lightDirection,
+                    [&](glm::vec3) { return params.lightDirection; },
+                    [&](glm::vec3 center, glm::vec3 previous, float length) {
+                        glm::ivec3 cell = glm::ivec3(glm::floor(0.5f * (center + previous)));
+                        float alpha = std::clamp(params.thickness * (1 - solver.loadField(cell.x, cell.y, cell.z, M_FIELD)), 0.f, 1.f);
+                        return std::pow(1 - alpha, length);
+                    });
+            }
+
+            renderTiles(pool, image, camera, [&](glm::vec3 rayDir, glm::vec2) { return trace(camera.eye, rayDir); });
+        }
+
+    private:
+        glm::vec3 trace(glm::vec3 cameraPos, glm::vec3 rayDir) const
+        {
+            glm::vec3 marchResolution = glm::vec3(res);
+            float cellSize = 1 / std::max(marchResolution.x, std::max(marchResolution.y, marchResolution.z));
+            glm::vec3 cuboidSize = marchResolution * cellSize;
+
+            // The GL path starts at the rasterized front face of the cube
+            glm::vec3 t1 = (-0.5f * cuboidSize - cameraPos) / rayDir;
+            glm::vec3 t2 = (0.5f * cuboidSize - cameraPos) / rayDir;
+            glm::vec3 tNear = glm::min(t1, t2);
+            glm::vec3 tFar = glm::max(t1, t2);
+            float tEntry = std::max(tNear.x, std::max(tNear.y, tNear.z));
+            float tExit = std::min(tFar.x, std::min(tFar.y, tFar.z));
+            if (tEntry > tExit || tEntry < 0)
+                return params.background;
+            glm::vec3 pos = cameraPos + tEntry * rayDir;
+            glm::vec3 stop = cameraPos + tExit * rayDir;
+
+            glm::ivec3 startID = glm::ivec3(glm::clamp((pos + 0.5f * cuboidSize) / cellSize, glm::vec3(0), marchResolution - 1.f));
+            glm::ivec3 stopID = glm::ivec3(glm::clamp((stop + 0.5f * cuboidSize) / cellSize, glm::vec3(0), marchResolution - 1.f));
+            glm::vec3 raySign = glm::sign(rayDir);
+            glm::vec3 tDelta = glm::abs(cellSize / rayDir);
+            glm::vec3 tMax = ((glm::vec3(startID) + glm::step(0.f, rayDir)) * cellSize - 0.5f * cuboidSize - pos) / rayDir;
+            glm::ivec3 voxelID = startID;
+            glm::bvec3 move = glm::equal(tNear, glm::vec3(tEntry));
+
+            glm::vec3 smoke(0);
+            float transmittance = 1;
+            for (int i = 0; i < params.ddaDepth; i++)
+            {
+                float m = solver.loadField(voxelID.x, voxelID.y, voxelID.z, M_FIELD);
+                float alpha = params.thickness * (1 - m);
+                float light = 1;
+                if (params.selfShadowing && alpha > 0)
+                    light = glm::mix(params.shadowAmbient, 1.f, lightVolume[(voxelID.z * res.y + voxelID.y) * res.x + voxelID.x]);
+                smoke += alpha * light;
+
+                if (solver.loadField(voxelID.x, voxelID.y, voxelID.z, S_FIELD) < 1.f)
+                {
+                    glm::vec3 normal = glm::normalize(-glm::sign(tMax) * glm::vec3(move));
+                    glm::vec3 halfVector = glm::normalize(params.lightDirection + rayDir);
+                    glm::vec3 ambient = glm::vec3(0.24725, 0.2245, 0.0645);
+                    glm::vec3 diffuse = std::max(glm::dot(params.lightDirection, normal), 0.f) * glm::vec3(0.34615, 0.3143, 0.0903);
+                    glm::vec3 specular = std::pow(std::max(glm::dot(normal, halfVector), 0.f), 83.2f) * glm::vec3(0.797357, 0.723991, 0.208006);
+                    smoke += transmittance * (ambient + diffuse + specular);
+                    break;
+                }
+
+                if (voxelID == stopID)
+                {
+                    smoke += transmittance * params.background;
+                    break;
+                }
+
+                transmittance *= 1 - alpha;
+
+                glm::bvec3 mask = glm::lessThan(tMax, glm::vec3(tMax.y, tMax.z, tMax.x));
+                move.x = mask.x && !mask.z;
+                move.y = mask.y && !mask.x;
+                move.z = !(move.x || move.y);
+                voxelID += glm::ivec3(glm::vec3(move) * raySign);
+                tMax += glm::vec3(move) * tDelta;
+            }
+            return smoke;
+        }
+
+        const SmokeSolver &solver;
+        SmokeRenderParams params;
+        glm::ivec3 res;
+        std::vector<float> lightVolume;
+    };
+
+    // Parameters of the cloud app, read from a property file such as assets/config/cloudProperties.json
+    struct CloudRenderParams
+    {
+        // Properties is a controls::PropertySystem, kept a parameter so the renderer does not depend on the GUI
+        template <typename Properties>
+        explicit CloudRenderParams(Properties &properties)
+            : cloudColor(properties.template getValue<glm::vec3>("cloudColor")),
+              absorption(properties.template getValue<float>("absorption")),
+              sampleStepSize(properties.template getValue<float>("sampleStepSize")),
+              border(properties.template getValue<float>("border")),
+              henyeyGreenG(properties.template getValue<float>("henyeyGreen_G")),
+              henyeyGreenK(properties.template getValue<float>("henyeyGreen_K")),
+              lightIntensity(properties.template getValue<float>("lightIntensity")),
+              lightPosition(properties.template getValue<glm::vec3>("lightPosition")),
+              lightColor(properties.template getValue<glm::vec3>("lightColor")),
+              exposure(properties.template getValue<float>("exposure")),
+              gamma(properties.template getValue<float>("gamma")),
+              period(properties.template getValue<float>("period"))
+        {
+        }
+
+        glm::vec3 cloudColor;
+        float absorption;
+        float sampleStepSize;
+        float border;
+        float henyeyGreenG;
+        float henyeyGreenK;
+        float lightIntensity;
+        glm::vec3 lightPosition;
+        glm::vec3 lightColor;
+        float exposure;
+        float gamma;
+        float period; // Texture coordinates covered by one noise tile
+        float time = 0.f;
+        glm::ivec3 lightVolumeResolution = glm::ivec3(64);
+        glm::vec3 background = glm::vec3(0.088f, 0.084f, 0.084f);
+    };
+
+    // Single channel 3D texture sampled like a GL_LINEAR, GL_REPEAT sampler3D
+    struct NoiseTexture
+    {
+        float sample(glm::vec3 uvw) const
+        {
+            glm::vec3 p = uvw * glm::vec3(resolution) - 0.5f;
+            glm::vec3 p0 = glm::floor(p);
+            glm::vec3 t = p - p0;
+            glm::ivec3 i0 = glm::ivec3(p0);
+            float c[8];
+            for (int i = 0; i < 8; i++)
+            {
+                glm::ivec3 id = i0 + glm::ivec3(i & 1, (i >> 1) & 1, i >> 2);
+                id = (id % resolution + resolution) % resolution;
+                c[i] = values[(id.z * resolution.y + id.y) * resolution.x + id.x];
+            }
+            float c0 = glm::mix(glm::mix(c[0], c[1], t.x), glm::mix(c[2], c[3], t.x), t.y);
+            float c1 = glm::mix(glm::mix(c[4], c[5], t.x), glm::mix(c[6], c[7], t.x), t.y);
+            return glm::mix(c0, c1, t.z);
+        }
+
+        glm::ivec3 resolution;
+        std::vector<float> values; // x fastest, as uploaded to the noise volumes of the cloud app
+    };
+
+    // CPU version of the cloud march in quad.frag and cloud.glsl
+    class CloudRenderer
+    {
+    public:
+        static constexpr float PI = 3.14159f;
+        static constexpr float CLOUD_BOX_SIZE = 0.5f;
+
+        CloudRenderer(NoiseTexture voronoi, NoiseTexture fbm, const CloudRenderParams &params)
+            : voronoi(std::move(voronoi)), fbm(std::move(fbm)), params(params)
+        {
+        }
+
+        void render(ThreadPool &pool, Image &image, const Camera &camera)
+        {
+            glm::vec3 res = glm::vec3(params.lightVolumeResolution);
+            glm::vec3 voxelSize = glm::vec3(CLOUD_BOX_SIZE) / res;
+            lightVolume = sweepTowardsLight(pool, params.lightVolumeResolution, params.lightPosition,
+                [&](glm::vec3 center) {
+                    glm::vec3 worldPos = center * voxelSize - 0.5f * CLOUD_BOX_SIZE;
+                    return glm::normalize(params.lightPosition - worldPos) / voxelSize;
+                },
+                [&](glm::vec3 center, glm::vec3 previous, float length) {
+                    glm::vec3 midPos = 0.5f * (center + previous) * voxelSize - 0.5f * CLOUD_BOX_SIZE;
+                    float stepDensity = params.sampleStepSize * sampleDensity(midPos);
+                    float stepTransparency = std::clamp(1 - multipleOctaveScattering(stepDensity, params.henyeyGreenG), 0.f, 1.f);
+                    return std::pow(stepTransparency, length / params.sampleStepSize);
+                });
+
+            renderTiles(pool, image, camera, [&](glm::vec3 rayDir, glm::vec2 fragCoord) { return trace(camera.eye, rayDir, fragCoord); });
+        }
+
+    private:
+        static float rnd(float x, float y)
+        {
+            float value = std::sin(x * 12.9898f + y * 78.233f) * 43758.5453123f;
+            return value - std::floor(value);
+        }
+
+        static float henyeyGreenstein(float theta, float g)
+        {
+            float denom = 1 + g * g - 2 * g * std::cos(theta);
+            return (1 - g * g) / (std::sqrt(denom * denom * denom) * (4 * PI));
+        }
+
+        float sampleDensity(glm::vec3 pos) const
+        {
+            const glm::vec3 wind1 = glm::vec3(0.06, 0.0, 0.02);
+            const glm::vec3 wind2 = glm::vec3(0.12, 0.0, -0.08);
+            float voronoiValue = 1 - voronoi.sample((pos + wind1 * params.time + 0.5f) / params.period);
+            float perlinValue = fbm.sample((pos + wind2 * params.time + 0.5f) / params.period);
+
+            glm::vec3 borderDistances = 0.5f - glm::abs(pos);
+            float borderFading = std::min(std::min(borderDistances.x, borderDistances.y), borderDistances.z);
+            borderFading = glm::smoothstep(0.f, params.border, borderFading);
+            return borderFading * borderFading * perlinValue * voronoiValue;
+        }
+
+        static float multipleOctaveScattering(float density, float mu)
+        {
+            float a = 1, b = 1, c = 1;
+            float luminance = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                luminance += b * henyeyGreenstein(0.3f + c, mu) * std::exp(-density * 0.1f * a);
+                a *= 0.2f;
+                b *= 0.4f;
+                c *= 0.9f;
+            }
+            return luminance;
+        }
+
+        float beersPowder(float dist) const
+        {
+            float beers = std::exp(-dist * params.absorption);
+            return beers * (1 - beers);
+        }
+
+        float sampleLightVolume(glm::vec3 pos) const
+        {
+            // Clamped trilinear lookup like the GL_CLAMP_TO_EDGE gpu::Volume
+            glm::ivec3 res = params.lightVolumeResolution;
+            glm::vec3 p = glm::clamp((pos / CLOUD_BOX_SIZE + 0.5f) * glm::vec3(res) - 0.5f, glm::vec3(0), glm::vec3(res - 1));
+            glm::ivec3 i0 = glm::ivec3(p);
+            glm::ivec3 i1 = glm::min(i0 + 1, res - 1);
+            glm::vec3 t = p - glm::vec3(i0);
+            auto at = [&](int x, int y, int z) { return lightVolume[(z * res.y + y) * res.x + x]; };
+            float c0 = glm::mix(glm::mix(at(i0.x, i0.y, i0.z), at(i1.x, i0.y, i0.z), t.x), glm::mix(at(i0.x, i1.y, i0.z), at(i1.x, i1.y, i0.z), t.x), t.y);
+            float c1 = glm::mix(glm::mix(at(i0.x, i0.y, i1.z), at(i1.x, i0.y, i1.z), t.x), glm::mix(at(i0.x, i1.y, i1.z), at(i1.x, i1.y, i1.z), t.x), t.y);
+            return glm::mix(c0, c1, t.z);
+        }
+
+        glm::vec3 trace(glm::vec3 cameraPos, glm::vec3 rayDir, glm::vec2 fragCoord) const
+        {
+            // Box intersection and step count
+            float halfSize = 0.5f * CLOUD_BOX_SIZE;
+            glm::vec3 t1 = (-halfSize - cameraPos) / rayDir;
+            glm::vec3 t2 = (halfSize - cameraPos) / rayDir;
+            glm::vec3 tNear = glm::min(t1, t2);
+            glm::vec3 tFar = glm::max(t1, t2);
+            float tEntry = std::max(tNear.x, std::max(tNear.y, tNear.z));
+            float tExit = std::min(tFar.x, std::min(tFar.y, tFar.z));
+            if (tExit < 0 || tEntry > tExit)
+                return params.background;
+            int numSteps = static_cast<int>((tExit - tEntry) / params.sampleStepSize);
+            glm::vec3 rayStart = cameraPos + (tEntry + 1e-5f) * rayDir;
+            float fragRandom = rnd(fragCoord.x, fragCoord.y);
+
+            glm::vec3 color(0);
+            float cloudTransparency = 1;
+            for (int i = 0; i < numSteps && cloudTransparency > 1e-3f && i < 100; i++)
+            {
+                // Jitter inside the step as in quad.frag
+                float outerRandom = rnd(fragRandom, static_cast<float>(i));
+                float t = (i + (outerRandom - 0.5f) * 0.5f) * params.sampleStepSize;
+                glm::vec3 samplePos = rayStart + rayDir * t;
+                float cloudDensity = params.sampleStepSize * sampleDensity(samplePos);
+                cloudTransparency *= 1 - beersPowder(cloudDensity);
+
+                glm::vec3 lightRayDir = glm::normalize(params.lightPosition - samplePos);
+                float lightTransparency = sampleLightVolume(samplePos);
+                float cosTheta = std::acos(std::abs(glm::dot(lightRayDir, -rayDir)));
+                float phase = glm::mix(henyeyGreenstein(cosTheta, params.henyeyGreenG), henyeyGreenstein(cosTheta, -params.henyeyGreenG), params.henyeyGreenK);
+                float lightRayDist = glm::distance(params.lightPosition, samplePos);
+                color += params.lightIntensity * lightTransparency * phase / (lightRayDist * lightRayDist)
+                       * params.lightColor * cloudTransparency * params.cloudColor;
+
+                // Russian roulette after 50 samples
+                if (!(i < 50 || rnd(outerRandom, outerRandom) < 0.5f))
+                    break;
+            }
+
+            // Tone mapping and blending over the background like GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA
+            glm::vec3 mapped = glm::pow(1.f - glm::exp(-color * params.exposure), glm::vec3(1 / params.gamma));
+            float opacity = numSteps > 0 ? 1 - cloudTransparency : 0;
+            return opacity * mapped + (1 - opacity) * params.background;
+        }
+
+        NoiseTexture voronoi;
+        NoiseTexture fbm;
+        CloudRenderParams params;
+        std::vector<float> lightVolume;
+    };
+
+} // namespace cpu
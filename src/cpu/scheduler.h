@@ -0,0 +1,245 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace cpu
+{
+    // Set of tasks with explicit dependencies. A task becomes ready once every task
+    // it depends on finished, so independent parts of consecutive stages overlap
+    // instead of waiting at a global barrier.
+    class TaskGraph
+    {
+    public:
+        // A task with a worker is queued on that worker whenever it becomes ready, e.g. to
+        // keep the tasks of one brick on the thread whose NUMA node holds the brick's memory
+        int add(std::function<void()> work, int worker = -1)
+        {
+            tasks.push_back(std::make_unique<Task>());
+            tasks.back()->work = std::move(work);
+            tasks.back()->worker = worker;
+            return static_cast<int>(tasks.size()) - 1;
+        }
+
+        // task may only start after dependency finished
+        void depend(int task, int dependency)
+        {
+            tasks[dependency]->successors.push_back(task);
+            tasks[task]->dependencies++;
+        }
+
+        size_t size() const { return tasks.size(); }
+
+    private:
+        friend class ThreadPool;
+
+        struct Task
+        {
+            std::function<void()> work;
+            std::vector<int> successors;
+            int dependencies = 0;
+            int worker = -1;
+            std::atomic<int> remaining = 0;
+        };
+
+        std::vector<std::unique_ptr<Task>> tasks;
+    };
+
+    // Thread pool executing task graphs with work stealing. Every worker owns a deque,
+    // runs its newest task first (the successor it just released, whose data is still
+    // in cache) and steals the oldest task of another worker when its own deque is empty.
+    //
+    // On Linux every worker is pinned to one of the allowed CPUs, so a worker stays on the
+    // NUMA node where the pages it first touched were placed.
+    class ThreadPool
+    {
+    public:
+        // The thread constructing the pool is pinned as well and has to be the one calling run()
+        explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+            : queues(std::max(threads, 1u))
+        {
+            // The thread calling run() works as well and owns the last queue
+            for (unsigned i = 0; i + 1 < queues.size(); i++)
+                workers.emplace_back([this, i] { workerLoop(i); });
+            pinThreads();
+        }
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+                stopping = true;
+            }
+            sleepCondition.notify_all();
+            for (auto &worker : workers)
+                worker.join();
+        }
+
+        ThreadPool(const ThreadPool &) = delete;
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        unsigned getThreadCount() const { return static_cast<unsigned>(queues.size()); }
+
+        // Runs all tasks of the graph and returns once the last one finished. Without stealing
+        // every task with a worker runs on exactly that worker, as needed for first touch.
+        void run(TaskGraph &graph, bool stealing = true)
+        {
+            if (graph.size() == 0)
+                return;
+
+            graph_ = &graph;
+            stealing_ = stealing;
+            pending.store(static_cast<int>(graph.size()));
+            for (auto &task : graph.tasks)
+                task->remaining.store(task->dependencies);
+
+            // Ready tasks without a worker are spread over all queues, later ones get stolen as needed
+            unsigned next = 0;
+            for (size_t i = 0; i < graph.size(); i++)
+            {
+                if (graph.tasks[i]->dependencies == 0)
+                    push(queueOf(*graph.tasks[i], next++), static_cast<int>(i));
+            }
+
+            unsigned self = static_cast<unsigned>(queues.size()) - 1;
+            while (pending.load(std::memory_order_acquire) > 0)
+            {
+                if (!tryRunOne(self))
+                    std::this_thread::yield();
+            }
+            graph_ = nullptr;
+        }
+
+    private:
+        struct Queue
+        {
+            std::mutex mutex;
+            std::deque<int> tasks;
+        };
+
+        void push(unsigned queue, int task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(queues[queue].mutex);
+                queues[queue].tasks.push_back(task);
+            }
+            queued.fetch_add(1, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> lock(sleepMutex);
+            }
+            sleepCondition.notify_one();
+        }
+
+        bool pop(unsigned queue, int &task)
+        {
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            if (queues[queue].tasks.empty())
+                return false;
+            task = queues[queue].tasks.back();
+            queues[queue].tasks.pop_back();
+            return true;
+        }
+
+        bool steal(unsigned queue, int &task)
+        {
+            std::lock_guard<std::mutex> lock(queues[queue].mutex);
+            if (queues[queue].tasks.empty())
+                return false;
+            task = queues[queue].tasks.front();
+            queues[queue].tasks.pop_front();
+            return true;
+        }
+
+        unsigned queueOf(const TaskGraph::Task &task, unsigned fallback) const
+        {
+            return (task.worker >= 0 ? static_cast<unsigned>(task.worker) : fallback) % queues.size();
+        }
+
+        bool tryRunOne(unsigned self)
+        {
+            int task = -1;
+            bool found = pop(self, task);
+            for (unsigned i = 1; !found && stealing_ && i < queues.size(); i++)
+                found = steal((self + i) % queues.size(), task);
+            if (!found)
+                return false;
+            queued.fetch_sub(1, std::memory_order_relaxed);
+
+            auto &tasks = graph_->tasks;
+            tasks[task]->work();
+            for (int successor : tasks[task]->successors)
+            {
+                if (tasks[successor]->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    push(queueOf(*tasks[successor], self), successor);
+            }
+            pending.fetch_sub(1, std::memory_order_acq_rel);
+            return true;
+        }
+
+        void workerLoop(unsigned self)
+        {
+            while (true)
+            {
+                if (tryRunOne(self))
+                    continue;
+
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                sleepCondition.wait(lock, [this] { return stopping || queued.load(std::memory_order_acquire) > 0; });
+                if (stopping)
+                    return;
+            }
+        }
+
+        // Worker i runs on the i-th allowed CPU, the calling thread on the one after the last worker
+        void pinThreads()
+        {
+#if defined(__linux__)
+            cpu_set_t allowed;
+            CPU_ZERO(&allowed);
+            if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+                return;
+            std::vector<int> cpus;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                    cpus.push_back(cpu);
+            }
+            if (cpus.empty())
+                return;
+
+            auto pin = [&](pthread_t thread, size_t index) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpus[index % cpus.size()], &set);
+                pthread_setaffinity_np(thread, sizeof(set), &set);
+            };
+            for (size_t i = 0; i < workers.size(); i++)
+                pin(workers[i].native_handle(), i);
+            pin(pthread_self(), workers.size());
+#endif
+        }
+
+        std::vector<Queue> queues;
+        std::vector<std::thread> workers;
+        TaskGraph *graph_ = nullptr;
+        std::atomic<bool> stealing_ = true;
+        std::atomic<int> pending = 0;
+        std::atomic<int> queued = 0;
+        std::mutex sleepMutex;
+        std::condition_variable sleepCondition;
+        bool stopping = false;
+    };
+
+} // namespace cpu
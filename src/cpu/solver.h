@@ -0,0 +1,589 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <span>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "../arena.h"
+#include "scheduler.h"
+
+namespace cpu
+{
+    // Field ids as defined in smokeHeader.glsl
+    enum Field
+    {
+        U_FIELD,
+        V_FIELD,
+        W_FIELD,
+        NEXT_U_FIELD,
+        NEXT_V_FIELD,
+        NEXT_W_FIELD,
+        S_FIELD,
+        P_FIELD,
+        M_FIELD,
+        NEXT_M_FIELD,
+        FIELD_COUNT
+    };
+
+    struct SolverParams
+    {
+        glm::ivec3 gridResolution = glm::ivec3(32, 32, 128);
+        float gridSpacing = 1.5f;
+        int totalIterations = 21;
+        glm::vec3 gravity = glm::vec3(0, 0, 9.81);
+        float overrelaxation = 0.91f;
+        float density = 0.002f;
+        float dt = 1 / 120.f;
+        // Cells per task. Advection only looks one brick far, so bricks have to be wider
+        // than dt * maxVelocity / gridSpacing cells.
+        glm::ivec3 brickSize = glm::ivec3(8, 8, 16);
+        // Separate every stage by a barrier over all bricks, as the GPU path does
+        bool globalBarriers = false;
+        // Keep the pressure of the last step as initial guess of the projection
+        bool warmStart = false;
+        // Back the fields with huge pages, see host::GridArena
+        bool hugePages = true;
+    };
+
+    // Block of cells [begin, end) processed by one task
+    struct Brick
+    {
+        glm::ivec3 begin;
+        glm::ivec3 end;
+    };
+
+    // CPU port of the compute shaders in assets/shader/smoke/3d (semi-Lagrangian advection only).
+    // Each stage runs as one task per brick. A task only waits for the tasks of the previous
+    // stage that touch its brick or the bricks around it, so stages overlap across the grid.
+    class SmokeSolver
+    {
+    public:
+        SmokeSolver(const SolverParams &params, ThreadPool &pool)
+            : params(params), res(params.gridResolution), arena(params.hugePages)
+        {
+            glm::ivec3 count = (res + params.brickSize - 1) / params.brickSize;
+            brickCount = count;
+            for (int z = 0; z < count.z; z++)
+            for (int y = 0; y < count.y; y++)
+            for (int x = 0; x < count.x; x++)
+            {
+                glm::ivec3 begin = glm::ivec3(x, y, z) * params.brickSize;
+                bricks.push_back({begin, glm::min(begin + params.brickSize, res)});
+            }
+
+            // Contiguous runs of bricks per worker, so every worker owns one contiguous part of each field
+            for (size_t brick = 0; brick < bricks.size(); brick++)
+                owners.push_back(static_cast<int>(brick * pool.getThreadCount() / bricks.size()));
+
+            static const char *names[FIELD_COUNT] = {"u", "v", "w", "nextU", "nextV", "nextW", "s", "p", "m", "nextM"};
+            for (int field = 0; field < FIELD_COUNT; field++)
+            {
+                glm::ivec3 size = res + glm::ivec3(field == U_FIELD || field == NEXT_U_FIELD, field == V_FIELD || field == NEXT_V_FIELD,
+                                                   field == W_FIELD || field == NEXT_W_FIELD);
+                setLayout(field, size);
+                fields[field] = arena.grid<float>(names[field], bricks.size() * layouts[field].brickElements);
+            }
+
+            // Bricks sharing a face with a brick (projection and extrapolation stencil)
+            // and bricks sharing at least a corner with it (advection stencil), both including itself
+            faceNeighbours.resize(bricks.size());
+            allNeighbours.resize(bricks.size());
+            for (int z = 0; z < count.z; z++)
+            for (int y = 0; y < count.y; y++)
+            for (int x = 0; x < count.x; x++)
+            {
+                int brick = (z * count.y + y) * count.x + x;
+                for (int dz = -1; dz <= 1; dz++)
+                for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                {
+                    glm::ivec3 other(x + dx, y + dy, z + dz);
+                    if (glm::any(glm::lessThan(other, glm::ivec3(0))) || glm::any(glm::greaterThanEqual(other, count)))
+                        continue;
+                    int neighbour = (other.z * count.y + other.y) * count.x + other.x;
+                    allNeighbours[brick].push_back(neighbour);
+                    if (std::abs(dx) + std::abs(dy) + std::abs(dz) <= 1)
+                        faceNeighbours[brick].push_back(neighbour);
+                }
+            }
+            reset(pool);
+        }
+
+        // Initializes the fields brick by brick, each on the worker owning the brick and without
+        // stealing. The first reset is the first touch of the fields' pages, which places each
+        // worker's part of the fields on its NUMA node. Only the pages at the border between
+        // two workers' parts are shared.
+        void reset(ThreadPool &pool)
+        {
+            TaskGraph graph;
+            for (size_t brick = 0; brick < bricks.size(); brick++)
+                graph.add([this, brick] { reset(brick); }, owners[brick]);
+            pool.run(graph, false);
+        }
+
+        // Appends the tasks of the given number of time steps to the graph
+        void schedule(TaskGraph &graph, int steps)
+        {
+            std::vector<int> previous;
+            for (int step = 0; step < steps; step++)
+            {
+                previous = addStage(graph, previous, allNeighbours, [this](const Brick &brick) { applyGravity(brick); }, true);
+                if (params.warmStart)
+                    previous = addStage(graph, previous, faceNeighbours, [this](const Brick &brick) { applyPressure(brick); });
+                for (int i = 0; i < 2 * params.totalIterations; i++)
+                    previous = addStage(graph, previous, faceNeighbours, [this, i](const Brick &brick) { forceIncompressibility(brick, i); });
+                previous = addStage(graph, previous, faceNeighbours, [this](const Brick &brick) { extrapolate(brick); });
+                previous = addStage(graph, previous, allNeighbours, [this](const Brick &brick) { advectVelocities(brick); });
+                previous = addStage(graph, previous, allNeighbours, [this](const Brick &brick) { copyVelocities(brick); });
+                previous = addStage(graph, previous, allNeighbours, [this](const Brick &brick) { advectSmoke(brick); });
+                previous = addStage(graph, previous, allNeighbours, [this](const Brick &brick) { copySmoke(brick); });
+            }
+        }
+
+        // Runs one time step with a barrier after every stage and measures the projection: returns
+        // the number of Gauss-Seidel sweeps (pairs of checkerboard passes) after which the residual
+        // first dropped to tolerance, totalIterations + 1 if it never did. All sweeps still run.
+        int stepToTolerance(ThreadPool &pool, float tolerance)
+        {
+            auto run = [&](auto work) {
+                TaskGraph graph;
+                for (size_t brick = 0; brick < bricks.size(); brick++)
+                    graph.add([&work, this, brick] { work(bricks[brick]); }, owners[brick]);
+                pool.run(graph);
+            };
+
+            run([this](const Brick &brick) { applyGravity(brick); });
+            if (params.warmStart)
+                run([this](const Brick &brick) { applyPressure(brick); });
+            int sweeps = residual() <= tolerance ? 0 : params.totalIterations + 1;
+            for (int i = 0; i < params.totalIterations; i++)
+            {
+                run([this, i](const Brick &brick) { forceIncompressibility(brick, 2 * i); });
+                run([this, i](const Brick &brick) { forceIncompressibility(brick, 2 * i + 1); });
+                if (sweeps > params.totalIterations && residual() <= tolerance)
+                    sweeps = i + 1;
+            }
+            run([this](const Brick &brick) { extrapolate(brick); });
+            run([this](const Brick &brick) { advectVelocities(brick); });
+            run([this](const Brick &brick) { copyVelocities(brick); });
+            run([this](const Brick &brick) { advectSmoke(brick); });
+            run([this](const Brick &brick) { copySmoke(brick); });
+            return sweeps;
+        }
+
+        // RMS divergence over all fluid cells, what the projection drives towards zero
+        float residual() const
+        {
+            double sum = 0;
+            int cells = 0;
+            for (int z = 0; z < res.z; z++)
+            for (int x = 0; x < res.x; x++)
+            for (int y = 0; y < res.y; y++)
+            {
+                if (loadField(x, y, z, S_FIELD) == 0.f)
+                    continue;
+                float d = loadField(x + 1, y, z, U_FIELD) - loadField(x, y, z, U_FIELD)
+                        + loadField(x, y + 1, z, V_FIELD) - loadField(x, y, z, V_FIELD)
+                        + loadField(x, y, z + 1, W_FIELD) - loadField(x, y, z, W_FIELD);
+                sum += d * d;
+                cells++;
+            }
+            return cells > 0 ? static_cast<float>(std::sqrt(sum / cells)) : 0.f;
+        }
+
+        float loadField(int x, int y, int z, int field) const
+        {
+            int idx = index(x, y, z, field);
+            if (idx < 0)
+                return isSmoke(field) ? 1.f : 0.f;
+            return fields[field][idx];
+        }
+
+        void saveField(int x, int y, int z, int field, float value)
+        {
+            int idx = index(x, y, z, field);
+            if (idx >= 0)
+                fields[field][idx] = value;
+        }
+
+        // Brick-major, see index(). The padding of partial bricks keeps the value of reset().
+        std::span<const float> getField(int field) const { return fields[field]; }
+        const std::vector<Brick> &getBricks() const { return bricks; }
+
+        const SolverParams params;
+
+    private:
+        static bool isSmoke(int field) { return field == M_FIELD || field == NEXT_M_FIELD; }
+
+        // Bricks are stored one after the other in the order of the bricks vector, each padded to
+        // brickSize cells, plus one along the axis of a face field for the faces one past the last
+        // cell, which belong to the last brick. Inside a brick y is fastest, then x, then z. With
+        // the fixed brick extent the element of a cell is a sum of one term per axis.
+        struct FieldLayout
+        {
+            glm::ivec3 size;         // Cells or faces per axis, as in smokeHeader.glsl
+            int brickElements;       // Padded elements per brick
+            std::vector<int> terms;  // Per coordinate of x, then y, then z
+            const int *axisTerms[3]; // Into terms
+        };
+
+        FieldLayout brickLayout(glm::ivec3 size) const
+        {
+            FieldLayout layout;
+            layout.size = size;
+            glm::ivec3 extent = params.brickSize + glm::ivec3(glm::greaterThan(size, res));
+            layout.brickElements = extent.x * extent.y * extent.z;
+            glm::ivec3 brickStride(layout.brickElements, brickCount.x * layout.brickElements,
+                                   brickCount.x * brickCount.y * layout.brickElements);
+            glm::ivec3 localStride(extent.y, 1, extent.x * extent.y);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int c = 0; c < size[axis]; c++)
+                {
+                    int brick = std::min(c / params.brickSize[axis], brickCount[axis] - 1);
+                    int local = c - brick * params.brickSize[axis];
+                    layout.terms.push_back(brick * brickStride[axis] + local * localStride[axis]);
+                }
+            }
+            return layout;
+        }
+
+        void setLayout(int field, glm::ivec3 size)
+        {
+            FieldLayout &layout = layouts[field];
+            layout = brickLayout(size);
+            layout.axisTerms[0] = layout.terms.data();
+            layout.axisTerms[1] = layout.axisTerms[0] + size.x;
+            layout.axisTerms[2] = layout.axisTerms[1] + size.y;
+        }
+
+        // Element of a cell or face in the brick-major layout, -1 outside of the grid
+        int index(int x, int y, int z, int field) const
+        {
+            const FieldLayout &layout = layouts[field];
+            if (x < 0 || x >= layout.size.x || y < 0 || y >= layout.size.y || z < 0 || z >= layout.size.z)
+                return -1;
+            return layout.axisTerms[0][x] + layout.axisTerms[1][y] + layout.axisTerms[2][z];
+        }
+
+        // Adds one task per brick which waits for the previous stage's tasks of the given neighbours
+        template <typename Work>
+        std::vector<int> addStage(TaskGraph &graph, const std::vector<int> &previous,
+                                  const std::vector<std::vector<int>> &neighbours, Work work, bool ownBrickOnly = false)
+        {
+            int barrier = -1;
+            if (params.globalBarriers && !previous.empty())
+            {
+                barrier = graph.add([] {});
+                for (int task : previous)
+                    graph.depend(barrier, task);
+            }
+
+            std::vector<int> tasks(bricks.size());
+            for (size_t brick = 0; brick < bricks.size(); brick++)
+            {
+                tasks[brick] = graph.add([this, brick, work] { work(bricks[brick]); }, owners[brick]);
+                if (barrier >= 0)
+                    graph.depend(tasks[brick], barrier);
+                else if (!previous.empty() && ownBrickOnly)
+                    graph.depend(tasks[brick], previous[brick]);
+                else if (!previous.empty())
+                {
+                    for (int neighbour : neighbours[brick])
+                        graph.depend(tasks[brick], previous[neighbour]);
+                }
+            }
+            return tasks;
+        }
+
+        float sampleField(float x, float y, float z, int field) const
+        {
+            float h = params.gridSpacing;
+            float h1 = 1 / h;
+            float h2 = h / 2;
+
+            x = std::clamp(x, h, h * res.x);
+            y = std::clamp(y, h, h * res.y);
+            z = std::clamp(z, h, h * res.z);
+            float dx = field == U_FIELD || field == NEXT_U_FIELD ? 0 : h2;
+            float dy = field == V_FIELD || field == NEXT_V_FIELD ? 0 : h2;
+            float dz = field == W_FIELD || field == NEXT_W_FIELD ? 0 : h2;
+
+            float x0 = std::min(std::floor((x - dx) * h1), res.x - 1.f);
+            float tx = h1 * ((x - dx) - x0 * h);
+            float x1 = std::min(x0 + 1, res.x - 1.f);
+
+            float y0 = std::min(std::floor((y - dy) * h1), res.y - 1.f);
+            float ty = h1 * ((y - dy) - y0 * h);
+            float y1 = std::min(y0 + 1, res.y - 1.f);
+
+            float z0 = std::min(std::floor((z - dz) * h1), res.z - 1.f);
+            float tz = h1 * ((z - dz) - z0 * h);
+            float z1 = std::min(z0 + 1, res.z - 1.f);
+
+            float c00 = (1 - tx) * loadField(int(x0), int(y0), int(z0), field) + tx * loadField(int(x1), int(y0), int(z0), field);
+            float c10 = (1 - tx) * loadField(int(x0), int(y1), int(z0), field) + tx * loadField(int(x1), int(y1), int(z0), field);
+            float c01 = (1 - tx) * loadField(int(x0), int(y0), int(z1), field) + tx * loadField(int(x1), int(y0), int(z1), field);
+            float c11 = (1 - tx) * loadField(int(x0), int(y1), int(z1), field) + tx * loadField(int(x1), int(y1), int(z1), field);
+
+            float c0 = (1 - ty) * c00 + ty * c10;
+            float c1 = (1 - ty) * c01 + ty * c11;
+
+            return (1 - tz) * c0 + tz * c1;
+        }
+
+        float avgU(int x, int y, int z) const
+        {
+            float avgU = loadField(x, y - 1, z, U_FIELD) + loadField(x, y, z, U_FIELD)
+                       + loadField(x + 1, y - 1, z, U_FIELD) + loadField(x + 1, y, z, U_FIELD)
+                       + loadField(x, y - 1, z - 1, U_FIELD) + loadField(x, y, z - 1, U_FIELD)
+                       + loadField(x + 1, y - 1, z - 1, U_FIELD) + loadField(x + 1, y, z - 1, U_FIELD);
+            return avgU / 8.f;
+        }
+
+        float avgV(int x, int y, int z) const
+        {
+            // Matches avgV in smokeHeader.glsl, which only keeps its last sample
+            return loadField(x, y + 1, z - 1, V_FIELD) / 8.f;
+        }
+
+        float avgW(int x, int y, int z) const
+        {
+            float avgW = loadField(x, y - 1, z, W_FIELD) + loadField(x, y, z, W_FIELD)
+                       + loadField(x, y - 1, z + 1, W_FIELD) + loadField(x, y, z + 1, W_FIELD)
+                       + loadField(x - 1, y - 1, z, W_FIELD) + loadField(x - 1, y, z, W_FIELD)
+                       + loadField(x - 1, y - 1, z + 1, W_FIELD) + loadField(x - 1, y, z + 1, W_FIELD);
+            return avgW / 8.f;
+        }
+
+        // Fills the whole padded block of the brick, including the faces it owns
+        void reset(size_t brick)
+        {
+            for (int field = 0; field < FIELD_COUNT; field++)
+            {
+                bool ones = field == S_FIELD || field == P_FIELD || isSmoke(field);
+                auto block = fields[field].subspan(brick * layouts[field].brickElements, layouts[field].brickElements);
+                std::fill(block.begin(), block.end(), ones ? 1.f : 0.f);
+            }
+        }
+
+        void applyGravity(const Brick &brick)
+        {
+            const float maxVelocity = 100.f;
+            glm::vec3 center = glm::vec3(res) / 2.f;
+            glm::vec3 offset = glm::vec3(1, 1, res.z / 4.f);
+            glm::vec3 size = glm::vec3(6, 6, 2);
+
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            for (int y = brick.begin.y; y < brick.end.y; y++)
+            {
+                if (!params.warmStart)
+                    saveField(x, y, z, P_FIELD, 0.f);
+
+                // Smoke source
+                glm::vec2 xyRect = glm::abs(glm::vec2(x, y) - glm::vec2(center));
+                if (z == 0 && xyRect.x < 5 && xyRect.y < 5)
+                {
+                    float t = std::clamp((glm::length(xyRect) / std::sqrt(50.f) - 0.4f) / 0.4f, 0.f, 1.f);
+                    saveField(x, y, z, M_FIELD, t * t * (3 - 2 * t));
+                }
+
+                // 4 splitting boxes and 1 box above
+                glm::vec3 d = glm::abs(center - glm::vec3(x, y, z));
+                bool splitting = std::abs(z - offset.z) < size.z
+                    && d.x > offset.x && d.x < size.x + offset.x
+                    && d.y > offset.y && d.y < size.y + offset.y;
+                bool above = std::abs(z - 2 * offset.z) < size.z && d.x < size.x + offset.x && d.y < size.y + offset.y;
+                float s = splitting || above ? 0.f : 1.f;
+                saveField(x, y, z, S_FIELD, s);
+                if (s == 0.f)
+                    continue;
+
+                saveField(x, y, z, U_FIELD, std::clamp(loadField(x, y, z, U_FIELD) + params.dt * params.gravity.x, -maxVelocity, maxVelocity));
+                saveField(x, y, z, V_FIELD, std::clamp(loadField(x, y, z, V_FIELD) + params.dt * params.gravity.y, -maxVelocity, maxVelocity));
+                saveField(x, y, z, W_FIELD, std::clamp(loadField(x, y, z, W_FIELD) + params.dt * params.gravity.z, -maxVelocity, maxVelocity));
+            }
+        }
+
+        void forceIncompressibility(const Brick &brick, int currentIteration)
+        {
+            float cp = params.density * params.gridSpacing / params.dt;
+            float frac = 1.f / (currentIteration + 1);
+
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            {
+                // Only cells of this pass' checkerboard colour
+                int y = brick.begin.y + ((x + brick.begin.y + z + currentIteration + 1) & 1);
+                for (; y < brick.end.y; y += 2)
+                {
+                    if (loadField(x, y, z, S_FIELD) == 0.f)
+                        continue;
+                    float prevS = loadField(x - 1, y, z, S_FIELD);
+                    float nextS = loadField(x + 1, y, z, S_FIELD);
+                    float upperS = loadField(x, y - 1, z, S_FIELD);
+                    float lowerS = loadField(x, y + 1, z, S_FIELD);
+                    float frontS = loadField(x, y, z - 1, S_FIELD);
+                    float backS = loadField(x, y, z + 1, S_FIELD);
+                    float s = prevS + nextS + lowerS + upperS + frontS + backS;
+                    if (s == 0.f)
+                        continue;
+
+                    float u1 = loadField(x, y, z, U_FIELD);
+                    float u2 = loadField(x + 1, y, z, U_FIELD);
+                    float v1 = loadField(x, y, z, V_FIELD);
+                    float v2 = loadField(x, y + 1, z, V_FIELD);
+                    float w1 = loadField(x, y, z, W_FIELD);
+                    float w2 = loadField(x, y, z + 1, W_FIELD);
+                    float d = u2 - u1 + v2 - v1 + w2 - w1;
+                    float tmp = -d / s * params.overrelaxation;
+
+                    float p = loadField(x, y, z, P_FIELD);
+                    saveField(x, y, z, P_FIELD, params.warmStart ? p + cp * tmp : frac * cp * tmp + (1 - frac) * p);
+
+                    saveField(x, y, z, U_FIELD, u1 - prevS * tmp);
+                    saveField(x + 1, y, z, U_FIELD, u2 + nextS * tmp);
+                    saveField(x, y, z, V_FIELD, v1 - upperS * tmp);
+                    saveField(x, y + 1, z, V_FIELD, v2 + lowerS * tmp);
+                    saveField(x, y, z, W_FIELD, w1 - frontS * tmp);
+                    saveField(x, y, z + 1, W_FIELD, w2 + backS * tmp);
+                }
+            }
+        }
+
+        // Pressure difference across a face between two fluid cells, zero next to obstacles
+        float faceGradient(glm::ivec3 lower, glm::ivec3 upper) const
+        {
+            float s = loadField(lower.x, lower.y, lower.z, S_FIELD) * loadField(upper.x, upper.y, upper.z, S_FIELD);
+            return s * (loadField(lower.x, lower.y, lower.z, P_FIELD) - loadField(upper.x, upper.y, upper.z, P_FIELD));
+        }
+
+        // Warm start, applies the pressure of the last step as applyPressure.comp does
+        void applyPressure(const Brick &brick)
+        {
+            float scale = params.dt / (params.density * params.gridSpacing);
+
+            // Bricks on the upper grid border also own the border faces
+            glm::ivec3 end = brick.end + glm::ivec3(glm::equal(brick.end, res));
+            for (int z = brick.begin.z; z < end.z; z++)
+            for (int x = brick.begin.x; x < end.x; x++)
+            for (int y = brick.begin.y; y < end.y; y++)
+            {
+                glm::ivec3 cell(x, y, z);
+                saveField(x, y, z, U_FIELD, loadField(x, y, z, U_FIELD) + scale * faceGradient(cell - glm::ivec3(1, 0, 0), cell));
+                saveField(x, y, z, V_FIELD, loadField(x, y, z, V_FIELD) + scale * faceGradient(cell - glm::ivec3(0, 1, 0), cell));
+                saveField(x, y, z, W_FIELD, loadField(x, y, z, W_FIELD) + scale * faceGradient(cell - glm::ivec3(0, 0, 1), cell));
+            }
+        }
+
+        void extrapolate(const Brick &brick)
+        {
+            // Bricks on the upper grid border also own the border faces
+            glm::ivec3 end = brick.end + glm::ivec3(glm::equal(brick.end, res));
+            for (int z = brick.begin.z; z < end.z; z++)
+            for (int x = brick.begin.x; x < end.x; x++)
+            for (int y = brick.begin.y; y < end.y; y++)
+            {
+                if (y == 0)
+                    saveField(x, y, z, U_FIELD, loadField(x, y + 1, z, U_FIELD));
+                else if (y == res.y - 1)
+                    saveField(x, y, z, U_FIELD, loadField(x, y - 1, z, U_FIELD));
+                else if (x == 0)
+                    saveField(x, y, z, V_FIELD, loadField(x + 1, y, z, V_FIELD));
+                else if (x == res.x - 1)
+                    saveField(x, y, z, V_FIELD, loadField(x - 1, y, z, V_FIELD));
+                else if (z == 0)
+                    saveField(x, y, z, W_FIELD, loadField(x, y, z + 1, W_FIELD));
+                else if (z == res.z - 1)
+                    saveField(x, y, z, W_FIELD, loadField(x, y, z - 1, W_FIELD));
+            }
+        }
+
+        void advectVelocities(const Brick &brick)
+        {
+            float h = params.gridSpacing;
+            float h2 = 0.5f * h;
+            float dt = params.dt;
+
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            for (int y = brick.begin.y; y < brick.end.y; y++)
+            {
+                float s = loadField(x, y, z, S_FIELD);
+                float u = loadField(x, y, z, U_FIELD);
+                float v = loadField(x, y, z, V_FIELD);
+                float w = loadField(x, y, z, W_FIELD);
+
+                if (s != 0.f && loadField(x - 1, y, z, S_FIELD) != 0.f && y < res.y - 1 && z < res.z - 1)
+                    u = sampleField(x * h - dt * u, y * h + h2 - dt * avgV(x, y, z), z * h + h2 - dt * avgW(x, y, z), U_FIELD);
+
+                if (s != 0.f && loadField(x, y - 1, z, S_FIELD) != 0.f && x < res.x - 1 && z < res.z - 1)
+                    v = sampleField(x * h + h2 - dt * avgU(x, y, z), y * h - dt * v, z * h + h2 - dt * avgW(x, y, z), V_FIELD);
+
+                if (s != 0.f && loadField(x, y, z - 1, S_FIELD) != 0.f && x < res.x - 1 && y < res.y - 1)
+                    w = sampleField(x * h + h2 - dt * avgU(x, y, z), y * h + h2 - dt * avgV(x, y, z), z * h - dt * w, W_FIELD);
+
+                saveField(x, y, z, NEXT_U_FIELD, u);
+                saveField(x, y, z, NEXT_V_FIELD, v);
+                saveField(x, y, z, NEXT_W_FIELD, w);
+            }
+        }
+
+        void copyVelocities(const Brick &brick)
+        {
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            for (int y = brick.begin.y; y < brick.end.y; y++)
+            {
+                saveField(x, y, z, U_FIELD, loadField(x, y, z, NEXT_U_FIELD));
+                saveField(x, y, z, V_FIELD, loadField(x, y, z, NEXT_V_FIELD));
+                saveField(x, y, z, W_FIELD, loadField(x, y, z, NEXT_W_FIELD));
+            }
+        }
+
+        void advectSmoke(const Brick &brick)
+        {
+            float h = params.gridSpacing;
+            float h2 = 0.5f * h;
+            float dt = params.dt;
+
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            for (int y = brick.begin.y; y < brick.end.y; y++)
+            {
+                if (loadField(x, y, z, S_FIELD) == 0.f)
+                    continue;
+
+                // Cell centered velocity, as smokeVelocity in smokeHeader.glsl
+                float velX = loadField(x, y, z, U_FIELD) + 0.5f * loadField(x + 1, y, z, U_FIELD);
+                float velY = loadField(x, y, z, V_FIELD) + 0.5f * loadField(x, y + 1, z, V_FIELD);
+                float velZ = loadField(x, y, z, W_FIELD) + 0.5f * loadField(x, y, z + 1, W_FIELD);
+                float m = sampleField(x * h + h2 - dt * velX, y * h + h2 - dt * velY, z * h + h2 - dt * velZ, M_FIELD);
+                saveField(x, y, z, NEXT_M_FIELD, m);
+            }
+        }
+
+        void copySmoke(const Brick &brick)
+        {
+            for (int z = brick.begin.z; z < brick.end.z; z++)
+            for (int x = brick.begin.x; x < brick.end.x; x++)
+            for (int y = brick.begin.y; y < brick.end.y; y++)
+                saveField(x, y, z, M_FIELD, loadField(x, y, z, NEXT_M_FIELD));
+        }
+
+        glm::ivec3 res;
+        glm::ivec3 brickCount;
+        host::GridArena arena;
+        FieldLayout layouts[FIELD_COUNT];
+        std::span<float> fields[FIELD_COUNT];
+        std::vector<Brick> bricks;
+        std::vector<int> owners; // Worker of every brick
+        std::vector<std::vector<int>> faceNeighbours;
+        std::vector<std::vector<int>> allNeighbours;
+    };
+
+} // namespace cpu
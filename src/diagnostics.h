@@ -0,0 +1,184 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "gpu.h"
+#include "program.h"
+
+namespace gpu
+{
+    // Per step metrics of the 3D solver, laid out like the Partial struct of reduceDiagnostics.comp
+    struct SimulationMetrics
+    {
+        float mass = 0.f;          // Summed smoke density in cell units
+        float maxDivergence = 0.f; // Largest divergence left by the pressure projection
+        float residual = 0.f;      // RMS divergence over all fluid cells
+        float maxSpeed = 0.f;      // Fastest cell centred velocity
+        uint32_t activeCells = 0;  // Cells holding smoke
+        uint32_t fluidCells = 0;   // Cells not blocked by obstacles
+        float centerHeight = 0.f;  // Height of the smoke's centre of mass above the bottom of the grid in cells
+    };
+    static_assert(sizeof(SimulationMetrics) == 28, "Has to match the std430 layout of the shader");
+
+    // Reduces the simulation fields to SimulationMetrics on the GPU. Every recorded step writes
+    // one slot of a persistently mapped result ring and is followed by a fence. collect() only
+    // reads slots whose fence already signaled, directly from the mapping, so results arrive a
+    // few frames late but the CPU never waits for the GPU.
+    class MetricsRing
+    {
+    public:
+        static constexpr GLuint partialsBinding = 19;
+        static constexpr GLuint resultsBinding = 20;
+
+        explicit MetricsRing(int slots = 64)
+            : slots(slots), partials(sizeof(SimulationMetrics), partialsBinding),
+              results(slots * sizeof(SimulationMetrics), resultsBinding,
+                      GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+        {
+        }
+
+        ~MetricsRing()
+        {
+            for (auto &entry : pending)
+                glDeleteSync(entry.fence);
+        }
+
+        MetricsRing(const MetricsRing &) = delete;
+        MetricsRing &operator=(const MetricsRing &) = delete;
+
+        // Reduces the current fields of one step. cellPass writes one partial per workgroup over
+        // the given invocations, reducePass sums them into the next slot. Returns false and records
+        // nothing while every slot still waits for its read back.
+        bool record(Program &cellPass, Program &reducePass, glm::ivec3 invocations, uint64_t step)
+        {
+            if (static_cast<int>(pending.size()) == slots)
+                return false;
+
+            glm::ivec3 groups = reserve(cellPass, invocations);
+            // Several rings may share the binding points
+            int slot = (nextSlot++) % slots;
+            partials.bind();
+            results.bind();
+            cellPass.dispatch(groups);
+            reducePass.setUniform("partialCount", static_cast<unsigned>(groups.x * groups.y * groups.z));
+            reducePass.setUniform("slot", static_cast<unsigned>(slot));
+            reducePass.dispatch(glm::ivec3(1));
+
+            // Reads through the mapping have to see the shader writes once the fence signaled
+            glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+            pending.push_back({slot, step, glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0)});
+            return true;
+        }
+
+        // Grows the partials buffer to one entry per workgroup of cellPass, returns the workgroup count
+        glm::ivec3 reserve(const Program &cellPass, glm::ivec3 invocations)
+        {
+            glm::ivec3 groups = (invocations + cellPass.getLocalSize() - 1) / cellPass.getLocalSize();
+            GLsizeiptr partialBytes = static_cast<GLsizeiptr>(groups.x) * groups.y * groups.z * sizeof(SimulationMetrics);
+            if (partialBytes > partials.getSize())
+                partials = Buffer(partialBytes, partialsBinding);
+            return groups;
+        }
+
+        // Hands every finished step to consume(step, metrics) in recording order
+        template <typename Consume>
+        void collect(Consume &&consume)
+        {
+            while (!pending.empty())
+            {
+                auto &entry = pending.front();
+                GLenum status = glClientWaitSync(entry.fence, 0, 0);
+                if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                    return;
+
+                SimulationMetrics metrics = results.data<const SimulationMetrics>()[entry.slot];
+                glDeleteSync(entry.fence);
+                uint64_t step = entry.step;
+                pending.pop_front();
+                consume(step, metrics);
+            }
+        }
+
+    private:
+        struct Pending
+        {
+            int slot;
+            uint64_t step;
+            GLsync fence;
+        };
+
+        int slots;
+        uint64_t nextSlot = 0;
+        Buffer partials;
+        Buffer results;
+        std::deque<Pending> pending;
+    };
+
+    // Recent metrics for plotting, optionally streamed to a CSV file or, for a .json path,
+    // to one JSON object per line
+    class MetricsLog
+    {
+    public:
+        explicit MetricsLog(size_t capacity = 512) : capacity(capacity) {}
+
+        void open(const std::string &path)
+        {
+            stream.open(path);
+            json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+            if (!json)
+                stream << "step,mass,maxDivergence,residual,maxSpeed,activeCells,fluidCells,centerHeight\n";
+        }
+
+        void add(uint64_t step, const SimulationMetrics &metrics)
+        {
+            history.push_back(metrics);
+            if (history.size() > capacity)
+                history.pop_front();
+            latest = metrics;
+
+            if (!stream.is_open())
+                return;
+            if (json)
+            {
+                stream << "{\"step\":" << step << ",\"mass\":" << metrics.mass << ",\"maxDivergence\":" << metrics.maxDivergence
+                       << ",\"residual\":" << metrics.residual << ",\"maxSpeed\":" << metrics.maxSpeed
+                       << ",\"activeCells\":" << metrics.activeCells << ",\"fluidCells\":" << metrics.fluidCells
+                       << ",\"centerHeight\":" << metrics.centerHeight << "}\n";
+            }
+            else
+            {
+                stream << step << "," << metrics.mass << "," << metrics.maxDivergence << "," << metrics.residual << ","
+                       << metrics.maxSpeed << "," << metrics.activeCells << "," << metrics.fluidCells << ","
+                       << metrics.centerHeight << "\n";
+            }
+        }
+
+        // One metric over the history, e.g. series(&SimulationMetrics::mass)
+        template <typename T>
+        std::vector<float> series(T SimulationMetrics::*member) const
+        {
+            std::vector<float> values;
+            values.reserve(history.size());
+            for (const auto &metrics : history)
+                values.push_back(static_cast<float>(metrics.*member));
+            return values;
+        }
+
+        const SimulationMetrics &getLatest() const { return latest; }
+
+    private:
+        size_t capacity;
+        std::deque<SimulationMetrics> history;
+        SimulationMetrics latest;
+        std::ofstream stream;
+        bool json = false;
+    };
+
+} // namespace gpu
@@ -0,0 +1,407 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+namespace gpu
+{
+    // Shader storage buffer owned by the application. Unlike graphics::SSBO it can be
+    // cleared and read back without going through a host side copy of its contents.
+    //
+    // Storage created with GL_MAP_PERSISTENT_BIT stays mapped for the lifetime of the buffer,
+    // see data(). Host accesses then have to be synchronized with fences, e.g. by a SnapshotRing.
+    class Buffer
+    {
+    public:
+        // Binding of buffers only used for copies, which are not bound on creation
+        static constexpr GLuint noBinding = ~0u;
+
+        Buffer(GLsizeiptr size, GLuint binding, GLbitfield flags = GL_DYNAMIC_STORAGE_BIT)
+            : size(size), binding(binding)
+        {
+            glCreateBuffers(1, &id);
+            glNamedBufferStorage(id, size, nullptr, flags);
+            if (flags & GL_MAP_PERSISTENT_BIT)
+            {
+                GLbitfield access = GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                mapped = glMapNamedBufferRange(id, 0, size, flags & access);
+            }
+            if (binding != noBinding)
+                bind();
+        }
+
+        ~Buffer()
+        {
+            if (id != 0)
+                glDeleteBuffers(1, &id);
+        }
+
+        Buffer(const Buffer &) = delete;
+        Buffer &operator=(const Buffer &) = delete;
+
+        Buffer(Buffer &&other) noexcept
+            : id(other.id), size(other.size), binding(other.binding), mapped(other.mapped)
+        {
+            other.id = 0;
+            other.mapped = nullptr;
+        }
+
+        Buffer &operator=(Buffer &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (id != 0)
+                    glDeleteBuffers(1, &id);
+                id = other.id;
+                size = other.size;
+                binding = other.binding;
+                mapped = other.mapped;
+                other.id = 0;
+                other.mapped = nullptr;
+            }
+            return *this;
+        }
+
+        void bind() const
+        {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, id);
+        }
+
+        // Binds to another binding point, e.g. to swap ping-pong buffers
+        void bind(GLuint otherBinding) const
+        {
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, otherBinding, id);
+        }
+
+        // Fills the whole buffer with a repeated 32 bit pattern
+        void clear(uint32_t value = 0)
+        {
+            glClearNamedBufferData(id, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &value);
+        }
+
+        void clear(float value)
+        {
+            glClearNamedBufferData(id, GL_R32F, GL_RED, GL_FLOAT, &value);
+        }
+
+        // Synchronous read back that waits for every GPU command writing the buffer, only meant
+        // for small buffers outside of the frame loop. Per frame results go through MetricsRing.
+        template <typename T>
+        void read(std::vector<T> &values, GLintptr offset = 0) const
+        {
+            glGetNamedBufferSubData(id, offset, values.size() * sizeof(T), values.data());
+        }
+
+        // Persistent mapping of the whole buffer, nullptr unless created with GL_MAP_PERSISTENT_BIT
+        template <typename T>
+        T *data() const
+        {
+            return static_cast<T *>(mapped);
+        }
+
+        GLuint getID() const { return id; }
+        GLsizeiptr getSize() const { return size; }
+        GLuint getBinding() const { return binding; }
+
+    private:
+        GLuint id = 0;
+        GLsizeiptr size = 0;
+        GLuint binding = 0;
+        void *mapped = nullptr;
+    };
+
+    // Single channel 3D texture with immutable storage. It is written by compute
+    // shaders as an image and read by render shaders through a filtered sampler.
+    // Volumes with several levels are sampled trilinearly between them, see buildMipChain.
+    class Volume
+    {
+    public:
+        Volume(glm::ivec3 resolution, GLenum internalFormat = GL_R16F, GLint wrap = GL_CLAMP_TO_EDGE, int levels = 1)
+            : resolution(resolution), internalFormat(internalFormat), levels(levels)
+        {
+            glCreateTextures(GL_TEXTURE_3D, 1, &id);
+            glTextureStorage3D(id, levels, internalFormat, resolution.x, resolution.y, resolution.z);
+            glTextureParameteri(id, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+            glTextureParameteri(id, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTextureParameteri(id, GL_TEXTURE_WRAP_S, wrap);
+            glTextureParameteri(id, GL_TEXTURE_WRAP_T, wrap);
+            glTextureParameteri(id, GL_TEXTURE_WRAP_R, wrap);
+        }
+
+        ~Volume()
+        {
+            if (id != 0)
+                glDeleteTextures(1, &id);
+        }
+
+        Volume(const Volume &) = delete;
+        Volume &operator=(const Volume &) = delete;
+
+        Volume(Volume &&other) noexcept
+            : resolution(other.resolution), id(other.id), internalFormat(other.internalFormat), levels(other.levels)
+        {
+            other.id = 0;
+        }
+
+        Volume &operator=(Volume &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (id != 0)
+                    glDeleteTextures(1, &id);
+                id = other.id;
+                resolution = other.resolution;
+                internalFormat = other.internalFormat;
+                levels = other.levels;
+                other.id = 0;
+            }
+            return *this;
+        }
+
+        // Uploads a block of single channel floats starting at offset
+        void upload(const float *data, glm::ivec3 offset, glm::ivec3 size)
+        {
+            glTextureSubImage3D(id, 0, offset.x, offset.y, offset.z, size.x, size.y, size.z, GL_RED, GL_FLOAT, data);
+        }
+
+        void bindImage(GLuint unit, GLenum access = GL_WRITE_ONLY, int level = 0) const
+        {
+            glBindImageTexture(unit, id, level, GL_TRUE, 0, access, internalFormat);
+        }
+
+        void bindTexture(GLuint unit) const
+        {
+            glBindTextureUnit(unit, id);
+        }
+
+        GLuint getID() const { return id; }
+        int getLevels() const { return levels; }
+
+        // Resolution of a mip level, halved per level and rounded down like the texture storage
+        glm::ivec3 levelResolution(int level) const { return glm::max(resolution >> level, glm::ivec3(1)); }
+
+        // Levels of a full mip chain down to a single texel
+        static int mipLevels(glm::ivec3 resolution)
+        {
+            int levels = 1;
+            while ((glm::max(resolution.x, glm::max(resolution.y, resolution.z)) >> levels) > 0)
+                levels++;
+            return levels;
+        }
+
+        glm::ivec3 resolution;
+
+    private:
+        GLuint id = 0;
+        GLenum internalFormat;
+        int levels;
+    };
+
+    // Framebuffer with one 2D texture per color attachment, used for rendering at a
+    // different resolution than the window and for keeping history between frames
+    class RenderTarget
+    {
+    public:
+        RenderTarget(glm::ivec2 size, const std::vector<GLenum> &formats)
+            : size(size), textures(formats.size())
+        {
+            glCreateFramebuffers(1, &fbo);
+            glCreateTextures(GL_TEXTURE_2D, static_cast<GLsizei>(textures.size()), textures.data());
+            std::vector<GLenum> drawBuffers;
+            for (size_t i = 0; i < textures.size(); i++)
+            {
+                glTextureStorage2D(textures[i], 1, formats[i], size.x, size.y);
+                glTextureParameteri(textures[i], GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTextureParameteri(textures[i], GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTextureParameteri(textures[i], GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+                glTextureParameteri(textures[i], GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+                glNamedFramebufferTexture(fbo, GL_COLOR_ATTACHMENT0 + static_cast<GLenum>(i), textures[i], 0);
+                drawBuffers.push_back(GL_COLOR_ATTACHMENT0 + static_cast<GLenum>(i));
+            }
+            glNamedFramebufferDrawBuffers(fbo, static_cast<GLsizei>(drawBuffers.size()), drawBuffers.data());
+        }
+
+        ~RenderTarget()
+        {
+            if (fbo != 0)
+            {
+                glDeleteFramebuffers(1, &fbo);
+                glDeleteTextures(static_cast<GLsizei>(textures.size()), textures.data());
+            }
+        }
+
+        RenderTarget(const RenderTarget &) = delete;
+        RenderTarget &operator=(const RenderTarget &) = delete;
+
+        RenderTarget(RenderTarget &&other) noexcept
+            : size(other.size), fbo(other.fbo), textures(std::move(other.textures))
+        {
+            other.fbo = 0;
+        }
+
+        RenderTarget &operator=(RenderTarget &&other) noexcept
+        {
+            if (this != &other)
+            {
+                if (fbo != 0)
+                {
+                    glDeleteFramebuffers(1, &fbo);
+                    glDeleteTextures(static_cast<GLsizei>(textures.size()), textures.data());
+                }
+                size = other.size;
+                fbo = other.fbo;
+                textures = std::move(other.textures);
+                other.fbo = 0;
+            }
+            return *this;
+        }
+
+        // Renders into this target, the viewport covers the whole target
+        void bind() const
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            glViewport(0, 0, size.x, size.y);
+        }
+
+        void clear(int attachment, glm::vec4 value) const
+        {
+            glClearNamedFramebufferfv(fbo, GL_COLOR, attachment, &value[0]);
+        }
+
+        void bindTexture(int attachment, GLuint unit) const
+        {
+            glBindTextureUnit(unit, textures[attachment]);
+        }
+
+        glm::ivec2 size;
+
+    private:
+        GLuint fbo = 0;
+        std::vector<GLuint> textures;
+    };
+
+    // Indexed triangle mesh drawn with a gpu::Program, which graphics::Mesh::draw does not
+    // take. Vertices are laid out like graphics::Mesh::Vertex: position, normal and texture
+    // coordinate at attribute locations 0, 1 and 2.
+    class Mesh
+    {
+    public:
+        template <typename Vertex>
+        Mesh(const std::vector<Vertex> &vertices, const std::vector<unsigned int> &indices)
+            : count(static_cast<GLsizei>(indices.size()))
+        {
+            static_assert(sizeof(Vertex) == 8 * sizeof(float), "Expected a position, normal and texture coordinate");
+            glCreateBuffers(2, buffers);
+            glNamedBufferStorage(buffers[0], vertices.size() * sizeof(Vertex), vertices.data(), 0);
+            glNamedBufferStorage(buffers[1], indices.size() * sizeof(unsigned int), indices.data(), 0);
+
+            glCreateVertexArrays(1, &vao);
+            glVertexArrayVertexBuffer(vao, 0, buffers[0], 0, sizeof(Vertex));
+            glVertexArrayElementBuffer(vao, buffers[1]);
+            const GLint sizes[3] = {3, 3, 2};
+            GLuint offset = 0;
+            for (GLuint attribute = 0; attribute < 3; attribute++)
+            {
+                glEnableVertexArrayAttrib(vao, attribute);
+                glVertexArrayAttribFormat(vao, attribute, sizes[attribute], GL_FLOAT, GL_FALSE, offset);
+                glVertexArrayAttribBinding(vao, attribute, 0);
+                offset += sizes[attribute] * sizeof(float);
+            }
+        }
+
+        ~Mesh()
+        {
+            glDeleteVertexArrays(1, &vao);
+            glDeleteBuffers(2, buffers);
+        }
+
+        Mesh(const Mesh &) = delete;
+        Mesh &operator=(const Mesh &) = delete;
+
+        template <typename Shader>
+        void draw(const Shader &shader) const
+        {
+            shader.bind();
+            glBindVertexArray(vao);
+            glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, nullptr);
+            glBindVertexArray(0);
+        }
+
+    private:
+        GLuint vao = 0;
+        GLuint buffers[2] = {};
+        GLsizei count;
+    };
+
+    // Runs a compute shader once per slice of the volume, starting at the slice closest to
+    // the light, so every slice can read the previous one. The shader gets the slice through
+    // the sweepAxis, sweepDirection (+1 when the light lies towards higher slices) and
+    // sweepSlice uniforms and writes the volume bound as image at imageUnit.
+    template <typename Shader>
+    void sweepTowardsLight(Shader &shader, const Volume &volume, GLuint imageUnit, glm::vec3 towardsLight)
+    {
+        int axis = 0;
+        for (int i = 1; i < 3; i++)
+        {
+            if (std::abs(towardsLight[i]) > std::abs(towardsLight[axis]))
+                axis = i;
+        }
+        int direction = towardsLight[axis] > 0 ? 1 : -1;
+        int slices = volume.resolution[axis];
+        glm::ivec3 dispatchSize(volume.resolution[(axis + 1) % 3] / 8 + 1, volume.resolution[(axis + 2) % 3] / 8 + 1, 1);
+
+        volume.bindImage(imageUnit, GL_READ_WRITE);
+        shader.bind();
+        shader.setUniform("sweepAxis", axis);
+        shader.setUniform("sweepDirection", direction);
+        shader.unbind();
+        for (int i = 0; i < slices; i++)
+        {
+            shader.bind();
+            shader.setUniform("sweepSlice", direction > 0 ? slices - 1 - i : i);
+            shader.unbind();
+            shader.dispatch(dispatchSize);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    // Fills the levels below the first of a volume, each from the one above. The shader runs
+    // 4x4x4 workgroups reading the finer level from image unit finerUnit and writing the
+    // coarser level to finerUnit + 1, see downsampleSmoke.comp.
+    template <typename Shader>
+    void buildMipChain(Shader &shader, const Volume &volume, GLuint finerUnit)
+    {
+        for (int level = 1; level < volume.getLevels(); level++)
+        {
+            volume.bindImage(finerUnit, GL_READ_ONLY, level - 1);
+            volume.bindImage(finerUnit + 1, GL_WRITE_ONLY, level);
+            shader.dispatch((volume.levelResolution(level) + 3) / 4);
+            glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+        }
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    }
+
+    // Writes the color buffer of the default framebuffer as binary PPM with rows from top to
+    // bottom, the format of the CPU renderer's images (cpu::Image) so they can be compared
+    inline void saveFramebuffer(const std::string &path, glm::ivec2 size)
+    {
+        std::vector<char> pixels(size.x * size.y * 3);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, size.x, size.y, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+        std::ofstream file(path, std::ios::binary);
+        file << "P6\n" << size.x << " " << size.y << "\n255\n";
+        for (int y = size.y - 1; y >= 0; y--)
+            file.write(pixels.data() + y * size.x * 3, size.x * 3);
+    }
+
+} // namespace gpu
@@ -0,0 +1,408 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <tinylogger/tinylogger.h>
+
+namespace gpu
+{
+    // Directory of the program binary cache, relative to the working directory
+    inline const std::filesystem::path programCacheDirectory = "shaderCache";
+
+    // Name and value of every #define a program is specialized with
+    using Defines = std::map<std::string, std::string>;
+
+    class Program;
+    inline void buildPrograms(const std::vector<Program *> &programs);
+
+    // Shader stage of a source file by its extension, 0 for unknown extensions
+    inline GLenum shaderStage(const std::filesystem::path &path)
+    {
+        static const std::map<std::string, GLenum> stages = {
+            {".comp", GL_COMPUTE_SHADER}, {".vert", GL_VERTEX_SHADER}, {".tesc", GL_TESS_CONTROL_SHADER},
+            {".tese", GL_TESS_EVALUATION_SHADER}, {".geom", GL_GEOMETRY_SHADER}, {".frag", GL_FRAGMENT_SHADER}};
+        auto stage = stages.find(path.extension().string());
+        return stage == stages.end() ? 0 : stage->second;
+    }
+
+    // Program with the interface of graphics::Shader, either a compute program or a graphics
+    // program linked from one file per stage. Programs are built in batches by buildPrograms:
+    // linked binaries are cached on disk, keyed by a hash of the fully included sources and the
+    // driver, and cache misses are compiled concurrently by the driver.
+    //
+    // A program can be specialized with #defines injected after the #version line of every
+    // stage. Every variant built so far stays linked, so switching back to it costs no compilation.
+    class Program
+    {
+    public:
+        explicit Program(std::string path, Defines defines = {})
+            : Program(std::vector<std::string>{std::move(path)}, std::move(defines))
+        {
+        }
+
+        // Stages in pipeline order, e.g. {"cube.vert", "cube.frag"}
+        explicit Program(std::vector<std::string> paths, Defines defines = {})
+            : paths(std::move(paths)), defines(std::move(defines)),
+              compute(this->paths.size() == 1 && shaderStage(this->paths.front()) == GL_COMPUTE_SHADER)
+        {
+        }
+
+        ~Program()
+        {
+            for (auto &[hash, variant] : variants)
+                glDeleteProgram(variant);
+        }
+
+        Program(const Program &) = delete;
+        Program &operator=(const Program &) = delete;
+
+        Program(Program &&other) noexcept
+            : paths(std::move(other.paths)), defines(std::move(other.defines)), compute(other.compute), id(other.id), localSize(other.localSize),
+              variants(std::move(other.variants)), locations(std::move(other.locations))
+        {
+            other.id = 0;
+            other.variants.clear();
+        }
+
+        void bind() const { glUseProgram(id); }
+        void unbind() const { glUseProgram(0); }
+
+        // Like graphics::Shader::dispatch, storage written here is visible to the next dispatch
+        void dispatch(glm::ivec3 groups) const
+        {
+            glUseProgram(id);
+            glDispatchCompute(groups.x, groups.y, groups.z);
+            glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+            glUseProgram(0);
+        }
+
+        // Dispatches enough workgroups of the linked local size to cover all invocations
+        void dispatchFor(glm::ivec3 invocations) const
+        {
+            dispatch(groupsFor(invocations));
+        }
+
+        glm::ivec3 groupsFor(glm::ivec3 invocations) const
+        {
+            return (invocations + localSize - 1) / localSize;
+        }
+
+        // Bare dispatch for callers that bind the program and place barriers themselves, see StageGraph
+        void dispatchGroups(glm::ivec3 groups) const
+        {
+            glDispatchCompute(groups.x, groups.y, groups.z);
+        }
+
+        // Rebuilds the program alone, prefer buildPrograms when reloading several
+        void reload();
+
+        // Takes effect with the next buildPrograms, which selects or builds the matching variant
+        void specialize(const Defines &specialization) { defines = specialization; }
+        const Defines &getDefines() const { return defines; }
+
+        void setUniform(const std::string &name, bool value) { glProgramUniform1i(id, location(name), value); }
+        void setUniform(const std::string &name, int value) { glProgramUniform1i(id, location(name), value); }
+        void setUniform(const std::string &name, unsigned value) { glProgramUniform1ui(id, location(name), value); }
+        void setUniform(const std::string &name, float value) { glProgramUniform1f(id, location(name), value); }
+        void setUniform(const std::string &name, glm::vec2 value) { glProgramUniform2f(id, location(name), value.x, value.y); }
+        void setUniform(const std::string &name, glm::vec3 value) { glProgramUniform3f(id, location(name), value.x, value.y, value.z); }
+        void setUniform(const std::string &name, glm::vec4 value) { glProgramUniform4f(id, location(name), value.x, value.y, value.z, value.w); }
+        void setUniform(const std::string &name, glm::ivec2 value) { glProgramUniform2i(id, location(name), value.x, value.y); }
+        void setUniform(const std::string &name, glm::ivec3 value) { glProgramUniform3i(id, location(name), value.x, value.y, value.z); }
+        void setUniform(const std::string &name, const glm::mat4 &value) { glProgramUniformMatrix4fv(id, location(name), 1, GL_FALSE, &value[0][0]); }
+
+        GLuint getID() const { return id; }
+        glm::ivec3 getLocalSize() const { return localSize; }
+        const std::string &getPath() const { return paths.back(); }
+
+    private:
+        friend void buildPrograms(const std::vector<Program *> &programs);
+
+        GLint location(const std::string &name)
+        {
+            auto it = locations.find(name);
+            if (it == locations.end())
+                it = locations.emplace(name, glGetUniformLocation(id, name.c_str())).first;
+            return it->second;
+        }
+
+        void select(uint64_t hash, GLuint variant)
+        {
+            variants[hash] = variant;
+            id = variant;
+            locations.clear();
+            if (compute)
+                glGetProgramiv(id, GL_COMPUTE_WORK_GROUP_SIZE, &localSize.x);
+        }
+
+        std::vector<std::string> paths;
+        Defines defines;
+        bool compute;
+        GLuint id = 0;
+        glm::ivec3 localSize = glm::ivec3(1);
+        std::unordered_map<uint64_t, GLuint> variants; // Linked programs by source hash
+        std::unordered_map<std::string, GLint> locations;
+    };
+
+    // Source of a shader with every #include "file" replaced by the file's contents, relative
+    // to the including file. Each file is included at most once.
+    inline std::string resolveIncludes(const std::filesystem::path &path, std::set<std::filesystem::path> &included)
+    {
+        auto canonical = std::filesystem::weakly_canonical(path);
+        if (!included.insert(canonical).second)
+            return "";
+
+        std::ifstream file(path);
+        if (!file)
+        {
+            tlog::error() << "Failed to open shader " << path.string();
+            return "";
+        }
+
+        std::stringstream source;
+        std::string line;
+        while (std::getline(file, line))
+        {
+            auto begin = line.find("#include \"");
+            if (begin != std::string::npos && line.find_first_not_of(" \t") == begin)
+            {
+                auto nameBegin = begin + 10;
+                auto name = line.substr(nameBegin, line.find('"', nameBegin) - nameBegin);
+                source << resolveIncludes(path.parent_path() / name, included) << "\n";
+            }
+            else
+            {
+                source << line << "\n";
+            }
+        }
+        return source.str();
+    }
+
+    // Workgroup shape of kernels declaring layout(local_size_x = LOCAL_SIZE_X, ...)
+    inline Defines localSizeDefines(glm::ivec3 localSize)
+    {
+        return {
+            {"LOCAL_SIZE_X", std::to_string(localSize.x)},
+            {"LOCAL_SIZE_Y", std::to_string(localSize.y)},
+            {"LOCAL_SIZE_Z", std::to_string(localSize.z)},
+        };
+    }
+
+    // Inserts the defines behind the #version line, which has to stay first
+    inline std::string injectDefines(const std::string &source, const Defines &defines)
+    {
+        std::string block;
+        for (const auto &[name, value] : defines)
+            block += "#define " + name + " " + value + "\n";
+        auto version = source.find("#version");
+        auto insert = version == std::string::npos ? 0 : source.find('\n', version) + 1;
+        return source.substr(0, insert) + block + source.substr(insert);
+    }
+
+    // FNV-1a, only used to name cache entries
+    inline uint64_t hashString(const std::string &value, uint64_t hash = 0xcbf29ce484222325ull)
+    {
+        for (unsigned char c : value)
+        {
+            hash ^= c;
+            hash *= 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    inline std::string driverString()
+    {
+        std::string driver;
+        for (GLenum name : {GL_VENDOR, GL_RENDERER, GL_VERSION})
+            driver += reinterpret_cast<const char *>(glGetString(name)) + std::string("\n");
+        return driver;
+    }
+
+    inline bool loadProgramBinary(GLuint program, const std::filesystem::path &file)
+    {
+        std::ifstream stream(file, std::ios::binary | std::ios::ate);
+        if (!stream)
+            return false;
+        std::streamoff size = stream.tellg();
+        if (size <= static_cast<std::streamoff>(sizeof(GLenum)))
+            return false;
+        stream.seekg(0);
+        GLenum format;
+        stream.read(reinterpret_cast<char *>(&format), sizeof(format));
+        std::vector<char> binary(size - sizeof(format));
+        stream.read(binary.data(), binary.size());
+        if (!stream)
+            return false;
+
+        glProgramBinary(program, format, binary.data(), static_cast<GLsizei>(binary.size()));
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        return linked == GL_TRUE;
+    }
+
+    inline void storeProgramBinary(GLuint program, const std::filesystem::path &file)
+    {
+        GLint length = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(program, length, nullptr, &format, binary.data());
+
+        std::error_code error;
+        std::filesystem::create_directories(file.parent_path(), error);
+        std::ofstream stream(file, std::ios::binary);
+        stream.write(reinterpret_cast<const char *>(&format), sizeof(format));
+        stream.write(binary.data(), binary.size());
+    }
+
+    // Builds the current variant of all programs of a batch. Variants linked before are
+    // selected and cached binaries are loaded directly. The remaining programs are all
+    // submitted before the first link status is queried, so a driver supporting parallel
+    // shader compilation compiles them on its own threads meanwhile.
+    inline void buildPrograms(const std::vector<Program *> &programs)
+    {
+        static bool parallelCompile = [] {
+#ifdef GL_ARB_parallel_shader_compile
+            if (GLEW_ARB_parallel_shader_compile)
+            {
+                glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+                return true;
+            }
+#endif
+            return false;
+        }();
+        static const std::string driver = driverString();
+
+        struct Pending
+        {
+            Program *program;
+            uint64_t hash;
+            GLuint id;
+            std::vector<GLuint> shaders;
+            std::filesystem::path cacheFile;
+        };
+        std::vector<Pending> pending;
+        int linked = 0;
+        int cached = 0;
+
+        for (Program *program : programs)
+        {
+            // Every stage resolves its includes on its own, stages may share a header
+            std::vector<std::string> sources;
+            uint64_t hash = hashString(driver);
+            for (const auto &path : program->paths)
+            {
+                std::set<std::filesystem::path> included;
+                sources.push_back(injectDefines(resolveIncludes(path, included), program->defines));
+                hash = hashString(std::filesystem::path(path).extension().string() + sources.back(), hash);
+            }
+            auto variant = program->variants.find(hash);
+            if (variant != program->variants.end())
+            {
+                if (program->id != variant->second)
+                    program->select(hash, variant->second);
+                linked++;
+                continue;
+            }
+
+            std::stringstream name;
+            name << std::hex << hash << ".bin";
+            auto cacheFile = programCacheDirectory / name.str();
+
+            // A failed build keeps the previously selected variant
+            GLuint id = glCreateProgram();
+            if (loadProgramBinary(id, cacheFile))
+            {
+                program->select(hash, id);
+                cached++;
+                continue;
+            }
+
+            std::vector<GLuint> shaders;
+            for (size_t i = 0; i < sources.size(); i++)
+            {
+                GLenum stage = shaderStage(program->paths[i]);
+                if (stage == 0)
+                {
+                    tlog::error() << "Unknown shader stage of " << program->paths[i];
+                    continue;
+                }
+                const char *sourcePointer = sources[i].c_str();
+                GLuint shader = glCreateShader(stage);
+                glShaderSource(shader, 1, &sourcePointer, nullptr);
+                glCompileShader(shader);
+                glAttachShader(id, shader);
+                shaders.push_back(shader);
+            }
+            glProgramParameteri(id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            glLinkProgram(id);
+            pending.push_back({program, hash, id, std::move(shaders), cacheFile});
+        }
+
+        // Querying the status waits for the link, by then later programs compile in parallel
+        for (auto &[program, hash, id, shaders, cacheFile] : pending)
+        {
+            GLint status = GL_FALSE;
+            glGetProgramiv(id, GL_LINK_STATUS, &status);
+            for (GLuint shader : shaders)
+                glDetachShader(id, shader);
+            if (status == GL_TRUE)
+            {
+                storeProgramBinary(id, cacheFile);
+                program->select(hash, id);
+            }
+            else
+            {
+                // Compile errors are in the logs of the stages, mismatched interfaces between
+                // stages and resource limits only in the one of the program
+                std::string logs;
+                for (size_t i = 0; i < shaders.size(); i++)
+                {
+                    GLint length = 0;
+                    glGetShaderiv(shaders[i], GL_INFO_LOG_LENGTH, &length);
+                    if (length <= 1)
+                        continue;
+                    std::string log(length, '\0');
+                    glGetShaderInfoLog(shaders[i], length, nullptr, log.data());
+                    logs += program->paths[i] + ":\n" + log.c_str() + "\n";
+                }
+                GLint length = 0;
+                glGetProgramiv(id, GL_INFO_LOG_LENGTH, &length);
+                if (length > 1)
+                {
+                    std::string log(length, '\0');
+                    glGetProgramInfoLog(id, length, nullptr, log.data());
+                    logs += std::string("Link:\n") + log.c_str();
+                }
+                tlog::error() << "Failed to build " << program->getPath() << ":\n" << logs;
+                glDeleteProgram(id);
+            }
+            for (GLuint shader : shaders)
+                glDeleteShader(shader);
+        }
+
+        if (pending.empty() && cached == 0)
+            return;
+        tlog::info() << "Built " << programs.size() << " programs, " << linked << " already linked, "
+                     << cached << " from the binary cache" << (parallelCompile ? ", parallel compile" : "");
+    }
+
+    inline void Program::reload()
+    {
+        buildPrograms({this});
+    }
+
+} // namespace gpu
@@ -0,0 +1,232 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <imgui.h>
+
+#include "controls/gui.h"
+
+namespace properties
+{
+    // Cached value of one property of a controls::PropertySystem. GUI edits and Handle::set()
+    // mark the entry, Registry::update() turns the marks into the changed flags of the next frame.
+    class Entry
+    {
+    public:
+        virtual ~Entry() = default;
+
+        // Takes over the value of the property system, returns whether it differed
+        virtual bool sync() = 0;
+
+        void mark()
+        {
+            if (marked)
+                return;
+            marked = true;
+            markedEntries->push_back(this);
+        }
+
+        std::string name;
+        bool changed = false;
+        bool marked = false;
+        std::vector<size_t> bindings; // Into the bindings of the registry
+        std::vector<Entry *> *markedEntries = nullptr;
+        controls::PropertySystem *system = nullptr;
+    };
+
+    template <typename T>
+    class TypedEntry : public Entry
+    {
+    public:
+        bool sync() override
+        {
+            T current = system->getValue<T>(name);
+            if (current == value)
+                return false;
+            value = current;
+            return true;
+        }
+
+        T value;
+    };
+
+    // Typed reference to a property whose name was resolved once at registration.
+    // Reading it dereferences the cached entry without any lookup.
+    template <typename T>
+    class Handle
+    {
+    public:
+        Handle() = default;
+        explicit Handle(TypedEntry<T> *entry) : entry(entry) {}
+
+        const T &operator*() const { return entry->value; }
+        const T *operator->() const { return &entry->value; }
+
+        // Whether the value changed before the last Registry::update(), true in the first frame
+        bool changed() const { return entry->changed; }
+
+        // Takes effect immediately, changed() follows at the next update
+        void set(const T &value)
+        {
+            if (entry->value == value)
+                return;
+            entry->value = value;
+            entry->system->template setValue<T>(entry->name, value);
+            entry->mark();
+        }
+
+        Entry *getEntry() const { return entry; }
+
+    private:
+        TypedEntry<T> *entry = nullptr;
+    };
+
+    // Properties one derived resource depends on, e.g. the parameters of a noise volume
+    class Group
+    {
+    public:
+        template <typename... Handles>
+        explicit Group(const Handles &...handles) : entries{handles.getEntry()...}
+        {
+        }
+
+        bool changed() const
+        {
+            for (const Entry *entry : entries)
+            {
+                if (entry->changed)
+                    return true;
+            }
+            return false;
+        }
+
+    private:
+        std::vector<const Entry *> entries;
+    };
+
+    // Hands out handles to the properties of a controls::PropertySystem, which loads the
+    // property file and draws the widgets, and keeps track of which shader uniforms are out of
+    // date. The system only exposes values by name, so registered properties are cached and
+    // compared against it by name only in frames in which the user interacts with the GUI.
+    class Registry
+    {
+    public:
+        explicit Registry(const std::string &path) : system(path) {}
+
+        Registry(const Registry &) = delete;
+        Registry &operator=(const Registry &) = delete;
+
+        // Everything registered counts as changed in the first frame
+        template <typename T>
+        Handle<T> get(const std::string &name)
+        {
+            for (auto &entry : entries)
+            {
+                if (entry->name != name)
+                    continue;
+                auto *typed = dynamic_cast<TypedEntry<T> *>(entry.get());
+                if (typed == nullptr)
+                    throw std::runtime_error("Property " + name + " was registered with a different type");
+                return Handle<T>(typed);
+            }
+
+            auto entry = std::make_unique<TypedEntry<T>>();
+            entry->name = name;
+            entry->system = &system;
+            entry->markedEntries = &markedEntries;
+            entry->value = system.getValue<T>(name);
+            entry->mark();
+            auto *typed = entry.get();
+            entries.push_back(std::move(entry));
+            return Handle<T>(typed);
+        }
+
+        // Uploads the property as uniform of the shader (graphics::Shader or gpu::Program) whenever it changed
+        template <typename T, typename Shader>
+        void bindUniform(const Handle<T> &handle, Shader &shader, const std::string &uniform)
+        {
+            Handle<T> value = handle;
+            handle.getEntry()->bindings.push_back(bindings.size());
+            bindings.push_back({&shader, [&shader, value, uniform] { shader.setUniform(uniform, *value); }, true});
+        }
+
+        // Widgets of the property system. An edit needs an active item, in the frame it is made
+        // or, for clicks, the one before.
+        void buildGUI()
+        {
+            system.buildGUI();
+            bool active = ImGui::IsAnyItemActive();
+            if (active || wasActive)
+            {
+                for (auto &entry : entries)
+                {
+                    if (entry->sync())
+                        entry->mark();
+                }
+            }
+            wasActive = active;
+        }
+
+        // Call once per frame after the GUI was built. The properties marked since the last
+        // update become changed for this frame, those of the last frame are reset.
+        void update()
+        {
+            for (Entry *entry : changedEntries)
+                entry->changed = false;
+            changedEntries.swap(markedEntries);
+            markedEntries.clear();
+            for (Entry *entry : changedEntries)
+            {
+                entry->marked = false;
+                entry->changed = true;
+                for (size_t binding : entry->bindings)
+                    bindings[binding].dirty = true;
+            }
+        }
+
+        // Sets the uniforms of the bound shader that changed since its last upload
+        template <typename Shader>
+        void upload(Shader &shader)
+        {
+            for (auto &binding : bindings)
+            {
+                if (binding.shader != &shader || !binding.dirty)
+                    continue;
+                binding.upload();
+                binding.dirty = false;
+            }
+        }
+
+        // A reloaded shader lost all of its uniforms
+        template <typename Shader>
+        void invalidate(Shader &shader)
+        {
+            for (auto &binding : bindings)
+            {
+                if (binding.shader == &shader)
+                    binding.dirty = true;
+            }
+        }
+
+    private:
+        struct Binding
+        {
+            const void *shader;
+            std::function<void()> upload;
+            bool dirty;
+        };
+
+        controls::PropertySystem system;
+        std::vector<std::unique_ptr<Entry>> entries;
+        std::vector<Entry *> markedEntries;
+        std::vector<Entry *> changedEntries;
+        std::vector<Binding> bindings;
+        bool wasActive = false;
+    };
+
+} // namespace properties
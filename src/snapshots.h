@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include <GL/glew.h>
+
+#include "gpu.h"
+
+namespace gpu
+{
+    // Host read access to device buffers through a ring of slots in one persistently mapped,
+    // coherent buffer. A snapshot is a GPU side copy of a device buffer into the next slot
+    // followed by a fence, collect() hands out slots whose fence signaled as pointers into the
+    // mapping. Nothing waits for the GPU or goes through glGetBufferSubData staging copies.
+    class SnapshotRing
+    {
+    public:
+        explicit SnapshotRing(GLsizeiptr slotSize, int slotCount = 3)
+            : slotSize(slotSize), slots(slotCount),
+              storage(slotSize * slotCount, Buffer::noBinding,
+                      GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT)
+        {
+        }
+
+        ~SnapshotRing()
+        {
+            for (auto &slot : slots)
+            {
+                if (slot.fence != nullptr)
+                    glDeleteSync(slot.fence);
+            }
+        }
+
+        SnapshotRing(const SnapshotRing &) = delete;
+        SnapshotRing &operator=(const SnapshotRing &) = delete;
+
+        // Copies slotSize bytes of the source starting at offset into the next slot. A circular
+        // source, such as a field of the moving window, is unrotated by starting the slot at
+        // rotation bytes and wrapping the rest around. Shader writes to the source have to be
+        // made visible with GL_BUFFER_UPDATE_BARRIER_BIT beforehand. Returns false and copies
+        // nothing while the next slot is still in use.
+        bool snapshot(const Buffer &source, uint64_t tag, GLintptr offset = 0, GLintptr rotation = 0)
+        {
+            // A slot is free again once collect() handed out its snapshot
+            int index = next;
+            if (slots[index].fence != nullptr)
+                return false;
+
+            GLintptr slot = index * slotSize;
+            glCopyNamedBufferSubData(source.getID(), storage.getID(), offset + rotation, slot, slotSize - rotation);
+            if (rotation > 0)
+                glCopyNamedBufferSubData(source.getID(), storage.getID(), offset, slot + slotSize - rotation, rotation);
+            slots[index] = {glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0), tag};
+            pending.push_back(index);
+            next = (next + 1) % static_cast<int>(slots.size());
+            return true;
+        }
+
+        // Hands every finished snapshot to consume(tag, data) in recording order. data points into
+        // the mapping and is only valid during the call.
+        template <typename Consume>
+        void collect(Consume &&consume)
+        {
+            while (!pending.empty())
+            {
+                Slot &slot = slots[pending.front()];
+                GLenum status = glClientWaitSync(slot.fence, 0, 0);
+                if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                    return;
+
+                consume(slot.tag, storage.data<const char>() + pending.front() * slotSize);
+                glDeleteSync(slot.fence);
+                slot = Slot();
+                pending.pop_front();
+            }
+        }
+
+        GLsizeiptr getSlotSize() const { return slotSize; }
+
+    private:
+        struct Slot
+        {
+            GLsync fence = nullptr;
+            uint64_t tag = 0;
+        };
+
+        GLsizeiptr slotSize;
+        std::vector<Slot> slots;
+        Buffer storage;
+        std::deque<int> pending;
+        int next = 0;
+    };
+
+} // namespace gpu
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+
+#include "program.h"
+
+namespace gpu
+{
+    // One access of a stage to a resource. barrier is the glMemoryBarrier bit that makes
+    // earlier shader writes visible to this kind of access.
+    struct Access
+    {
+        int resource;
+        GLbitfield barrier;
+    };
+
+    inline Access storage(int resource) { return {resource, GL_SHADER_STORAGE_BARRIER_BIT}; }
+    inline Access image(int resource) { return {resource, GL_SHADER_IMAGE_ACCESS_BARRIER_BIT}; }
+    inline Access texture(int resource) { return {resource, GL_TEXTURE_FETCH_BARRIER_BIT}; }
+    inline Access host(int resource) { return {resource, GL_BUFFER_UPDATE_BARRIER_BIT}; }
+
+    // Compute work of a frame as stages that declare the resources they read and write. Stages
+    // run in the order they were added, the dependencies between them follow from the declared
+    // accesses: a barrier is only issued in front of a stage that reads or overwrites data an
+    // earlier stage wrote, or overwrites data an earlier stage may still read, and it only
+    // carries the bits of the accesses involved. Program binds are skipped while consecutive
+    // dispatches use the same program. The hazard state carries over from one run to the next.
+    // With elision disabled every stage gets a barrier with all of its access bits and its own
+    // program bind, like dispatching each kernel on its own, for comparison.
+    class StageGraph
+    {
+    public:
+        // Counters of the last run
+        struct Statistics
+        {
+            int dispatches = 0;
+            int barriers = 0;
+            int binds = 0;
+            double submitMs = 0;
+            bool elision = true; // Whether the run elided barriers and binds
+        };
+
+        int resource(const std::string &name)
+        {
+            resources.push_back({name});
+            return static_cast<int>(resources.size()) - 1;
+        }
+
+        // Dispatches the program over the invocations. uniforms sets per dispatch values such as
+        // the iteration of a solver, Program::setUniform does not need the program to be bound.
+        void dispatch(Program &program, glm::ivec3 invocations, std::vector<Access> reads, std::vector<Access> writes,
+                      std::function<void(Program &)> uniforms = {})
+        {
+            stages.push_back({&program, invocations, std::move(uniforms), {}, std::move(reads), std::move(writes)});
+        }
+
+        // Other GPU or host work, e.g. swapping buffers or a pass with its own dispatch logic.
+        // The graph makes the declared reads visible before and considers the program unbound after.
+        void call(std::vector<Access> reads, std::vector<Access> writes, std::function<void()> work)
+        {
+            stages.push_back({nullptr, glm::ivec3(0), {}, std::move(work), std::move(reads), std::move(writes)});
+        }
+
+        // Makes the writes visible to work outside of the graph, e.g. the following draw call
+        void consume(std::vector<Access> reads)
+        {
+            call(std::move(reads), {}, [] {});
+        }
+
+        void setElision(bool enabled) { elision = enabled; }
+
+        // Executes and clears all stages added since the last run
+        void run()
+        {
+            auto start = std::chrono::steady_clock::now();
+            statistics = Statistics();
+            statistics.elision = elision;
+            GLuint bound = 0;
+            for (auto &stage : stages)
+            {
+                GLbitfield bits = 0;
+                for (const Access &read : stage.reads)
+                {
+                    const auto &state = resources[read.resource];
+                    if (!elision || (state.written && !(state.flushed & read.barrier)))
+                        bits |= read.barrier;
+                }
+                for (const Access &write : stage.writes)
+                {
+                    const auto &state = resources[write.resource];
+                    if (!elision || (state.written && !(state.flushed & write.barrier)) || state.readEpoch == epoch)
+                        bits |= write.barrier;
+                }
+                if (bits != 0)
+                {
+                    glMemoryBarrier(bits);
+                    statistics.barriers++;
+                    epoch++;
+                    for (auto &state : resources)
+                        state.flushed |= bits;
+                }
+
+                if (stage.program != nullptr)
+                {
+                    if (stage.uniforms)
+                        stage.uniforms(*stage.program);
+                    if (!elision || bound != stage.program->getID())
+                    {
+                        bound = stage.program->getID();
+                        glUseProgram(bound);
+                        statistics.binds++;
+                    }
+                    stage.program->dispatchGroups(stage.program->groupsFor(stage.invocations));
+                    statistics.dispatches++;
+                }
+                else
+                {
+                    stage.work();
+                    bound = 0;
+                }
+
+                for (const Access &read : stage.reads)
+                    resources[read.resource].readEpoch = epoch;
+                for (const Access &write : stage.writes)
+                {
+                    resources[write.resource].written = true;
+                    resources[write.resource].flushed = 0;
+                }
+            }
+            glUseProgram(0);
+            stages.clear();
+            statistics.submitMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        const Statistics &getStatistics() const { return statistics; }
+
+    private:
+        struct Stage
+        {
+            Program *program;
+            glm::ivec3 invocations;
+            std::function<void(Program &)> uniforms;
+            std::function<void()> work;
+            std::vector<Access> reads;
+            std::vector<Access> writes;
+        };
+
+        struct Resource
+        {
+            std::string name;
+            bool written = false;  // Written by a stage since the graph exists
+            GLbitfield flushed = 0; // Barrier bits issued since the last write
+            int readEpoch = -1;     // Barrier epoch of the last read
+        };
+
+        std::vector<Resource> resources;
+        std::vector<Stage> stages;
+        int epoch = 0;
+        bool elision = true;
+        Statistics statistics;
+    };
+
+} // namespace gpu
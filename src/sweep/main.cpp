@@ -0,0 +1,301 @@
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <tinylogger/tinylogger.h>
+#include <glm/glm.hpp>
+
+#include "graphics/window.h"
+
+#include "../diagnostics.h"
+#include "../gpu.h"
+#include "../program.h"
+#include "../workgroups.h"
+
+#define ASSETS_PATH_RELATIVE "../assets"
+
+// Binding of the per instance parameter blocks, see smokeHeader.glsl
+#define INSTANCE_PARAMETERS_BINDING 27
+
+struct SweepParams {
+    glm::ivec3 gridResolution = glm::ivec3(32, 32, 64);
+    int totalIterations = 21;
+    glm::vec3 gravity = glm::vec3(0, 0, 9.81);
+    float dt = 1/120.f;
+    int steps = 200;
+    int report = 0; // Steps between metrics rows, 0 only reports the last step
+    std::string output; // CSV file of the metrics rows
+    // Every combination of the values below is simulated as one instance
+    std::vector<float> gridSpacings = {1.5f};
+    std::vector<float> overrelaxations = {0.91f};
+    std::vector<float> densities = {0.002f};
+};
+
+// Solver parameters of one instance, laid out like InstanceParameters of smokeHeader.glsl
+struct InstanceParameters {
+    float gridSpacing;
+    float overrelaxation;
+    float density;
+};
+static_assert(sizeof(InstanceParameters) == 12, "Has to match the std430 layout of the shader");
+
+static std::vector<std::string> split(const std::string &value, char delimiter)
+{
+    std::vector<std::string> parts;
+    std::stringstream stream(value);
+    std::string part;
+    while (std::getline(stream, part, delimiter))
+        parts.push_back(part);
+    return parts;
+}
+
+static std::vector<float> parseValues(const std::string &value)
+{
+    std::vector<float> values;
+    for (const auto &part : split(value, ','))
+        values.push_back(std::stof(part));
+    return values;
+}
+
+static SweepParams parseArguments(int argc, char **argv)
+{
+    SweepParams params;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--steps") {
+            params.steps = std::stoi(value);
+        } else if (arg == "--iterations") {
+            params.totalIterations = std::stoi(value);
+        } else if (arg == "--report") {
+            params.report = std::stoi(value);
+        } else if (arg == "--output") {
+            params.output = value;
+        } else if (arg == "--grid-spacing") {
+            params.gridSpacings = parseValues(value);
+        } else if (arg == "--overrelaxation") {
+            params.overrelaxations = parseValues(value);
+        } else if (arg == "--density") {
+            params.densities = parseValues(value);
+        } else if (arg == "--resolution") {
+            auto res = split(value, ',');
+            params.gridResolution = glm::ivec3(std::stoi(res.at(0)), std::stoi(res.at(1)), std::stoi(res.at(2)));
+        } else {
+            tlog::error() << "Unknown argument " << arg;
+            exit(EXIT_FAILURE);
+        }
+        i++;
+    }
+    return params;
+}
+
+static std::vector<InstanceParameters> sweepInstances(const SweepParams &params)
+{
+    std::vector<InstanceParameters> instances;
+    for (float gridSpacing : params.gridSpacings)
+        for (float overrelaxation : params.overrelaxations)
+            for (float density : params.densities)
+                instances.push_back({gridSpacing, overrelaxation, density});
+    return instances;
+}
+
+static void initGLEW()
+{
+    GLenum err = glewInit();
+    if (GLEW_OK != err)
+    {
+        tlog::error() << "Error: " << glewGetErrorString(err);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void initGLFW(graphics::Window &window)
+{
+    // The sweep only computes, so its window is never shown
+    glfwInit();
+    glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+    if (!window.init("3d-smoke-sweep", 1, 1))
+    {
+        exit(EXIT_FAILURE);
+    }
+    glfwMakeContextCurrent(window.getGLFWWindow());
+}
+
+static void setUniforms(gpu::Program &shader, const SweepParams &params)
+{
+    shader.bind();
+    shader.setUniform("gridResolution", glm::vec3(params.gridResolution));
+    shader.setUniform("domainOffset", glm::ivec3(0));
+    shader.setUniform("domainResolution", glm::vec3(params.gridResolution));
+    shader.setUniform("dt", params.dt);
+    shader.setUniform("gravity", params.gravity);
+    shader.setUniform("totalIterations", params.totalIterations);
+    shader.setUniform("reset", false);
+    shader.unbind();
+}
+
+int main(int argc, char **argv)
+{
+    tlog::info() << "Current working directory: " << std::filesystem::current_path();
+    tlog::info() << "Assets directory: " << ASSETS_PATH_RELATIVE;
+
+    auto params = parseArguments(argc, argv);
+    auto instances = sweepInstances(params);
+    int count = static_cast<int>(instances.size());
+
+    graphics::Window window;
+    initGLFW(window);
+    initGLEW();
+
+    // Compile shaders
+    const std::string smokeShaders = std::string(ASSETS_PATH_RELATIVE) + "/shader/smoke";
+    auto applyGravityShader = gpu::Program(smokeShaders + "/3d/applyGravity.comp");
+    auto forceIncompressibility = gpu::Program(smokeShaders + "/3d/forceIncompressibility.comp");
+    auto extrapolate = gpu::Program(smokeShaders + "/3d/extrapolate.comp");
+    auto advectVelocities = gpu::Program(smokeShaders + "/3d/advectVelocities.comp");
+    auto copyVelocityBuffer = gpu::Program(smokeShaders + "/3d/copyVelocityBuffer.comp");
+    auto advectSmoke = gpu::Program(smokeShaders + "/3d/advectSmoke.comp");
+    auto copySmokeBuffer = gpu::Program(smokeShaders + "/3d/copySmokeBuffer.comp");
+    auto diagnostics = gpu::Program(smokeShaders + "/3d/diagnostics.comp");
+    auto reduceDiagnostics = gpu::Program(smokeShaders + "/3d/reduceDiagnostics.comp");
+    const std::vector<gpu::Program *> programs = {&applyGravityShader, &forceIncompressibility, &extrapolate, &advectVelocities,
+                                                  &copyVelocityBuffer, &advectSmoke, &copySmokeBuffer, &diagnostics};
+
+    // All instances run in the same dispatches, stacked along z. Each one takes a multiple of
+    // the workgroup depth, so every workgroup of the diagnostics belongs to a single instance.
+    auto res = params.gridResolution;
+    glm::ivec3 localSize = gpu::defaultLocalSize;
+    int stride = (res.z + 1 + localSize.z - 1) / localSize.z * localSize.z;
+    const gpu::Defines batchDefines = {
+        {"GRID_X", std::to_string(res.x)},
+        {"GRID_Y", std::to_string(res.y)},
+        {"GRID_Z", std::to_string(res.z)},
+        {"VELOCITY_ADVECTION", "ADVECTION_SEMI_LAGRANGIAN"},
+        {"SMOKE_ADVECTION", "ADVECTION_SEMI_LAGRANGIAN"},
+        {"WARM_START", "0"},
+        {"INSTANCES", std::to_string(count)},
+        {"INSTANCE_STRIDE_Z", std::to_string(stride)},
+        // No SMOKE_VOLUME: without a renderer copySmokeBuffer.comp only copies the field and
+        // leaves image unit 2, which is never bound here, alone
+    };
+    for (auto *shader : programs)
+    {
+        auto defines = batchDefines;
+        defines.merge(gpu::localSizeDefines(localSize));
+        shader->specialize(defines);
+    }
+    auto batch = programs;
+    batch.push_back(&reduceDiagnostics);
+    gpu::buildPrograms(batch);
+    for (auto *shader : programs)
+    {
+        setUniforms(*shader, params);
+    }
+
+    // Every field buffer holds the grids of all instances one after another
+    GLsizeiptr uBytes = count * (res.x + 1) * res.y * res.z * sizeof(float);
+    GLsizeiptr vBytes = count * res.x * (res.y + 1) * res.z * sizeof(float);
+    GLsizeiptr wBytes = count * res.x * res.y * (res.z + 1) * sizeof(float);
+    GLsizeiptr cellBytes = count * res.x * res.y * res.z * sizeof(float);
+    std::vector<gpu::Buffer> fields;
+    fields.emplace_back(uBytes, 0);
+    fields.emplace_back(vBytes, 1);
+    fields.emplace_back(wBytes, 2);
+    fields.emplace_back(uBytes, 3);
+    fields.emplace_back(vBytes, 4);
+    fields.emplace_back(wBytes, 5);
+    fields.emplace_back(cellBytes, 6);
+    fields.emplace_back(cellBytes, 7);
+    fields.emplace_back(cellBytes, 8);
+    fields.emplace_back(cellBytes, 9);
+    for (int i = 0; i < 6; i++)
+        fields[i].clear(0.f);
+    for (int i = 6; i < 10; i++)
+        fields[i].clear(1.f);
+
+    gpu::Buffer instanceParameters(count * sizeof(InstanceParameters), INSTANCE_PARAMETERS_BINDING);
+    glNamedBufferSubData(instanceParameters.getID(), 0, instanceParameters.getSize(), instances.data());
+
+    // Staggered faces reach one past the last cell
+    auto invocations = glm::ivec3(res.x + 1, res.y + 1, count * stride);
+    auto cellInvocations = glm::ivec3(res.x, res.y, count * stride);
+
+    // The diagnostics write one partial per workgroup, those of an instance are contiguous
+    glm::ivec3 groups = diagnostics.groupsFor(cellInvocations);
+    int instanceGroups = groups.x * groups.y * (stride / localSize.z);
+    gpu::Buffer partials(static_cast<GLsizeiptr>(groups.x) * groups.y * groups.z * sizeof(gpu::SimulationMetrics),
+                         gpu::MetricsRing::partialsBinding);
+    gpu::Buffer results(count * sizeof(gpu::SimulationMetrics), gpu::MetricsRing::resultsBinding);
+
+    std::ofstream csv;
+    if (!params.output.empty())
+    {
+        csv.open(params.output);
+        csv << "instance,gridSpacing,overrelaxation,density,step,mass,maxDivergence,residual,maxSpeed,activeCells,fluidCells,centerHeight\n";
+    }
+
+    // Reduces the fields of every instance into its own result slot and reads them back
+    auto report = [&](int step)
+    {
+        diagnostics.dispatch(groups);
+        for (int instance = 0; instance < count; instance++)
+        {
+            reduceDiagnostics.setUniform("partialOffset", static_cast<unsigned>(instance * instanceGroups));
+            reduceDiagnostics.setUniform("partialCount", static_cast<unsigned>(instanceGroups));
+            reduceDiagnostics.setUniform("slot", static_cast<unsigned>(instance));
+            reduceDiagnostics.dispatch(glm::ivec3(1));
+        }
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        std::vector<gpu::SimulationMetrics> metrics(count);
+        results.read(metrics);
+
+        for (int instance = 0; instance < count; instance++)
+        {
+            const auto &p = instances[instance];
+            const auto &m = metrics[instance];
+            tlog::info() << "Step " << step << ", instance " << instance << " (spacing " << p.gridSpacing << ", overrelaxation "
+                         << p.overrelaxation << ", density " << p.density << "): mass " << m.mass << ", residual " << m.residual
+                         << ", max divergence " << m.maxDivergence << ", max speed " << m.maxSpeed << ", active cells "
+                         << m.activeCells;
+            if (csv.is_open())
+            {
+                csv << instance << "," << p.gridSpacing << "," << p.overrelaxation << "," << p.density << "," << step << ","
+                    << m.mass << "," << m.maxDivergence << "," << m.residual << "," << m.maxSpeed << "," << m.activeCells << ","
+                    << m.fluidCells << "," << m.centerHeight << "\n";
+            }
+        }
+    };
+
+    glFinish();
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < params.steps; step++)
+    {
+        applyGravityShader.dispatchFor(invocations);
+        for (int i = 0; i < 2 * params.totalIterations; i++)
+        {
+            forceIncompressibility.setUniform("currentIteration", i);
+            forceIncompressibility.dispatchFor(invocations);
+        }
+        extrapolate.dispatchFor(invocations);
+        advectVelocities.dispatchFor(invocations);
+        copyVelocityBuffer.dispatchFor(invocations);
+        advectSmoke.dispatchFor(invocations);
+        copySmokeBuffer.dispatchFor(invocations);
+
+        // Intermediate reports wait for the GPU and are part of the timing
+        if (params.report > 0 && (step + 1) % params.report == 0 && step + 1 < params.steps)
+            report(step + 1);
+    }
+    glFinish();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    report(params.steps);
+
+    tlog::info() << "Sweep: " << count << " instances of " << res.x << "x" << res.y << "x" << res.z << ", "
+                 << 1000.0 * seconds / params.steps << " ms/step, " << 1000.0 * seconds / (params.steps * count)
+                 << " ms per instance step";
+    return EXIT_SUCCESS;
+}
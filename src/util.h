@@ -1,9 +1,15 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <span>
 #include <vector>
 
 #include "graphics/mesh.h"
 
+#include "arena.h"
+
 namespace geometry
 {
     namespace quad2d
@@ -241,64 +247,130 @@ namespace perlin
         return interpolate(v1, v2, v3, v4, v5, v6, v7, v8, fade(fractPos));
     }
 
+    // Perlin noise whose lattice wraps every period cells, so it tiles seamlessly
+    inline float noisePerlin(const glm::vec3 &position, uint32_t seed, const glm::ivec3 &period)
+    {
+        glm::vec3 floorPos = glm::floor(position);
+        glm::vec3 fractPos = position - floorPos;
+
+        glm::ivec3 cell = glm::ivec3(floorPos);
+
+        auto corner = [&](const glm::ivec3 &offset)
+        {
+            glm::ivec3 wrapped = ((cell + offset) % period + period) % period;
+            return glm::dot(gradient(hash(glm::uvec3(wrapped), seed)), fractPos - glm::vec3(offset));
+        };
+
+        return interpolate(
+            corner({0, 0, 0}), corner({1, 0, 0}), corner({0, 1, 0}), corner({1, 1, 0}),
+            corner({0, 0, 1}), corner({1, 0, 1}), corner({0, 1, 1}), corner({1, 1, 1}),
+            fade(fractPos));
+    }
+
+    // Octaves of tileable Perlin noise over one tile, position in [0, 1). Octave i has
+    // round(frequency * lacunarity^i) lattice cells across the tile per axis, but at least two,
+    // since a single wrapped cell has the same gradient at all corners. Its lattice wraps with
+    // the tile. Octaves with less than two texels of the given resolution per cell are left
+    // out, the tile cannot represent them.
     inline float noisePerlin(
         glm::vec3 position,
         int octaveCount,
         float persistence,
         float lacunarity,
         float amplitude,
-        float scale,
+        glm::vec3 frequency,
+        glm::ivec3 resolution,
         uint32_t seed)
     {
         float m_amplitude = amplitude;
-        // Normalize
-        position /= scale;
         float value = 0.0f;
 
         for (int i = 0; i < octaveCount; i++)
         {
             uint32_t s = hash((uint32_t)i, seed);
+            glm::ivec3 cells = glm::max(glm::ivec3(glm::floor(frequency + 0.5f)), glm::ivec3(2));
+            if (glm::any(glm::greaterThan(2 * cells, resolution)))
+                break;
 
-            value += noisePerlin(position, s) * m_amplitude;
+            value += noisePerlin(position * glm::vec3(cells), s, cells) * m_amplitude;
 
             m_amplitude *= persistence;
-            position *= lacunarity;
+            frequency *= lacunarity;
         }
 
         return value;
     }
 
-    inline std::vector<glm::vec4> noiseFBM(
+    // Generator of the slices [begin, end) along z of one seamless fbm tile, x fastest, into
+    // values holding just these slices. The first octave of the finest of the four layers has features of about scale texels, the
+    // following layers are 2, 4 and 8 times coarser, each with its own seed.
+    inline auto fbmSlices(
         glm::ivec3 resolution,
         int octaveCount,
         float persistence,
         float lacunarity,
         float amplitude,
         float scale,
-        uint32_t seed,
-        const float period = 1.0)
+        uint32_t seed)
     {
-        const int gridSize = resolution.x * resolution.y * resolution.z;
-        std::vector<glm::vec4> values(gridSize);
-        for (int x = 0; x < resolution.x; ++x)
+        return [=](std::span<float> values, int begin, int end)
         {
-            for (int y = 0; y < resolution.y; ++y)
+            const glm::vec3 frequency = glm::vec3(resolution) / scale;
+            for (int z = begin; z < end; ++z)
             {
-                for (int z = 0; z < resolution.z; ++z)
+                for (int y = 0; y < resolution.y; ++y)
                 {
-                    glm::vec3 pos = {x, y, z};
-                    pos /= resolution;
-                    pos = glm::mod(pos, period);
-                    float fbm = 0.0f;
-                    fbm += 0.5f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, scale * 10.0f, seed);
-                    fbm += 0.25f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, scale * 20.0f, seed);
-                    fbm += 0.125f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, scale * 40.0f, seed);
-                    fbm += 0.0625f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, scale * 80.0f, seed);
-                    values[z * resolution.x * resolution.y + y * resolution.x + x] = glm::vec4(fbm);
+                    for (int x = 0; x < resolution.x; ++x)
+                    {
+                        glm::vec3 pos = {x, y, z};
+                        pos /= resolution;
+                        float fbm = 0.0f;
+                        fbm += 0.5f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, frequency, resolution, hash(0u, seed));
+                        fbm += 0.25f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, frequency / 2.0f, resolution, hash(1u, seed));
+                        fbm += 0.125f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, frequency / 4.0f, resolution, hash(2u, seed));
+                        fbm += 0.0625f * noisePerlin(pos, octaveCount, persistence, lacunarity, amplitude, frequency / 8.0f, resolution, hash(3u, seed));
+                        values[((z - begin) * resolution.y + y) * resolution.x + x] = fbm;
+                    }
                 }
             }
-        }
-        return values;
+        };
+    }
+
+    // Fills values with one seamless fbm tile in parallel slabs along z
+    inline void noiseFBM(
+        std::span<float> values,
+        glm::ivec3 resolution,
+        int octaveCount,
+        float persistence,
+        float lacunarity,
+        float amplitude,
+        float scale,
+        uint32_t seed)
+    {
+        auto slices = fbmSlices(resolution, octaveCount, persistence, lacunarity, amplitude, scale, seed);
+        size_t sliceSize = static_cast<size_t>(resolution.x) * resolution.y;
+        host::parallelRanges(resolution.z, [&](int begin, int end) { slices(values.subspan(begin * sliceSize, (end - begin) * sliceSize), begin, end); });
+    }
+
+    // Single octave, tileable noise volume with frequency lattice cells across the tile.
+    // Its energy sits in one narrow frequency band, so octaves of it can be layered as
+    // procedural detail without aliasing into the coarser frequencies.
+    inline void noiseBand(std::span<float> values, glm::ivec3 resolution, int frequency, uint32_t seed)
+    {
+        host::parallelRanges(resolution.z, [&](int begin, int end)
+        {
+            for (int z = begin; z < end; ++z)
+            {
+                for (int y = 0; y < resolution.y; ++y)
+                {
+                    for (int x = 0; x < resolution.x; ++x)
+                    {
+                        glm::vec3 pos = (glm::vec3(x, y, z) + 0.5f) / glm::vec3(resolution) * float(frequency);
+                        values[z * resolution.x * resolution.y + y * resolution.x + x] = noisePerlin(pos, seed, glm::ivec3(frequency));
+                    }
+                }
+            }
+        });
     }
 
 } // namespace perlin
@@ -306,82 +378,83 @@ namespace perlin
 namespace voronoi
 {
 
-    static float randomFloat()
-    {
-        return (float)(rand()) / (float)(RAND_MAX);
-    }
-
-    static std::vector<glm::vec4> createVoronoiNoise(const glm::ivec3 resolution, const glm::ivec3 gridRes, const float period = 1.0)
+    // Feature point offsets of a gridRes lattice, one per lattice cell, hashed from the seed so
+    // every platform draws the same points
+    static std::vector<glm::vec3> voronoiSamples(const glm::ivec3 gridRes, uint32_t seed)
     {
-        // Grid contains the center points
-        const int gridSize = gridRes.x * gridRes.y * gridRes.z;
-        const int texSize = resolution.x * resolution.y * resolution.z;
-        auto samples = std::vector<glm::vec3>(gridSize);
-        auto voronoiNoise = std::vector<glm::vec4>(texSize);
-        srand(time(0));
-        for (int i = 0; i < gridSize; ++i)
+        auto samples = std::vector<glm::vec3>(gridRes.x * gridRes.y * gridRes.z);
+        for (uint32_t i = 0; i < samples.size(); i++)
         {
-            samples[i].x = randomFloat();
-            samples[i].y = randomFloat();
-            samples[i].z = randomFloat();
+            for (uint32_t axis = 0; axis < 3; axis++)
+                samples[i][axis] = static_cast<float>(perlin::hash(glm::uvec3(i, gridRes.x, axis), seed)) / static_cast<float>(UINT32_MAX);
         }
+        return samples;
+    }
 
+    // Distance of a voxel to the closest feature point of the lattice, in lattice cells. The
+    // lattice wraps with the volume, neighbour cells beyond a face take the feature points of
+    // the opposite side, so the distances tile seamlessly.
+    static float voronoiDistance(const glm::vec3 pixel, const glm::ivec3 resolution, const glm::ivec3 gridRes,
+                                 const std::vector<glm::vec3> &samples)
+    {
         const glm::vec3 cellSize = glm::vec3(resolution) / glm::vec3(gridRes);
-        const glm::vec3 tileSize = glm::vec3(resolution) * period;
 
-        for (int x = 0; x < resolution.x; ++x)
+        // Maximum possible distance
+        float minDistance = glm::length(cellSize);
+        glm::ivec3 gridCell = glm::ivec3(pixel / cellSize);
+
+        for (int i = -1; i <= 1; ++i)
         {
-            for (int y = 0; y < resolution.y; ++y)
+            for (int j = -1; j <= 1; ++j)
             {
-                for (int z = 0; z < resolution.z; ++z)
+                for (int k = -1; k <= 1; ++k)
                 {
+                    glm::ivec3 cellIdx = gridCell + glm::ivec3{i, j, k};
+                    glm::ivec3 wrapped = (cellIdx % gridRes + gridRes) % gridRes;
 
-                    // Maximum possible distance
-                    float minDistance = glm::length(cellSize);
-                    glm::vec3 pixel = {x, y, z};
-                    glm::ivec3 gridCell = glm::ivec3(pixel / cellSize);
-
-                    for (int i = -1; i <= 1; ++i)
-                    {
-                        for (int j = -1; j <= 1; ++j)
-                        {
-                            for (int k = -1; k <= 1; ++k)
-                            {
-
-                                glm::vec3 cellIdx = gridCell + glm::ivec3{i, j, k};
-
-                                int idx = cellIdx.z * gridRes.x * gridRes.y + cellIdx.y * gridRes.x + cellIdx.x;
-                                if (idx >= 0 && idx < gridSize)
-                                {
-                                    glm::vec3 sample = (cellIdx + samples[idx]) * cellSize;
-                                    glm::vec3 diff = glm::mod(pixel, tileSize) - glm::mod(sample, tileSize);
-                                    float dist = glm::length(diff);
-                                    minDistance = glm::min(minDistance, dist);
-                                }
-                            }
-                        }
-                    }
-                    minDistance /= glm::length(glm::vec3(cellSize));
-
-                    voronoiNoise[z * resolution.x * resolution.y + y * resolution.x + x] = glm::vec4(minDistance, minDistance, minDistance, 1.0);
+                    int idx = wrapped.z * gridRes.x * gridRes.y + wrapped.y * gridRes.x + wrapped.x;
+                    glm::vec3 sample = (glm::vec3(cellIdx) + samples[idx]) * cellSize;
+                    float dist = glm::length(pixel - sample);
+                    minDistance = glm::min(minDistance, dist);
                 }
             }
         }
-        return voronoiNoise;
+        return minDistance / glm::length(glm::vec3(cellSize));
     }
 
-    inline std::vector<glm::vec4> composedVoronoiNoise(const glm::ivec3 voronoiResolution, const float c1, const float c2, const float c3, const float period = 1.0)
+    // Generator of the slices [begin, end) along z of the weighted sum of the distances to the
+    // feature points of a 4, 8 and 16 cell lattice, as one seamless tile, into values holding
+    // just these slices. All three layers are
+    // evaluated per voxel, so no intermediate volumes are allocated. The feature points are drawn
+    // from the seed once, when the generator is created.
+    inline auto composedVoronoiSlices(const glm::ivec3 voronoiResolution, const float c1, const float c2, const float c3, const uint32_t seed)
     {
-        auto voronoi4Noise = createVoronoiNoise(voronoiResolution, glm::ivec3(4), period);
-        auto voronoi8Noise = createVoronoiNoise(voronoiResolution, glm::ivec3(8), period);
-        auto voronoi16Noise = createVoronoiNoise(voronoiResolution, glm::ivec3(16), period);
-        auto voronoiNoise = std::vector<glm::vec4>(voronoiResolution.x * voronoiResolution.y * voronoiResolution.z);
-        for (int i = 0; i < voronoiNoise.size(); ++i)
+        return [=, samples4 = voronoiSamples(glm::ivec3(4), seed), samples8 = voronoiSamples(glm::ivec3(8), seed),
+                samples16 = voronoiSamples(glm::ivec3(16), seed)](std::span<float> values, int begin, int end)
         {
-            voronoiNoise[i] = c1 * voronoi4Noise[i] + c2 * voronoi8Noise[i] + c3 * voronoi16Noise[i];
-        }
+            const glm::ivec3 res = voronoiResolution;
+            for (int z = begin; z < end; ++z)
+            {
+                for (int y = 0; y < res.y; ++y)
+                {
+                    for (int x = 0; x < res.x; ++x)
+                    {
+                        glm::vec3 pixel = {x, y, z};
+                        values[((z - begin) * res.y + y) * res.x + x] = c1 * voronoiDistance(pixel, res, glm::ivec3(4), samples4)
+                                                                      + c2 * voronoiDistance(pixel, res, glm::ivec3(8), samples8)
+                                                                      + c3 * voronoiDistance(pixel, res, glm::ivec3(16), samples16);
+                    }
+                }
+            }
+        };
+    }
 
-        return voronoiNoise;
+    // Fills values with one seamless voronoi tile in parallel slabs along z
+    inline void composedVoronoiNoise(std::span<float> values, const glm::ivec3 voronoiResolution, const float c1, const float c2, const float c3, const uint32_t seed)
+    {
+        auto slices = composedVoronoiSlices(voronoiResolution, c1, c2, c3, seed);
+        size_t sliceSize = static_cast<size_t>(voronoiResolution.x) * voronoiResolution.y;
+        host::parallelRanges(voronoiResolution.z, [&](int begin, int end) { slices(values.subspan(begin * sliceSize, (end - begin) * sliceSize), begin, end); });
     }
 
 } // namespace voronoi
\ No newline at end of file
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <GL/glew.h>
+#include <glm/glm.hpp>
+#include <tinylogger/tinylogger.h>
+
+#include "program.h"
+
+namespace gpu
+{
+    // Workgroup shape used by kernels nobody tuned yet, the LOCAL_SIZE defaults of smokeHeader.glsl
+    inline const glm::ivec3 defaultLocalSize = glm::ivec3(8, 8, 16);
+
+    // Shapes the tuner benchmarks. All are powers of two, which the reduction in diagnostics.comp relies on.
+    inline const std::vector<glm::ivec3> localSizeCandidates = {
+        {8, 8, 16}, {8, 8, 8}, {8, 8, 4}, {16, 8, 8}, {16, 8, 4}, {16, 16, 4}, {32, 4, 4},
+        {32, 8, 2}, {32, 8, 4}, {64, 4, 2}, {64, 2, 2}, {4, 4, 32}, {4, 8, 16}, {16, 4, 8},
+    };
+
+    // Picks the fastest workgroup shape per kernel on this device and grid. Every candidate is
+    // built as its own program variant and timed with GL_TIME_ELAPSED queries. The winners are
+    // stored next to the program binaries, keyed by driver, kernel source path and specialization,
+    // so the next start reads them back instead of benchmarking again.
+    class WorkgroupTuner
+    {
+    public:
+        explicit WorkgroupTuner(std::filesystem::path file = programCacheDirectory / "workgroups.txt") : file(std::move(file))
+        {
+            std::ifstream stream(this->file);
+            std::string key;
+            glm::ivec3 size;
+            while (stream >> key >> size.x >> size.y >> size.z)
+                winners[key] = size;
+        }
+
+        // Tuned shape of the kernel under this specialization, the default when it was never tuned
+        glm::ivec3 get(const Program &program, const Defines &defines) const
+        {
+            auto it = winners.find(key(program, defines));
+            return it != winners.end() ? it->second : defaultLocalSize;
+        }
+
+        // Benchmarks every candidate the device supports on the current contents of the bound
+        // buffers, which the kernel overwrites. setup has to upload the uniforms of each freshly
+        // built variant. The program is left specialized with the winner.
+        glm::ivec3 tune(Program &program, const Defines &defines, glm::ivec3 invocations,
+                        const std::function<void(Program &)> &setup, int repetitions = 20)
+        {
+            glm::ivec3 maxSize;
+            GLint maxInvocations = 0;
+            for (int i = 0; i < 3; i++)
+                glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, i, &maxSize[i]);
+            glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+
+            GLuint query;
+            glGenQueries(1, &query);
+            glm::ivec3 best = get(program, defines);
+            uint64_t bestTime = std::numeric_limits<uint64_t>::max();
+            for (glm::ivec3 candidate : localSizeCandidates)
+            {
+                if (glm::any(glm::greaterThan(candidate, maxSize)) || candidate.x * candidate.y * candidate.z > maxInvocations)
+                    continue;
+
+                specialize(program, defines, candidate);
+                buildPrograms({&program});
+                if (program.getLocalSize() != candidate)
+                    continue; // Build failed, e.g. too much shared memory for this shape
+                setup(program);
+
+                // The first dispatch absorbs lazy driver work on the new program
+                program.dispatchFor(invocations);
+                glBeginQuery(GL_TIME_ELAPSED, query);
+                for (int i = 0; i < repetitions; i++)
+                    program.dispatchFor(invocations);
+                glEndQuery(GL_TIME_ELAPSED);
+                GLuint64 time = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &time);
+
+                if (time < bestTime)
+                {
+                    bestTime = time;
+                    best = candidate;
+                }
+            }
+            glDeleteQueries(1, &query);
+
+            specialize(program, defines, best);
+            buildPrograms({&program});
+            setup(program);
+            winners[key(program, defines)] = best;
+            tlog::info() << "Workgroup " << best.x << "x" << best.y << "x" << best.z << " for " << program.getPath()
+                         << ", " << bestTime / (1000.0 * repetitions) << " us/dispatch";
+            return best;
+        }
+
+        void save() const
+        {
+            std::error_code error;
+            std::filesystem::create_directories(file.parent_path(), error);
+            std::ofstream stream(file);
+            for (const auto &[key, size] : winners)
+                stream << key << " " << size.x << " " << size.y << " " << size.z << "\n";
+        }
+
+        // Specializes the program with the defines and the given workgroup shape
+        static void specialize(Program &program, const Defines &defines, glm::ivec3 localSize)
+        {
+            Defines specialization = defines;
+            for (auto &[name, value] : localSizeDefines(localSize))
+                specialization[name] = value;
+            program.specialize(specialization);
+        }
+
+    private:
+        static std::string key(const Program &program, const Defines &defines)
+        {
+            static const std::string driver = driverString();
+            std::string text = program.getPath();
+            for (const auto &[name, value] : defines)
+                text += "\n" + name + "=" + value;
+            std::stringstream key;
+            key << std::hex << hashString(text, hashString(driver));
+            return key.str();
+        }
+
+        std::filesystem::path file;
+        std::map<std::string, glm::ivec3> winners;
+    };
+
+} // namespace gpu